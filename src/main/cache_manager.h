@@ -0,0 +1,460 @@
+#ifndef __CACHE_MANAGER_H__
+#define __CACHE_MANAGER_H__
+
+/**
+ * This file contains the cache manager for the volunteer shared directory.
+ * Every input downloaded and every output produced by a task stays in the
+ * shared directory (so that it can be seeded to other volunteers). Without
+ * a cache manager, this directory grows forever.
+ * The cache manager keeps an index file (inside the shared directory) with
+ * one line per cached file and evicts files when the byte budget is exceeded.
+ * Several processes (tasks, their seeders and the host agent) share the
+ * index: it is read and written under a lock file, and every write merges the
+ * changes made by this process into the current index.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include <map>
+#include <set>
+#include <string>
+
+using std::map;
+using std::set;
+using std::string;
+
+// Name of the index file (hidden files are never cached themselves).
+#define CACHE_INDEX_FILE ".cache_index"
+// Lock file serializing index updates.
+#define CACHE_LOCK_FILE ".cache_lock"
+// Default byte budget (4 GB).
+#define CACHE_DEFAULT_BUDGET (4LL*1024*1024*1024)
+// A job with no accesses for this long is assumed complete (seconds). It
+// matches the work unit delay bound used by the work generator.
+#define CACHE_JOB_TTL 86400
+
+/**
+ * A cached file. The name is a file name (NOT PATH) inside the shared
+ * directory. The respective .torrent and fast-resume files are evicted along
+ * with the file.
+ */
+struct CacheEntry {
+	/**
+	 * File size (bytes).
+	 */
+	long long size;
+	/**
+	 * Last time (seconds since epoch) this file was used by a task.
+	 */
+	time_t last_access;
+	/**
+	 * True if the task that needed this file is already done (the file is
+	 * only kept to seed other volunteers).
+	 */
+	bool consumed;
+	/**
+	 * Info-hash (hex) of the torrent describing this file (empty if unknown).
+	 */
+	string hash;
+};
+
+/**
+ * Returns the job identifier of a cached file.
+ * Note: file names follow the format: id-[map|reduce]-seq.number[-partition]
+ */
+string cache_job_id(const string& name) {
+	return name.substr(0, name.find('-'));
+}
+
+/**
+ * Returns the file name (NOT PATH) of a cached file.
+ */
+string cache_file_name(const string& path) {
+	return path.substr(path.find_last_of('/') + 1);
+}
+
+/**
+ * Returns true if a file is a companion file (a .torrent or a fast-resume
+ * file) of some cached file.
+ */
+bool cache_companion(const char* name) {
+	size_t len = strlen(name);
+	return (len > 8 && !strcmp(name + len - 8, ".torrent")) ||
+		   (len > 7 && !strcmp(name + len - 7, ".resume"));
+}
+
+/**
+ * Returns the size of a file (or -1 if the file is not accessible). The size
+ * of a directory (multi-file torrent) is the size of the files inside it.
+ */
+long long cache_file_size(const string& path) {
+	struct stat buffer;
+	long long total = 0, size;
+	DIR* dir;
+	if (stat(path.c_str(), &buffer)) { return -1; }
+	if (!S_ISDIR(buffer.st_mode)) { return buffer.st_size; }
+	if((dir = opendir(path.c_str())) == NULL) { return -1; }
+	for(struct dirent* dp = readdir(dir); dp != NULL; dp = readdir(dir)) {
+		if(dp->d_name[0] == '.') { continue; }
+		if((size = cache_file_size(path + "/" + dp->d_name)) > 0) { total += size; }
+	}
+	closedir(dir);
+	return total;
+}
+
+/**
+ * CacheManager implements a size-capped cache over the shared directory.
+ * Eviction order is:
+ * 1) files of jobs that are assumed complete (no access for CACHE_JOB_TTL);
+ * 2) files already consumed by a local task;
+ * 3) all other files.
+ * Within each class, the least recently used file goes first.
+ */
+class CacheManager {
+
+protected:
+	/**
+	 * Directory being managed.
+	 */
+	string shared_dir;
+	/**
+	 * Maximum number of bytes stored in the shared directory.
+	 */
+	long long budget;
+	/**
+	 * Cached files, indexed by name.
+	 */
+	map<string, CacheEntry> entries;
+	/**
+	 * Last access (seconds since epoch) per job identifier.
+	 */
+	map<string, time_t> job_access;
+	/**
+	 * Entries changed (touched, consumed or evicted) by this process since
+	 * the index was last read.
+	 */
+	set<string> changed;
+
+	/**
+	 * Returns the eviction class of an entry (lower classes go first).
+	 */
+	int eviction_class(const string& name, const CacheEntry& ce, time_t now) {
+		if (now - this->job_access[cache_job_id(name)] > CACHE_JOB_TTL)
+		{ return 0; }
+		return ce.consumed ? 1 : 2;
+	}
+
+	/**
+	 * Takes the index lock (LOCK_SH or LOCK_EX). Returns the lock file
+	 * descriptor (or -1 if the lock file can't be opened, in which case the
+	 * index is used unlocked).
+	 */
+	int lock(int operation) {
+		int fd = open((this->shared_dir + CACHE_LOCK_FILE).c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0) {
+	        fprintf(stderr,
+	        		"[CM-lock] failed to open lock file %s%s.\n",
+	        		this->shared_dir.c_str(),
+	        		CACHE_LOCK_FILE);
+			return -1;
+		}
+		while (flock(fd, operation) && errno == EINTR) {}
+		return fd;
+	}
+
+	void unlock(int fd) { if (fd >= 0) { close(fd); } }
+
+	/**
+	 * Reads the index file into 'index'. Entries whose files no longer exist
+	 * are dropped.
+	 */
+	void read_index(map<string, CacheEntry>& index) {
+		FILE* f;
+		char line[512], name[256], hash[64];
+		long long size;
+		long access;
+		int consumed;
+
+		index.clear();
+		if(!(f = fopen((this->shared_dir + CACHE_INDEX_FILE).c_str(), "r"))) { return; }
+		while (fgets(line, sizeof(line), f)) {
+			// The info-hash column is optional.
+			hash[0] = '\0';
+			if (sscanf(line, "%255s %lld %ld %d %63s",
+					name, &size, &access, &consumed, hash) < 4) { continue; }
+			if (cache_file_size(this->shared_dir + name) < 0) { continue; }
+			CacheEntry& ce = index[name];
+			ce.size = size;
+			ce.last_access = access;
+			ce.consumed = consumed;
+			ce.hash = hash;
+		}
+		fclose(f);
+	}
+
+	/**
+	 * Adds the files found in the shared directory but missing in the index
+	 * (e.g. written by a concurrent task) using their modification time.
+	 * Per job accesses are rebuilt.
+	 */
+	void add_untracked() {
+		DIR* dir;
+
+		if((dir = opendir(this->shared_dir.c_str())) != NULL) {
+			for(struct dirent* dp = readdir(dir); dp != NULL; dp = readdir(dir)) {
+				struct stat buffer;
+				string path = this->shared_dir + dp->d_name;
+				if(dp->d_name[0] == '.') { continue; }
+				if(cache_companion(dp->d_name)) { continue; }
+				if(this->entries.count(dp->d_name)) { continue; }
+				if(stat(path.c_str(), &buffer)) { continue; }
+				CacheEntry& ce = this->entries[dp->d_name];
+				ce.size = cache_file_size(path);
+				ce.last_access = buffer.st_mtime;
+				ce.consumed = false;
+			}
+			closedir(dir);
+		}
+
+		this->job_access.clear();
+		for(map<string, CacheEntry>::iterator it = this->entries.begin();
+				it != this->entries.end();
+				++it) {
+			time_t& ja = this->job_access[cache_job_id(it->first)];
+			if (it->second.last_access > ja) { ja = it->second.last_access; }
+		}
+	}
+
+	/**
+	 * Re-reads the index and applies the changes made by this process on
+	 * top of it (the lock must be held).
+	 */
+	void merge() {
+		map<string, CacheEntry> index;
+		set<string>::iterator it;
+
+		this->read_index(index);
+		for(it = this->changed.begin(); it != this->changed.end(); ++it) {
+			map<string, CacheEntry>::iterator eit = this->entries.find(*it);
+			if (eit == this->entries.end()) { index.erase(*it); }
+			else { index[*it] = eit->second; }
+		}
+		this->entries.swap(index);
+		this->add_untracked();
+		this->changed.clear();
+	}
+
+	/**
+	 * Writes the index file (the lock must be held). A temporary file is
+	 * renamed over the old index so that a crash never leaves a half written
+	 * index behind.
+	 */
+	int write_index() {
+		string index = this->shared_dir + CACHE_INDEX_FILE;
+		string tmp = index + ".tmp";
+		FILE* f;
+
+		if(!(f = fopen(tmp.c_str(), "w"))) {
+	        fprintf(stderr,
+	        		"[CM-save] failed to open file %s.\n",
+	        		tmp.c_str());
+	        return 1;
+		}
+		for(map<string, CacheEntry>::iterator it = this->entries.begin();
+				it != this->entries.end();
+				++it) {
+			fprintf(f, "%s %lld %ld %d %s\n",
+					it->first.c_str(),
+					it->second.size,
+					(long)it->second.last_access,
+					it->second.consumed,
+					it->second.hash.c_str());
+		}
+		fclose(f);
+		return rename(tmp.c_str(), index.c_str());
+	}
+
+public:
+	CacheManager(string shared_dir, long long budget) :
+		shared_dir(shared_dir),
+		budget(budget) {}
+
+	void setBudget(long long new_budget) { this->budget = new_budget; }
+	long long getBudget() { return this->budget; }
+
+	/**
+	 * Loads the index file. Entries whose files no longer exist are dropped.
+	 * Files found in the shared directory but missing in the index are added
+	 * (see add_untracked).
+	 */
+	int load() {
+		int fd = this->lock(LOCK_SH);
+		this->read_index(this->entries);
+		this->unlock(fd);
+		this->changed.clear();
+		this->add_untracked();
+		return 0;
+	}
+
+	/**
+	 * Writes the changes made by this process into the index file (changes
+	 * made meanwhile by other processes are kept). The entries are refreshed
+	 * with the current index.
+	 */
+	int save() {
+		int fd = this->lock(LOCK_EX);
+		this->merge();
+		int ret = this->write_index();
+		this->unlock(fd);
+		return ret;
+	}
+
+	/**
+	 * Returns the name of the cache entry holding a file. Files inside a
+	 * directory of the shared directory (multi-file torrents) belong to the
+	 * entry of that directory.
+	 * Note: path may be either a PATH or a file name.
+	 */
+	string entry_name(const string& path) {
+		if (path.compare(0, this->shared_dir.size(), this->shared_dir))
+		{ return cache_file_name(path); }
+		string name = path.substr(this->shared_dir.size());
+		return name.substr(0, name.find('/'));
+	}
+
+	/**
+	 * Registers an access to a file (adding it to the cache if needed). The
+	 * info-hash (hex) of the respective torrent is recorded if given.
+	 * Note: path may be either a PATH or a file name.
+	 */
+	void touch(const string& path, const string& hash = "") {
+		string name = this->entry_name(path);
+		long long size = cache_file_size(this->shared_dir + name);
+		time_t now = time(NULL);
+		if (size < 0) { return; }
+		CacheEntry& ce = this->entries[name];
+		ce.size = size;
+		ce.last_access = now;
+		ce.consumed = false;
+		if (!hash.empty()) { ce.hash = hash; }
+		this->job_access[cache_job_id(name)] = now;
+		this->changed.insert(name);
+	}
+
+	/**
+	 * Searches for a cached file by info-hash (hex). Returns the file name
+	 * or an empty string if there is no such file.
+	 */
+	string lookup(const string& hash) {
+		for(map<string, CacheEntry>::iterator it = this->entries.begin();
+				it != this->entries.end();
+				++it) { if (it->second.hash == hash) { return it->first; } }
+		return string();
+	}
+
+	/**
+	 * Returns true if a file is cached.
+	 */
+	bool cached(const string& name) { return this->entries.count(name) > 0; }
+
+	/**
+	 * Marks a file as consumed (the local task that needed it is done).
+	 */
+	void consume(const string& path) {
+		map<string, CacheEntry>::iterator it =
+				this->entries.find(this->entry_name(path));
+		if (it != this->entries.end()) {
+			it->second.consumed = true;
+			this->changed.insert(it->first);
+		}
+	}
+
+	/**
+	 * Returns true if a file is cached and its job is still running (i.e.,
+	 * the file is still worth seeding).
+	 */
+	bool useful(const string& name) {
+		map<string, CacheEntry>::iterator it = this->entries.find(name);
+		if (it == this->entries.end()) { return false; }
+		return this->eviction_class(it->first, it->second, time(NULL)) != 0;
+	}
+
+	/**
+	 * Returns the number of bytes currently cached.
+	 */
+	long long used() {
+		long long total = 0;
+		for(map<string, CacheEntry>::iterator it = this->entries.begin();
+				it != this->entries.end();
+				++it) { total += it->second.size; }
+		return total;
+	}
+
+	/**
+	 * Evicts files until the cache fits into the byte budget. Files of jobs
+	 * assumed complete are always evicted. Eviction works on the current index
+	 * (under the lock), which is written back. Returns the number of evicted
+	 * files.
+	 */
+	int evict() {
+		int fd = this->lock(LOCK_EX);
+		this->merge();
+		long long total = this->used();
+		time_t now = time(NULL);
+		int evicted = 0;
+
+		while(this->entries.size()) {
+			map<string, CacheEntry>::iterator it, victim = this->entries.end();
+			int victim_class = 3;
+			// Pick the least recently used entry of the lowest class.
+			for(it = this->entries.begin(); it != this->entries.end(); ++it) {
+				int c = this->eviction_class(it->first, it->second, now);
+				if (c < victim_class ||
+						(c == victim_class &&
+						 it->second.last_access < victim->second.last_access)) {
+					victim = it;
+					victim_class = c;
+				}
+			}
+			if (victim_class != 0 && total <= this->budget) { break; }
+#if DEBUG
+			debug_log("[CM-evict]", "evicting:", victim->first.c_str());
+#endif
+			this->remove(victim->first);
+			total -= victim->second.size;
+			this->entries.erase(victim);
+			evicted++;
+		}
+		this->write_index();
+		this->unlock(fd);
+		return evicted;
+	}
+
+	/**
+	 * Removes a cached file (or directory) and all its companion files from
+	 * disk.
+	 */
+	void remove(const string& name) {
+		string path = this->shared_dir + name;
+		DIR* dir;
+		if((dir = opendir(path.c_str())) != NULL) {
+			for(struct dirent* dp = readdir(dir); dp != NULL; dp = readdir(dir))
+			{ if(dp->d_name[0] != '.') { unlink((path + "/" + dp->d_name).c_str()); } }
+			closedir(dir);
+			rmdir(path.c_str());
+		}
+		else { unlink(path.c_str()); }
+		unlink((this->shared_dir + name + ".torrent").c_str());
+		unlink((this->shared_dir + name + ".resume").c_str());
+	}
+};
+
+#endif /* CACHE_MANAGER_H_ */
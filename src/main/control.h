@@ -14,6 +14,22 @@
 #define STANDALONE 	0
 #define DEBUG		1
 #define BITTORRENT  1
+/**
+ * Compilation flag to merge reduce inputs as soon as each one is downloaded.
+ */
+#define INCREMENTAL_REDUCE 1
+/**
+ * Compilation flag to delegate BitTorrent transfers to the host agent
+ * (util/bt/bt_agent) instead of running one session per task. The agent
+ * must be shipped as a file of the app version (logical name "bt_agent").
+ */
+#define BT_AGENT 0
+/**
+ * Compilation flag to publish all outputs of a map task as one multi-file
+ * torrent (reducers only download their own partition file). The work
+ * generator hands this torrent to every reducer (see mr_shuffle.h).
+ */
+#define MAP_SINGLE_TORRENT 0
 
 #include <stdio.h>
 #include <unistd.h>
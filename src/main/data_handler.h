@@ -3,23 +3,69 @@
 
 #include <stdio.h>
 #include <wait.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <vector>
 #include <list>
+#include <deque>
+#include <set>
 #include <string>
+#include <algorithm>
 
 #include "libtorrent/entry.hpp"
 #include "libtorrent/bencode.hpp"
 #include "libtorrent/session.hpp"
+#include "libtorrent/alert_types.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/file.hpp"
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/escape_string.hpp"
 #include "libtorrent/create_torrent.hpp"
 
+#include "cache_manager.h"
+#include "piece_size.h"
+#include "piece_hasher.h"
+
 using std::vector;
 using std::list;
+using std::deque;
+using std::set;
 using std::string;
 
+/**
+ * Callback used by the incremental input mode (see get_incremental_input).
+ * It receives the path of an input file that just became available and some
+ * caller specific data.
+ */
+typedef void (*input_ready_func)(const string& path, void* args);
+
+/**
+ * Function used to receive zipped inputs that did not exist when the task was
+ * created (reduce slow-start, see simple_work_generator.cpp). New .torrent
+ * files are written into the working directory 'wdir' and their paths are
+ * placed into 'torrents'.
+ */
+typedef void (*late_input_func)(const string& wdir, vector<string>& torrents, unsigned int& expected);
+
 // Auxiliary buffer for some C I/O operations.
 char dh_buf[1024];
 
+// Session state file (inside the shared directory).
+#define SESSION_STATE_FILE ".session_state"
+// Suffix of fast-resume files (inside the shared directory).
+#define RESUME_FILE_SUFFIX ".resume"
+// Unix socket of the host BitTorrent agent (inside the shared directory).
+#define AGENT_SOCKET_FILE ".agent.sock"
+// Lock held by the running agent (only one agent per shared directory).
+#define AGENT_LOCK_FILE ".agent.lock"
+// Lock held by tasks while they start an agent.
+#define AGENT_START_LOCK_FILE ".agent_start.lock"
+
 /**
  * Auxiliary function that handles child processes. It waits until child process
  * completion and checks for errors.
@@ -164,9 +210,24 @@ int init_dir(string dir) {
 /**
  * Auxiliary function that is used as a predicate to check if a torrent has
  * finished downloading or not.
+ * Note: only selected files (priority above zero) need to be done. The
+ * finished flag of the torrent status is not enough: right after a file is
+ * selected on a finished torrent (see add_torrent), the status may still
+ * report the torrent as finished. The selected files are checked instead.
  */
-bool torrent_done (const libtorrent::torrent_handle& t)
-{ return t.status().is_seeding; }
+bool torrent_done (const libtorrent::torrent_handle& t) {
+	vector<int> priorities;
+	vector<libtorrent::size_type> progress;
+	if (!t.is_valid() || !t.status().is_finished) { return false; }
+	priorities = t.file_priorities();
+	t.file_progress(progress, libtorrent::torrent_handle::piece_granularity);
+	const libtorrent::torrent_info& ti = t.get_torrent_info();
+	for(int i = 0; i < ti.num_files(); i++) {
+		if (ti.file_at(i).pad_file || priorities[i] <= 0) { continue; }
+		if (progress[i] < ti.file_at(i).size) { return false; }
+	}
+	return true;
+}
 
 /**
  * Auxiliary function that is used as a predicato to check if a file is
@@ -178,14 +239,258 @@ bool file_ready (const string& s) {
 }
 
 /**
- * Auxiliary function that is used as a predicate and detected hidden files.
+ * Adds a file, or every (non hidden) file of a directory, to a file storage.
+ * Directory entries are added in name order: readdir order depends on the
+ * file system and every replica of a task must produce the same torrent.
+ * Note: only flat directories (such as map output directories) are supported.
  */
-bool file_filter(string const& f) {
-	if (libtorrent::filename(f)[0] == '.') return false;
-	fprintf(stderr, "%s\n", f.c_str());
+int add_files_sorted(libtorrent::file_storage& fs, const string& full_path) {
+	struct stat buffer;
+	vector<string> names;
+	vector<string>::iterator vit;
+	DIR* dir;
+
+	if (stat(full_path.c_str(), &buffer)) { return 1; }
+	if (!S_ISDIR(buffer.st_mode)) {
+		fs.add_file(libtorrent::filename(full_path), buffer.st_size);
+		return 0;
+	}
+	if((dir = opendir(full_path.c_str())) == NULL) { return 1; }
+	for(struct dirent* dp = readdir(dir); dp != NULL; dp = readdir(dir))
+	{ if(dp->d_name[0] != '.') { names.push_back(dp->d_name); } }
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	for(vit = names.begin(); vit != names.end(); vit++) {
+		if (stat((full_path + "/" + *vit).c_str(), &buffer)) { return 1; }
+		fs.add_file(libtorrent::filename(full_path) + "/" + *vit, buffer.st_size);
+	}
+	return 0;
+}
+
+/**
+ * Creates a torrent file ("output_torrent") representing the contents of
+ * "output_file" (a file or a directory). The tracker "tracker_url" is added.
+ * If pad is set, every file is piece aligned using pad files (so that each
+ * file can be downloaded and checked on its own). The piece size depends on the
+ * size of the contents and on the expected number of downloaders (see
+ * choose_piece_size). The result only depends on the contents (creation date
+ * and file order are fixed), so replicas of a task publish the same info-hash
+ * (see simple_validator.cpp). See documentation in
+ * http://www.rasterbar.com/products/libtorrent/make_torrent.html
+ */
+int make_torrent_file(
+		string output_file,
+		string output_torrent,
+		string tracker_url,
+		bool pad = false,
+		int downloaders = 1) {
+	libtorrent::file_storage fs;
+	int flags = 0, piece_size = 0, pad_file_limit = -1;
+	string full_path = libtorrent::complete(output_file);
+
+	if (pad) {
+		pad_file_limit = 0;
+		flags |= libtorrent::create_torrent::optimize;
+	}
+
+	add_files_sorted(fs, full_path);
+	if (fs.num_files() == 0) {
+        fprintf(stderr,
+        		"[DH-make_torrent_file] failed to add file %s\n",
+        		output_file.c_str());
+		return 1;
+	}
+
+	piece_size = choose_piece_size(fs.total_size(), downloaders);
+	libtorrent::create_torrent t(fs, piece_size, pad_file_limit, flags);
+	t.add_tracker(tracker_url);
+
+	// One hashing thread: a task must not use more cores than BOINC
+	// scheduled it for (the app version is single threaded).
+	if (hash_pieces_parallel(t, libtorrent::parent_path(full_path), 1)) {
+        fprintf(stderr,
+        		"[DH-make_torrent_file] failed to hash file %s\n",
+        		output_file.c_str());
+		return 1;
+	}
+
+	t.set_creator("freeCycles-wrapper (using libtorrent)");
+
+	// create the torrent
+	libtorrent::entry e = t.generate();
+	// hack to change creation date (needs to be the same for all .torrents files)
+	e.dict()["creation date"] = 0;
+
+	std::vector<char> torrent;
+	bencode(back_inserter(torrent), e);
+
+	FILE* output = fopen(output_torrent.c_str(), "wb+");
+	if (output == NULL)	{
+        fprintf(stderr,
+        		"[DH-make_torrent_file] failed to open file %s: (%d) %s\n",
+        		output_torrent.c_str(),
+        		errno,
+        		strerror(errno));
+		return 1;
+	}
+	fwrite(&torrent[0], 1, torrent.size(), output);
+	fclose(output);
+	return 0;
+}
+
+/**
+ * Creates one multi-file torrent ("output_torrent") with all outputs of a map
+ * task (inside "output_dir", see MAP_SINGLE_TORRENT) and copies it into
+ * "shared_torrent" (to be seeded). Returns zero on success.
+ */
+int make_task_torrent(
+		const string& output_dir,
+		const string& output_torrent,
+		const string& shared_torrent,
+		const string& tracker_url,
+		int downloaders) {
+	// Files are piece aligned so that each partition can be fetched alone.
+	if (make_torrent_file(
+			output_dir, output_torrent, tracker_url, true, downloaders)) {
+		return 1;
+	}
+	if (copy_file(output_torrent, shared_torrent)) {
+        fprintf(stderr,
+        		"[DH-make_task_torrent] failed to copy %s\n",
+        		output_torrent.c_str());
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Returns the info-hash (hex) of a torrent handle.
+ */
+string info_hash_hex(const libtorrent::torrent_handle& th)
+{ return libtorrent::to_hex(th.info_hash().to_string()); }
+
+/**
+ * Returns the info-hash (hex) of a .torrent file (or an empty string if the
+ * file cannot be loaded).
+ */
+string info_hash_hex(const string& torrent) {
+	libtorrent::error_code ec;
+	libtorrent::torrent_info ti(torrent, ec);
+	if (ec) { return string(); }
+	return libtorrent::to_hex(ti.info_hash().to_string());
+}
+
+/**
+ * Returns the partition (reducer index) handled by a task.
+ * Note: Task names follow the format: id-[map|reduce]-seq.number
+ */
+int task_partition(const string& wu_name)
+{ return atoi(wu_name.substr(wu_name.rfind('-') + 1).c_str()); }
+
+/**
+ * Returns the index of the file that holds a given partition inside a
+ * multi-file map output torrent (or -1 if there is no such file).
+ * Note: partition files are named <map task name>-<partition>.
+ */
+int partition_file(const libtorrent::torrent_info& ti, int partition) {
+	char suffix[16];
+	sprintf(suffix, "-%d", partition);
+	for(int i = 0; i < ti.num_files(); i++) {
+		libtorrent::file_entry fe = ti.file_at(i);
+		if (!fe.pad_file && ends_with(fe.path, suffix)) { return i; }
+	}
+	return -1;
+}
+
+/**
+ * Checks every piece of a torrent file against a local file. The file must
+ * start at a piece boundary and may only share its last piece with padding
+ * (which is the case for single file torrents and for padded torrents).
+ */
+bool verify_file(
+		const libtorrent::torrent_info& ti,
+		int index,
+		const string& path) {
+	libtorrent::file_entry fe = ti.file_at(index);
+	vector<char> buf(ti.piece_length());
+	libtorrent::size_type left = fe.size;
+	FILE* f;
+	int piece, size, read;
+
+	if (fe.offset % ti.piece_length()) { return false; }
+	if (!(f = fopen(path.c_str(), "rb"))) { return false; }
+	for(piece = fe.offset / ti.piece_length(); left > 0; piece++) {
+		size = ti.piece_size(piece);
+		read = left < size ? (int)left : size;
+		if (fread(&buf[0], 1, read, f) != (size_t)read) { break; }
+		// The rest of the last piece is a pad file (zeros).
+		memset(&buf[0] + read, 0, size - read);
+		if (libtorrent::hasher(&buf[0], size).final() != ti.hash_for_piece(piece))
+		{ break; }
+		left -= read;
+	}
+	fclose(f);
+	return left == 0;
+}
+
+/**
+ * Searches the shared directory for a local copy of the file described by
+ * a .torrent (or of one partition, for multi-file map output torrents). The
+ * search is keyed by info-hash (using the cache index). Files indexed with an
+ * info-hash were complete when indexed (only their size is checked); other
+ * files with the same name must pass a full piece check.
+ * On success, the local PATH is placed into 'input' (no torrent needs to be
+ * started, no tracker is contacted).
+ */
+bool find_local_copy(
+		const string& torrent,
+		const string& shared_dir,
+		CacheManager& cache,
+		string& input,
+		int partition = -1) {
+	libtorrent::error_code ec;
+	libtorrent::torrent_info ti(torrent, ec);
+	libtorrent::file_entry fe;
+	string hash, path;
+	int index;
+	bool verified;
+
+	if (ec) { return false; }
+	if (partition < 0 && ti.num_files() != 1) { return false; }
+	if ((index = partition < 0 ? 0 : partition_file(ti, partition)) < 0)
+	{ return false; }
+	fe = ti.file_at(index);
+	hash = libtorrent::to_hex(ti.info_hash().to_string());
+	verified = cache.lookup(hash) == ti.name();
+	path = shared_dir + fe.path;
+	if (cache_file_size(path) != fe.size) { return false; }
+	if (!verified && !verify_file(ti, index, path)) { return false; }
+#if DEBUG
+	debug_log("[DH-find_local_copy]", "local copy found:", path.c_str());
+#endif
+	cache.touch(ti.name(), hash);
+	input = path;
 	return true;
 }
 
+/**
+ * Returns the PATH of the input described by a .torrent (once downloaded
+ * into the shared directory). For multi-file map output torrents, it is the
+ * path of the file holding the given partition.
+ */
+string torrent_input_path(
+		const string& torrent,
+		const string& shared_dir,
+		int partition = -1) {
+	libtorrent::error_code ec;
+	libtorrent::torrent_info ti(torrent, ec);
+	int index;
+	if (ec) { return string(); }
+	if (partition < 0 || (index = partition_file(ti, partition)) < 0)
+	{ return shared_dir + ti.name(); }
+	return shared_dir + ti.file_at(index).path;
+}
+
 /**
  * This implementation assumes that there is only one input file and only one
  * output file. The file paths can be resolved using BOINC API since they have
@@ -200,6 +505,47 @@ protected:
 	string input_path;
 	string output_path;
 	string working_dir;
+	/**
+	 * Source of late inputs (NULL if not supported) and total number of input
+	 * files expected (0 if the zipped input is complete, see
+	 * read_expected_inputs).
+	 */
+	late_input_func late_inputs;
+	unsigned int expected_inputs;
+
+	/**
+	 * True while late inputs are expected ('received' input files were handed
+	 * over so far).
+	 */
+	bool waiting_late_inputs(size_t received)
+	{ return this->late_inputs != NULL && received < this->expected_inputs; }
+
+	/**
+	 * Places the late .torrent files received since the last call into
+	 * 'torrents'. Files already in 'known' (by name) are ignored.
+	 */
+	void get_late_inputs(set<string>& known, vector<string>& torrents) {
+		vector<string> late;
+		vector<string>::iterator vit;
+		this->late_inputs(this->working_dir, late, this->expected_inputs);
+		for(vit = late.begin(); vit != late.end(); vit++) {
+			if (known.insert(vit->substr(vit->rfind('/') + 1)).second)
+			{ torrents.push_back(*vit); }
+		}
+	}
+
+	/**
+	 * Reads the number of input files expected from the unzipped input
+	 * (".inputs"). Only inputs of reducers sent before all map tasks finished
+	 * (reduce slow-start) have it; other inputs are complete.
+	 */
+	void read_expected_inputs() {
+		FILE* f = fopen((this->working_dir + ".inputs").c_str(), "r");
+		this->expected_inputs = 0;
+		if (f == NULL) { return; }
+		if (fscanf(f, "%u", &this->expected_inputs) != 1) { this->expected_inputs = 0; }
+		fclose(f);
+	}
 
 public:
 	/**
@@ -212,23 +558,53 @@ public:
 	DataHandler(string input_path, string output_path, string working_dir) :
 			input_path(input_path),
 			output_path(output_path),
-			working_dir(working_dir) {
+			working_dir(working_dir),
+			late_inputs(NULL),
+			expected_inputs(0) {
 		init_dir(working_dir);
 	}
 	virtual ~DataHandler() {}
 
+	/**
+	 * Lets incremental inputs (see get_incremental_input) wait for late
+	 * inputs, if the input says more are expected (see read_expected_inputs).
+	 * Only handlers using BitTorrent support late inputs.
+	 */
+	void setLateInputs(late_input_func func) { this->late_inputs = func; }
+
 	/**
 	 * This method returns the path to the real input. This is the path that
-	 * should be used to open the file.
+	 * should be used to open the file. Returns zero on success (the task
+	 * must fail otherwise, its input is incomplete).
 	 */
-	virtual void get_input(string& input) { input = this->input_path; }
+	virtual int get_input(string& input) {
+		input = this->input_path;
+		return 0;
+	}
 
 	/**
 	 * Method similar to 'get_input'. This one has additional functionality
 	 * since it manages a zipped input (that holds several input files).
 	 */
-	virtual void get_zipped_input(vector<string>& inputs)
-	{ unzip_files(this->working_dir, this->input_path, inputs); }
+	virtual int get_zipped_input(vector<string>& inputs)
+	{ return unzip_files(this->working_dir, this->input_path, inputs); }
+
+	/**
+	 * Method similar to 'get_zipped_input'. This one hands every input file
+	 * to 'ready' as soon as it is available (files are also pushed into
+	 * 'inputs', in the same order). Using BOINC, all files are available at
+	 * once (after unzipping).
+	 */
+	virtual int get_incremental_input(
+			vector<string>& inputs,
+			input_ready_func ready,
+			void* args) {
+		vector<string>::iterator vit;
+		if (this->get_zipped_input(inputs)) { return 1; }
+		for(vit = inputs.begin(); vit != inputs.end(); vit++)
+		{ ready(*vit, args); }
+		return 0;
+	}
 
 	/**
 	 * This method receives an output file path and stages it at its
@@ -240,12 +616,12 @@ public:
 	/**
  	 * Method similar to 'stage_output'. This one has additional 
  	 * functionality to handle multiple output files (they are zipped into
- 	 * one). 
+ 	 * one). Returns zero on success.
  	 */	 
-	virtual void stage_zipped_output(vector<string>& outputs) {
-		zip_files(this->output_path, outputs);
+	virtual int stage_zipped_output(vector<string>& outputs) {
+		if (zip_files(this->output_path, outputs)) { return 1; }
 		// Because BOINC dislikes extensions.
-		rename((this->output_path + ".zip").c_str(), this->output_path.c_str());
+		return rename((this->output_path + ".zip").c_str(), this->output_path.c_str());
 	}
 };
 
@@ -263,6 +639,20 @@ private:
 	string shared_dir;
 	string tracker_url;
 	string wu_name;
+	/**
+	 * Expected number of peers downloading the outputs of this task (drives
+	 * the piece size of output torrents).
+	 */
+	int downloaders;
+	/**
+	 * Cache manager for the shared directory.
+	 */
+	CacheManager cache;
+	/**
+	 * Inputs (PATHs) fetched by this task. They are marked as consumed in the
+	 * cache once the task stages its output.
+	 */
+	vector<string> fetched;
 
 public:
 
@@ -282,17 +672,28 @@ public:
 				shared_dir(shared_dir),
 				tracker_url(tracker_url),
 				wu_name(wu_name),
+				downloaders(1),
+				cache(shared_dir, CACHE_DEFAULT_BUDGET),
 				DataHandler(input, output, working_dir) {
 		init_dir(shared_dir);
 	}
+	void setDownloaders(int new_downloaders) { this->downloaders = new_downloaders; }
 	BitTorrentHandler() = delete;
 	BitTorrentHandler(const BitTorrentHandler& bt) = delete;
-	~BitTorrentHandler() {}
+	~BitTorrentHandler() {
+		this->save_resume_data();
+		this->cache.evict();
+	}
 
-	void get_input(string& input) {
+	int get_input(string& input) {
 		list<libtorrent::torrent_handle> handles;
 		list<string> files;
 
+		// Co-located input (produced or cached by this host).
+		if (find_local_copy(this->input_path, this->shared_dir, this->cache, input)) {
+			this->fetched.push_back(input);
+			return 0;
+		}
 		// Add input torrent (input path) with shared_dir as shared_dir.
 		handles.push_back(this->add_torrent(this->input_path, this->shared_dir));
 #if DEBUG
@@ -314,25 +715,41 @@ public:
     	debug_log("[DH-get_input]", "waiting for file:", input.c_str());
 #endif
 		this->wait_files(files);
+		this->cache.touch(input, info_hash_hex(handles.front()));
+		this->fetched.push_back(input);
+		return 0;
 	}
 
-	void get_zipped_input(vector<string>& inputs) {
+	int get_zipped_input(vector<string>& inputs) {
 		list<libtorrent::torrent_handle> handles;
 		list<string> files;
+		vector<string> torrents;
 		vector<string>::iterator vit;
 		list<libtorrent::torrent_handle>::iterator lit;
+		string local;
+
+		int partition = this->input_partition();
 
 		// Extract all .torrent files to working directory.
-		unzip_files(this->working_dir, this->input_path, inputs);
-		// For every .torrent file, add torrent and save handle.
-		for(vit = inputs.begin(); vit != inputs.end(); vit++)
-		{ handles.push_back(this->add_torrent(*vit, this->shared_dir)); }
+		unzip_files(this->working_dir, this->input_path, torrents);
+		// For every .torrent file, use the local copy (if any) or add torrent
+		// and save handle.
+		for(vit = torrents.begin(); vit != torrents.end(); vit++) {
+			if (find_local_copy(*vit, this->shared_dir, this->cache, local, partition))
+			{ inputs.push_back(local); }
+			else {
+				handles.push_back(this->add_torrent(
+						*vit, this->shared_dir, false, partition));
+			}
+		}
 		// Wait until all files are downloaded.
 		this->wait_torrent(handles);
-		inputs.clear();
 		for(lit = handles.begin(); lit != handles.end(); lit++)	{
 			// Prepare output (list of input file paths).
-			inputs.push_back(this->shared_dir + lit->name());
+			inputs.push_back(torrent_input_path(
+					this->working_dir+lit->name()+".torrent",
+					this->shared_dir,
+					partition));
 			// Prepare list to use in wait_files
 			files.push_back(inputs.back());
 			// Move .torrent files from working to shared directory.
@@ -341,41 +758,171 @@ public:
 		}
 		// Wait until the file is accessible.
 		this->wait_files(files);
+		for(lit = handles.begin(); lit != handles.end(); lit++)
+		{ this->cache.touch(lit->name(), info_hash_hex(*lit)); }
+		this->fetched.insert(this->fetched.end(), inputs.begin(), inputs.end());
+		return 0;
+	}
+
+	/**
+	 * Incremental version of 'get_zipped_input'. Instead of waiting for all
+	 * torrents, torrent_finished alerts are used to hand every input file to
+	 * 'ready' as soon as its download is done. This way, the caller can start
+	 * processing the first inputs while the slowest ones are still being
+	 * downloaded. Late inputs (if any) are added as they arrive.
+	 */
+	int get_incremental_input(
+			vector<string>& inputs,
+			input_ready_func ready,
+			void* args) {
+		list<libtorrent::torrent_handle> handles;
+		list<libtorrent::torrent_handle> finished;
+		deque<libtorrent::alert*> alerts;
+		vector<string> torrents;
+		vector<string>::iterator vit;
+		list<libtorrent::torrent_handle>::iterator lit;
+		deque<libtorrent::alert*>::iterator ait;
+		set<string> known;
+		string local;
+		int partition = this->input_partition();
+
+		// Extract all .torrent files to working directory.
+		unzip_files(this->working_dir, this->input_path, torrents);
+		this->read_expected_inputs();
+		for(vit = torrents.begin(); vit != torrents.end(); vit++)
+		{ known.insert(vit->substr(vit->rfind('/') + 1)); }
+
+		while(torrents.size() || handles.size() ||
+				this->waiting_late_inputs(inputs.size())) {
+			// For every .torrent file, hand over the local copy (if any) or
+			// add torrent and save handle.
+			for(vit = torrents.begin(); vit != torrents.end(); vit++) {
+				if (find_local_copy(*vit, this->shared_dir, this->cache, local, partition)) {
+					this->fetched.push_back(local);
+					inputs.push_back(local);
+					ready(local, args);
+				}
+				else {
+					handles.push_back(this->add_torrent(
+							*vit, this->shared_dir, false, partition));
+				}
+			}
+			torrents.clear();
+			if (!handles.size() && !this->waiting_late_inputs(inputs.size())) { break; }
+			// Sleep until libtorrent posts something (or one second passes).
+			this->bt_session.wait_for_alert(libtorrent::seconds(1));
+			this->bt_session.pop_alerts(&alerts);
+			for(ait = alerts.begin(); ait != alerts.end(); ait++) {
+				libtorrent::torrent_finished_alert* tfa =
+						libtorrent::alert_cast<libtorrent::torrent_finished_alert>(*ait);
+				if(tfa != NULL) { finished.push_back(tfa->handle); }
+				delete *ait;
+			}
+			alerts.clear();
+			// Torrents that were already complete (when added) post no alert.
+			for(lit = handles.begin(); lit != handles.end(); lit++)
+			{ if(torrent_done(*lit)) { finished.push_back(*lit); } }
+			// Hand over every finished input (only once).
+			for(lit = finished.begin(); lit != finished.end(); lit++) {
+				list<libtorrent::torrent_handle>::iterator hit =
+						std::find(handles.begin(), handles.end(), *lit);
+				// Alerts may be stale (e.g., posted before this task selected
+				// its partition on a torrent that was already finished).
+				if(hit == handles.end() || !torrent_done(*hit)) { continue; }
+				this->input_done(*hit, partition, inputs, ready, args);
+				handles.erase(hit);
+			}
+			finished.clear();
+			// Map outputs finished after this task was created.
+			if (this->late_inputs != NULL) { this->get_late_inputs(known, torrents); }
+		}
+		return 0;
 	}
 
 	/**
 	 * Note: this output will most likely point somewhere inside a working dir.
 	 */
 	void stage_output(string& output) {
+		string name = cache_file_name(output);
 		// Create .torrent (according to BOINC output path).
 		make_torrent(output, this->output_path);
-		// Move output to shared directory.
-		rename(output.c_str(), this->shared_dir.c_str());
-		// Copy .torrent to shared directory.
-		copy_file(this->output_path, this->shared_dir + wu_name + ".torrent");
+		// Move output to shared directory (if it is not there yet).
+		rename(output.c_str(), (this->shared_dir + name).c_str());
+		// Copy .torrent to shared directory (named after the data, so the
+		// cache keeps and evicts both together).
+		copy_file(this->output_path, this->shared_dir + name + ".torrent");
+		this->cache.touch(name, info_hash_hex(this->output_path));
+		this->consume_fetched();
 	}
 
-	void stage_zipped_output(vector<string>& outputs) {
+	int stage_zipped_output(vector<string>& outputs) {
 		vector<string> torrents = vector<string>();
 		vector<string>::iterator vit;
 
+#if MAP_SINGLE_TORRENT
+		// All outputs (inside shared_dir/wu_name/) go into one multi-file
+		// torrent, which is uploaded instead of a zip of .torrent files.
+		if (make_task_torrent(
+				this->shared_dir + this->wu_name,
+				this->output_path,
+				this->shared_dir + this->wu_name + ".torrent",
+				this->tracker_url,
+				this->downloaders)) {
+			return 1;
+		}
+		this->cache.touch(this->wu_name, info_hash_hex(this->output_path));
+#else
 		// For every output file, create .torrent.
 		for(vit = outputs.begin(); vit != outputs.end(); vit++) {
 			torrents.push_back(*vit+".torrent");
 			// These .torrent files go directly to the shared directory.
-			make_torrent(*vit, *vit+".torrent");
+			if (make_torrent(*vit, *vit+".torrent")) { return 1; }
 		}
 		// Zip .torrent files and place zip into BOINC output path.
-		zip_files(this->working_dir + "output", torrents);
-		copy_file((this->working_dir + "output.zip").c_str(),
-				   this->output_path.c_str());
+		if (zip_files(this->working_dir + "output", torrents) ||
+			copy_file(this->working_dir + "output.zip", this->output_path)) {
+			return 1;
+		}
+		for(vit = outputs.begin(); vit != outputs.end(); vit++)
+		{ this->cache.touch(*vit, info_hash_hex(*vit + ".torrent")); }
+#endif
+		this->consume_fetched();
+		return 0;
+	}
+
+	/**
+	 * Returns the partition to fetch from zipped inputs (or -1 if every
+	 * zipped input is a single file torrent).
+	 */
+	int input_partition() {
+#if MAP_SINGLE_TORRENT
+		return task_partition(this->wu_name);
+#else
+		return -1;
+#endif
+	}
+
+	/**
+	 * Marks all inputs fetched by this task as consumed (the task is done
+	 * with them, they are only kept for seeding).
+	 */
+	void consume_fetched() {
+		vector<string>::iterator vit;
+		for(vit = this->fetched.begin(); vit != this->fetched.end(); vit++)
+		{ this->cache.consume(*vit); }
+		this->cache.save();
 	}
 
 	/**
 	 * Initialization function, starts BitTorrent client after some
 	 * configuration (some configurations are user definable).
+	 * The cache budget is the maximum number of bytes kept in the shared
+	 * directory.
 	 */
-	int init(int download_rate,	int upload_rate) {
+	int init(
+			int download_rate,
+			int upload_rate,
+			long long cache_budget = CACHE_DEFAULT_BUDGET) {
 		// Setup BitTorrent settings
 	    this->bt_settings = libtorrent::high_performance_seed();
 	    this->bt_settings.allow_multiple_connections_per_ip = true;
@@ -383,6 +930,11 @@ public:
 	    this->bt_settings.download_rate_limit = download_rate;
 	    this->bt_settings.upload_rate_limit = upload_rate;
 	    this->bt_session.set_settings(bt_settings);
+	    // Finished downloads are reported through alerts (incremental input).
+	    this->bt_session.set_alert_mask(
+	    		libtorrent::alert::status_notification |
+	    		libtorrent::alert::error_notification);
+	    this->load_session_state();
 	    this->bt_session.listen_on(std::make_pair(6500, 7000), bt_ec);
 	    if (bt_ec)	{
 	        fprintf(stderr,
@@ -390,21 +942,141 @@ public:
 	                bt_ec.message().c_str());
 			return 1;
 		}
+	    // Load cache index and make room before seeding anything.
+	    this->cache.setBudget(cache_budget);
+	    this->cache.load();
+	    this->cache.evict();
 	    this->check_shared_torrents();
 	    return 0;
 	}
 
 	/**
-	 * Adds a new torrent to the current session.
+	 * Adds a new torrent to the current session. If the torrent is already in
+	 * the session, the existing handle is returned.
 	 * Note: Save path is the directory path where the downloaded file will be.
+	 * Note: seed should only be used for files that were just created (no
+	 * checking is performed).
+	 * Note: if partition is not negative, only the file holding that partition
+	 * is downloaded (multi-file map output torrents).
 	 */
-	libtorrent::torrent_handle add_torrent(string torrent, string save_path) {
+	libtorrent::torrent_handle add_torrent(
+			string torrent,
+			string save_path,
+			bool seed = false,
+			int partition = -1) {
 		libtorrent::add_torrent_params p;
+		libtorrent::torrent_handle th;
+		libtorrent::error_code ec;
+		vector<char> resume_data;
+		int index = -1;
 		p.save_path = this->shared_dir;
 		p.ti = new libtorrent::torrent_info(torrent, this->bt_ec);
+		if (this->bt_ec) { return th; }
+		if (partition >= 0) { index = partition_file(*p.ti, partition); }
+		th = this->bt_session.find_torrent(p.ti->info_hash());
+		if (th.is_valid()) {
+			// Other partitions may already be selected, just add this one.
+			if (index >= 0) { th.file_priority(index, 1); }
+			return th;
+		}
+		if (seed) { p.flags |= libtorrent::add_torrent_params::flag_seed_mode; }
+		if (index >= 0) {
+			p.file_priorities.assign(p.ti->num_files(), 0);
+			p.file_priorities[index] = 1;
+		}
+		// Fast-resume data avoids re-checking (hashing) the whole file.
+		if (!libtorrent::load_file(
+				this->shared_dir + p.ti->name() + RESUME_FILE_SUFFIX,
+				resume_data,
+				ec)) {
+			p.resume_data = &resume_data;
+		}
 		return this->bt_session.add_torrent(p, this->bt_ec);
 	}
 
+	/**
+	 * Loads the session state (saved by a previous session) from the shared
+	 * directory.
+	 */
+	void load_session_state() {
+		libtorrent::error_code ec;
+		libtorrent::lazy_entry state;
+		vector<char> buf;
+		if (libtorrent::load_file(
+				this->shared_dir + SESSION_STATE_FILE, buf, ec)) { return; }
+		if (buf.empty()) { return; }
+		if (libtorrent::lazy_bdecode(&buf[0], &buf[0] + buf.size(), state, ec))
+		{ return; }
+		this->bt_session.load_state(state);
+	}
+
+	/**
+	 * Saves fast-resume data for every torrent in the session plus the session
+	 * state into the shared directory. Next sessions will use this data to
+	 * start seeding without re-checking all cached files.
+	 */
+	void save_resume_data() {
+		vector<libtorrent::torrent_handle> handles = this->bt_session.get_torrents();
+		vector<libtorrent::torrent_handle>::iterator hit;
+		deque<libtorrent::alert*> alerts;
+		deque<libtorrent::alert*>::iterator ait;
+		libtorrent::entry state;
+		int outstanding = 0;
+
+		// Ask for resume data (it is posted through alerts).
+		for(hit = handles.begin(); hit != handles.end(); hit++) {
+			if (!hit->is_valid()) { continue; }
+			hit->save_resume_data();
+			outstanding++;
+		}
+		while(outstanding > 0) {
+			if (this->bt_session.wait_for_alert(libtorrent::seconds(10)) == NULL)
+			{ break; }
+			this->bt_session.pop_alerts(&alerts);
+			for(ait = alerts.begin(); ait != alerts.end(); ait++) {
+				libtorrent::save_resume_data_alert* srda =
+						libtorrent::alert_cast<libtorrent::save_resume_data_alert>(*ait);
+				if (srda != NULL) {
+					this->write_entry(
+							this->shared_dir + srda->handle.name() + RESUME_FILE_SUFFIX,
+							*srda->resume_data);
+					outstanding--;
+				}
+				else if (libtorrent::alert_cast<
+						libtorrent::save_resume_data_failed_alert>(*ait) != NULL)
+				{ outstanding--; }
+				delete *ait;
+			}
+			alerts.clear();
+		}
+
+		this->bt_session.save_state(state);
+		this->write_entry(this->shared_dir + SESSION_STATE_FILE, state);
+	}
+
+	/**
+	 * Writes a bencoded entry into a file. A temporary file is renamed over
+	 * the destination so that readers never see half written files.
+	 */
+	int write_entry(const string& path, const libtorrent::entry& e) {
+		vector<char> buf;
+		string tmp = path + ".tmp";
+		FILE* output;
+
+		bencode(back_inserter(buf), e);
+		if (!(output = fopen(tmp.c_str(), "wb"))) {
+	        fprintf(stderr,
+	        		"[DH-write_entry] failed to open file %s: (%d) %s\n",
+	        		tmp.c_str(),
+	        		errno,
+	        		strerror(errno));
+			return 1;
+		}
+		fwrite(&buf[0], 1, buf.size(), output);
+		fclose(output);
+		return rename(tmp.c_str(), path.c_str());
+	}
+
 	/**
 	 * Blocking function that holds execution while input is not ready.
 	 */
@@ -427,12 +1099,44 @@ public:
 		}
 	}
 
+	/**
+	 * Auxiliary method for 'get_incremental_input'. It moves the .torrent
+	 * file to the shared directory, waits until the downloaded file is
+	 * accessible and hands it to 'ready'.
+	 */
+	void input_done(
+			const libtorrent::torrent_handle& handle,
+			int partition,
+			vector<string>& inputs,
+			input_ready_func ready,
+			void* args) {
+		list<string> files;
+		string input = torrent_input_path(
+				this->working_dir+handle.name()+".torrent",
+				this->shared_dir,
+				partition);
+
+		rename(	(this->working_dir+handle.name()+".torrent").c_str(),
+				(this->shared_dir+handle.name()+".torrent").c_str());
+		files.push_back(input);
+		this->wait_files(files);
+		this->cache.touch(handle.name(), info_hash_hex(handle));
+		this->fetched.push_back(input);
+		inputs.push_back(input);
+#if DEBUG
+    	debug_log("[DH-input_done]", "input ready:", input.c_str());
+#endif
+		ready(input, args);
+	}
+
 	/**
 	 * Searches for torrent files inside the shared directory.
-	 * Found torrents will be added to the given session.
+	 * Found torrents will be added to the given session (only if the cache
+	 * says that the respective file is still worth seeding).
 	 */
 	void check_shared_torrents() {
 		DIR* dir;
+		string name;
 
 		// try to open dir. If opendir is unsuccessful, return.
 		if((dir = opendir(this->shared_dir.c_str())) == NULL) { return; }
@@ -441,63 +1145,507 @@ public:
 
 			if(dp->d_type == DT_DIR) { continue; }
 			if(! ends_with(dp->d_name, ".torrent")) { continue; }
+			// Strip ".torrent" to get the name of the cached file.
+			name = string(dp->d_name, strlen(dp->d_name) - 8);
+			if(! this->cache.useful(name)) { continue; }
 
 			add_torrent(this->shared_dir+dp->d_name, this->shared_dir);
 		}
+		closedir(dir);
 	}
 
 	/**
 	 * Creates a torrent file ("output_torrent") representing the contents of
-	 * "output_file". The tracker "tracker_url" is added. See documentation in
-	 * http://www.rasterbar.com/products/libtorrent/make_torrent.html
+	 * "output_file" (see make_torrent_file).
 	 */
-	int make_torrent(string output_file, string output_torrent) {
-		libtorrent::file_storage fs;
-		libtorrent::error_code ec;
-		int flags = 0, piece_size = 0, pad_file_limit = -1;
-		string full_path = libtorrent::complete(output_file);
+	int make_torrent(string output_file, string output_torrent)
+	{
+		return make_torrent_file(
+				output_file,
+				output_torrent,
+				this->tracker_url,
+				false,
+				this->downloaders);
+	}
 
-		add_files(fs, full_path, file_filter, flags);
-		if (fs.num_files() == 0) {
-	        fprintf(stderr,
-	        		"[DH-make_torrent] failed to add file %s\n",
-	        		output_file.c_str());
-			return 1;
+	/**
+	 * Returns the cache manager for the shared directory.
+	 */
+	CacheManager& getCache() { return this->cache; }
+
+	/**
+	 * Evicts cached files (see CacheManager::evict) and drops the torrents of
+	 * evicted files from the session (downloads in progress are kept).
+	 * Returns the number of evicted files.
+	 */
+	int evict_cache() {
+		vector<libtorrent::torrent_handle> handles;
+		vector<libtorrent::torrent_handle>::iterator hit;
+		int evicted = this->cache.evict();
+
+		if (!evicted) { return 0; }
+		handles = this->bt_session.get_torrents();
+		for(hit = handles.begin(); hit != handles.end(); hit++) {
+			if (!hit->is_valid() || !hit->status().is_finished) { continue; }
+			if (!this->cache.cached(hit->name())) { this->bt_session.remove_torrent(*hit); }
 		}
+		return evicted;
+	}
 
-		libtorrent::create_torrent t(fs, piece_size, pad_file_limit, flags);
-		t.add_tracker(this->tracker_url);
+	/**
+	 * Returns the handles of all torrents in the session.
+	 */
+	vector<libtorrent::torrent_handle> getTorrents()
+	{ return this->bt_session.get_torrents(); }
+
+	/**
+	 * Discards all pending alerts (for users that do not need them).
+	 */
+	void dropAlerts() {
+		deque<libtorrent::alert*> alerts;
+		deque<libtorrent::alert*>::iterator ait;
+		this->bt_session.pop_alerts(&alerts);
+		for(ait = alerts.begin(); ait != alerts.end(); ait++) { delete *ait; }
+	}
+};
 
-		libtorrent::set_piece_hashes(t,libtorrent::parent_path(full_path),ec);
-		if (ec)	{
-	        fprintf(stderr, "[DH-make_torrent] %s\n", ec.message().c_str());
+
+/**
+ * AgentHandler is yet another implementation that uses the BitTorrent
+ * protocol. Instead of running its own BitTorrent session, it delegates all
+ * transfers to the host BitTorrent agent (see util/bt/bt_agent.cpp) through a
+ * Unix socket. All tasks running on the same host share one session (one
+ * peer table, global rate limits) and outputs keep being seeded by the agent
+ * after the task exits.
+ * The agent protocol is line based. Requests are "ADD <torrent path>",
+ * "FETCH <partition> <torrent path>" (only the partition file is downloaded),
+ * "WAIT <name>" and "PUBLISH <torrent path>". Replies are "OK <name>",
+ * "DONE <name>" or "ERR <message>".
+ */
+class AgentHandler : public DataHandler {
+private:
+	string shared_dir;
+	string tracker_url;
+	string wu_name;
+	/**
+	 * Expected number of peers downloading the outputs of this task (drives
+	 * the piece size of output torrents).
+	 */
+	int downloaders;
+	/**
+	 * Agent executable. It is started if no agent is running.
+	 */
+	string agent_path;
+	/**
+	 * Connection to the agent.
+	 */
+	int agent_fd;
+	/**
+	 * Bytes read from the agent that do not form a full line yet.
+	 */
+	string agent_buf;
+	/**
+	 * Torrents reported as done (WAIT replies) while waiting for the reply
+	 * of another request.
+	 */
+	deque<string> agent_done;
+	/**
+	 * Shared directory cache (the agent adds and evicts files). It is used to
+	 * find co-located inputs and to mark inputs as consumed.
+	 */
+	CacheManager cache;
+	/**
+	 * Inputs (PATHs) fetched by this task. They are marked as consumed in the
+	 * cache once the task stages its output.
+	 */
+	vector<string> fetched;
+
+public:
+	AgentHandler(
+			string input,
+			string output,
+			string working_dir,
+			string shared_dir,
+			string tracker_url,
+			string wu_name,
+			string agent_path) :
+				shared_dir(shared_dir),
+				tracker_url(tracker_url),
+				wu_name(wu_name),
+				downloaders(1),
+				agent_path(agent_path),
+				agent_fd(-1),
+				cache(shared_dir, CACHE_DEFAULT_BUDGET),
+				DataHandler(input, output, working_dir) {
+		init_dir(shared_dir);
+		this->cache.load();
+	}
+	void setDownloaders(int new_downloaders) { this->downloaders = new_downloaders; }
+	AgentHandler() = delete;
+	AgentHandler(const AgentHandler& ah) = delete;
+	~AgentHandler() { if (this->agent_fd >= 0) { close(this->agent_fd); } }
+
+	/**
+	 * Connects to the host agent. If there is no agent, one is started
+	 * (detached from this process) with the given rate limits (Bps) and
+	 * cache budget (bytes). Tasks starting at the same time start only one
+	 * agent (the start is serialized with AGENT_START_LOCK_FILE).
+	 */
+	int init(
+			int download_rate,
+			int upload_rate,
+			long long cache_budget = CACHE_DEFAULT_BUDGET) {
+		pid_t pid;
+		int lock_fd, ret = 1;
+		char drate[16], urate[16], budget[32];
+
+		if (!this->connect_agent()) { return 0; }
+		// The lock is not inherited by the agent (close on exec).
+		lock_fd = open(
+				(this->shared_dir + AGENT_START_LOCK_FILE).c_str(),
+				O_RDWR | O_CREAT | O_CLOEXEC,
+				0644);
+		if (lock_fd >= 0) { flock(lock_fd, LOCK_EX); }
+		// Another task may have started the agent meanwhile.
+		if (!this->connect_agent()) {
+			if (lock_fd >= 0) { close(lock_fd); }
+			return 0;
+		}
+		// Start the agent (child of a short lived child, so it is not killed
+		// when BOINC ends this task).
+		sprintf(drate, "%d", download_rate / 1000);
+		sprintf(urate, "%d", upload_rate / 1000);
+		sprintf(budget, "%lld", cache_budget / (1024 * 1024));
+		if((pid = fork()) == 0) {
+			setsid();
+			if (fork() == 0) {
+				execl(	this->agent_path.c_str(), this->agent_path.c_str(),
+						"-s", this->shared_dir.c_str(),
+						"-d", drate,
+						"-u", urate,
+						"-c", budget,
+						(char*)0);
+			}
+			_exit(0);
+		}
+		sprintf(dh_buf, "%s -s %s", this->agent_path.c_str(), this->shared_dir.c_str());
+		handle_child_proc(pid, dh_buf);
+		// Give the agent some time to open its socket.
+		for(int i = 0; i < 30 && ret; i++) {
+			sleep(1);
+			ret = this->connect_agent();
+		}
+		if (lock_fd >= 0) { close(lock_fd); }
+		if (ret) { fprintf(stderr, "[DH-init] failed to contact agent %s\n", dh_buf); }
+		return ret;
+	}
+
+	int get_input(string& input) {
+		string name;
+
+		// Co-located input (produced or cached by this host).
+		if (find_local_copy(this->input_path, this->shared_dir, this->cache, input)) {
+			this->fetched.push_back(input);
+			return 0;
+		}
+		if (this->request("ADD", this->input_path, name)) { return 1; }
+		if (this->request("WAIT", name, name)) { return 1; }
+		// Return the file PATH.
+		input = this->shared_dir + name;
+		// Copy input torrent to shared dir (the name has to be faked since
+		// boinc does not preserve the original file name).
+		copy_file(this->input_path, input + ".torrent");
+		this->fetched.push_back(input);
+		return 0;
+	}
+
+	int get_zipped_input(vector<string>& inputs) {
+		vector<string> torrents, names;
+		vector<string>::iterator vit;
+		string name;
+		int partition = this->input_partition();
+
+		// Extract all .torrent files to working directory.
+		unzip_files(this->working_dir, this->input_path, torrents);
+		// For every .torrent file, use the local copy or hand it to the agent.
+		for(vit = torrents.begin(); vit != torrents.end(); vit++) {
+			if (find_local_copy(*vit, this->shared_dir, this->cache, name, partition)) {
+				inputs.push_back(name);
+				continue;
+			}
+			if (this->add(*vit, partition, name)) { return 1; }
+			names.push_back(name);
+		}
+		for(vit = names.begin(); vit != names.end(); vit++) {
+			if (this->request("WAIT", *vit, name)) { return 1; }
+			inputs.push_back(torrent_input_path(
+					this->working_dir + name + ".torrent",
+					this->shared_dir,
+					partition));
+			// Move .torrent files from working to shared directory.
+			rename(	(this->working_dir + name + ".torrent").c_str(),
+					(this->shared_dir + name + ".torrent").c_str());
+		}
+		this->fetched.insert(this->fetched.end(), inputs.begin(), inputs.end());
+		return 0;
+	}
+
+	int get_incremental_input(
+			vector<string>& inputs,
+			input_ready_func ready,
+			void* args) {
+		vector<string> torrents;
+		vector<string>::iterator vit;
+		set<string> known;
+		string name;
+		unsigned int pending = 0;
+		int partition = this->input_partition();
+
+		// Extract all .torrent files to working directory.
+		unzip_files(this->working_dir, this->input_path, torrents);
+		this->read_expected_inputs();
+		for(vit = torrents.begin(); vit != torrents.end(); vit++)
+		{ known.insert(vit->substr(vit->rfind('/') + 1)); }
+		while (torrents.size() || pending > 0 ||
+				this->waiting_late_inputs(inputs.size())) {
+			for(vit = torrents.begin(); vit != torrents.end(); vit++) {
+				if (find_local_copy(*vit, this->shared_dir, this->cache, name, partition)) {
+					this->fetched.push_back(name);
+					inputs.push_back(name);
+					ready(name, args);
+					continue;
+				}
+				if (this->add(*vit, partition, name)) { return 1; }
+				// Waits are sent upfront, the agent replies in completion order.
+				if (this->send_line("WAIT", name)) { return 1; }
+				pending++;
+			}
+			torrents.clear();
+			// Hand over finished inputs (waits for one second at most if late
+			// inputs are expected, so they are checked regularly).
+			while (pending > 0 && this->reply_ready(
+					this->waiting_late_inputs(inputs.size() + pending) ? 1000 : -1)) {
+				if (this->read_done(name)) { return 1; }
+				inputs.push_back(torrent_input_path(
+						this->working_dir + name + ".torrent",
+						this->shared_dir,
+						partition));
+				rename(	(this->working_dir + name + ".torrent").c_str(),
+						(this->shared_dir + name + ".torrent").c_str());
+				this->fetched.push_back(inputs.back());
+				ready(inputs.back(), args);
+				pending--;
+			}
+			if (!this->waiting_late_inputs(inputs.size() + pending)) { continue; }
+			if (!pending) { sleep(1); }
+			// Map outputs finished after this task was created.
+			this->get_late_inputs(known, torrents);
+		}
+		return 0;
+	}
+
+	/**
+	 * Note: this output will most likely point somewhere inside a working dir.
+	 */
+	void stage_output(string& output) {
+		string name = cache_file_name(output);
+		// Create .torrent (according to BOINC output path).
+		make_torrent_file(
+				output,
+				this->output_path,
+				this->tracker_url,
+				false,
+				this->downloaders);
+		// Move output to shared directory (if it is not there yet).
+		rename(output.c_str(), (this->shared_dir + name).c_str());
+		// Copy .torrent to shared directory (named after the data) and let
+		// the agent seed it.
+		copy_file(this->output_path, this->shared_dir + name + ".torrent");
+		this->request("PUBLISH", this->shared_dir + name + ".torrent", name);
+		this->consume_fetched();
+	}
+
+	int stage_zipped_output(vector<string>& outputs) {
+		vector<string> torrents = vector<string>();
+		vector<string>::iterator vit;
+		string name;
+
+#if MAP_SINGLE_TORRENT
+		// All outputs (inside shared_dir/wu_name/) go into one multi-file
+		// torrent, which is uploaded instead of a zip of .torrent files.
+		if (make_task_torrent(
+				this->shared_dir + this->wu_name,
+				this->output_path,
+				this->shared_dir + this->wu_name + ".torrent",
+				this->tracker_url,
+				this->downloaders)) {
 			return 1;
 		}
+		this->request("PUBLISH", this->shared_dir + this->wu_name + ".torrent", name);
+#else
+		// For every output file, create .torrent and let the agent seed it.
+		for(vit = outputs.begin(); vit != outputs.end(); vit++) {
+			torrents.push_back(*vit+".torrent");
+			if (make_torrent_file(
+					*vit,
+					*vit+".torrent",
+					this->tracker_url,
+					false,
+					this->downloaders)) {
+				return 1;
+			}
+			this->request("PUBLISH", *vit+".torrent", name);
+		}
+		// Zip .torrent files and place zip into BOINC output path.
+		if (zip_files(this->working_dir + "output", torrents) ||
+			copy_file(this->working_dir + "output.zip", this->output_path)) {
+			return 1;
+		}
+#endif
+		this->consume_fetched();
+		return 0;
+	}
+
+private:
+	/**
+	 * Marks all inputs fetched by this task as consumed (the task is done
+	 * with them, they are only kept for seeding). The agent evicts them
+	 * first when the shared directory is full.
+	 */
+	void consume_fetched() {
+		vector<string>::iterator vit;
+		// Refresh the entries first (inputs downloaded by the agent were
+		// indexed by it).
+		this->cache.save();
+		for(vit = this->fetched.begin(); vit != this->fetched.end(); vit++)
+		{ this->cache.consume(*vit); }
+		this->cache.save();
+	}
 
-		t.set_creator("freeCycles-wrapper (using libtorrent)");
+	/**
+	 * Returns the partition to fetch from zipped inputs (or -1 if every
+	 * zipped input is a single file torrent).
+	 */
+	int input_partition() {
+#if MAP_SINGLE_TORRENT
+		return task_partition(this->wu_name);
+#else
+		return -1;
+#endif
+	}
 
-		// create the torrent
-		libtorrent::entry e = t.generate();
-		// hack to change creation date (needs to be the same for all .torrents files)
-		e.dict()["creation date"] = 0;
+	/**
+	 * Hands a .torrent to the agent (only the partition file is downloaded
+	 * if partition is not negative). The torrent name is placed into name.
+	 */
+	int add(const string& torrent, int partition, string& name) {
+		char buf[16];
+		if (partition < 0) { return this->request("ADD", torrent, name); }
+		sprintf(buf, "%d ", partition);
+		return this->request("FETCH", buf + torrent, name);
+	}
 
-		std::vector<char> torrent;
-		bencode(back_inserter(torrent), e);
+	/**
+	 * Opens a connection to the agent socket. Returns zero on success.
+	 */
+	int connect_agent() {
+		struct sockaddr_un addr;
+		string path = this->shared_dir + AGENT_SOCKET_FILE;
 
-		FILE* output = fopen(output_torrent.c_str(), "wb+");
-		if (output == NULL)	{
-	        fprintf(stderr,
-	        		"[DH-make_torrent] failed to open file %s: (%d) %s\n",
-	        		output_torrent.c_str(),
-	        		errno,
-	        		strerror(errno));
+		if (this->agent_fd >= 0) { close(this->agent_fd); }
+		if ((this->agent_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) { return 1; }
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+		if (connect(this->agent_fd, (struct sockaddr*)&addr, sizeof(addr))) {
+			close(this->agent_fd);
+			this->agent_fd = -1;
+			return 1;
+		}
+		return 0;
+	}
+
+	/**
+	 * Sends a request ("<cmd> <arg>") to the agent.
+	 */
+	int send_line(const char* cmd, const string& arg) {
+		string line = string(cmd) + " " + arg + "\n";
+		size_t sent = 0;
+		ssize_t ret;
+		while (sent < line.size()) {
+			if ((ret = write(this->agent_fd, line.c_str() + sent, line.size() - sent)) <= 0) {
+		        fprintf(stderr, "[DH-send_line] failed to send: %s", line.c_str());
+				return 1;
+			}
+			sent += ret;
+		}
+		return 0;
+	}
+
+	/**
+	 * Reads one reply from the agent. The reply argument (e.g. a torrent
+	 * name) is placed into arg. Returns non zero on errors.
+	 */
+	int read_reply(string& arg, string* cmd = NULL) {
+		char buf[512];
+		ssize_t ret;
+		size_t end;
+
+		while ((end = this->agent_buf.find('\n')) == string::npos) {
+			if ((ret = read(this->agent_fd, buf, sizeof(buf))) <= 0) {
+		        fprintf(stderr, "[DH-read_reply] agent closed the connection\n");
+				return 1;
+			}
+			this->agent_buf.append(buf, ret);
+		}
+		string line = this->agent_buf.substr(0, end);
+		this->agent_buf.erase(0, end + 1);
+		arg = line.substr(line.find(' ') + 1);
+		if (cmd != NULL) { *cmd = line.substr(0, line.find(' ')); }
+		if (line.compare(0, 3, "ERR") == 0) {
+	        fprintf(stderr, "[DH-read_reply] agent error: %s\n", arg.c_str());
 			return 1;
 		}
-		fwrite(&torrent[0], 1, torrent.size(), output);
-		fclose(output);
 		return 0;
 	}
 
+	/**
+	 * Sends a request and waits for the respective reply.
+	 */
+	int request(const char* cmd, const string& arg, string& reply) {
+		string reply_cmd;
+		if (this->send_line(cmd, arg)) { return 1; }
+		if (!strcmp(cmd, "WAIT")) { return this->read_done(reply); }
+		// Replies to pending waits may arrive first.
+		while (true) {
+			if (this->read_reply(reply, &reply_cmd)) { return 1; }
+			if (reply_cmd.compare("DONE")) { return 0; }
+			this->agent_done.push_back(reply);
+		}
+	}
+
+	/**
+	 * Reads the reply to a pending WAIT (the name of a finished torrent).
+	 */
+	int read_done(string& name) {
+		if (this->agent_done.empty()) { return this->read_reply(name); }
+		name = this->agent_done.front();
+		this->agent_done.pop_front();
+		return 0;
+	}
+
+	/**
+	 * True if a reply can be read without blocking for more than 'timeout'
+	 * milliseconds (-1 waits forever).
+	 */
+	bool reply_ready(int timeout) {
+		struct pollfd pfd;
+		if (!this->agent_done.empty() || this->agent_buf.find('\n') != string::npos)
+		{ return true; }
+		pfd.fd = this->agent_fd;
+		pfd.events = POLLIN;
+		return poll(&pfd, 1, timeout) > 0;
+	}
 };
 
 #endif /* DATA_HANDLER_H_ */
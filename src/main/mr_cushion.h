@@ -0,0 +1,162 @@
+#ifndef __MR_CUSHION_H__
+#define __MR_CUSHION_H__
+
+/**
+ * This file contains the cushion controller used by the work generator. The
+ * cushion is the number of unsent results the work generator tries to keep
+ * (so the feeder never runs dry). Instead of a fixed cushion and fixed sleeps,
+ * the controller measures:
+ * - the consumption rate (results sent to volunteers per second), from the
+ *   number of unsent results seen at each poll and the results created since
+ *   the previous one;
+ * - the time it takes to create one work unit.
+ * The cushion covers the results consumed until the next poll plus the time
+ * the transitioner takes to create results of new work units, and the time to
+ * create the refill. The poll interval is the time to consume
+ * CUSHION_POLL_RESULTS results. Whenever the feeder runs dry while there is
+ * work to send (an empty-feeder event), the cushion is boosted; the boost
+ * decays while the feeder is fed.
+ */
+
+#include <stdint.h>
+
+#include <deque>
+#include <utility>
+
+// Bounds of the cushion (unsent results).
+#define CUSHION_MIN 10
+#define CUSHION_MAX 20000
+// Bounds of the poll interval (seconds).
+#define CUSHION_POLL_MIN 1.0
+#define CUSHION_POLL_MAX 10.0
+// Results consumed between polls.
+#define CUSHION_POLL_RESULTS 5
+// Time (seconds) before the results of a new work unit are unsent results.
+#define CUSHION_TRANSITION_DELAY 5.0
+// Consumption is sampled over (at least) this many seconds.
+#define CUSHION_RATE_WINDOW 30.0
+// Weight of the newest sample in the moving averages.
+#define CUSHION_ALPHA 0.3
+// Cushion boost after empty-feeder events (and its decay per poll).
+#define CUSHION_BOOST_MAX 8.0
+#define CUSHION_BOOST_DECAY 0.98
+
+class CushionController {
+
+protected:
+	/**
+	 * Results consumed per second and seconds to create one work unit
+	 * (moving averages, -1 until measured).
+	 */
+	double rate;
+	double create_time;
+	double boost;
+	/**
+	 * Current sample: unsent results and time at its start, and results
+	 * created since then.
+	 */
+	int sample_unsent;
+	double sample_start;
+	int sample_created;
+	/**
+	 * Recently created results (time, count) that may not be unsent results
+	 * yet (see CUSHION_TRANSITION_DELAY).
+	 */
+	std::deque<std::pair<double, int> > in_flight;
+	uint64_t polls;
+	uint64_t empties;
+
+	static double average(double avg, double sample)
+	{ return avg < 0 ? sample : CUSHION_ALPHA * sample + (1 - CUSHION_ALPHA) * avg; }
+
+public:
+	CushionController() :
+		rate(-1),
+		create_time(-1),
+		boost(1),
+		sample_unsent(-1),
+		sample_start(0),
+		sample_created(0),
+		polls(0),
+		empties(0) {}
+
+	/**
+	 * Registers a poll: 'unsent' results at time 'now'. 'starved' tells if
+	 * there was work left to create at the previous poll (so an empty feeder
+	 * is the controller's fault). Returns true on an empty-feeder event.
+	 */
+	bool observe(int unsent, double now, bool starved) {
+		bool empty = unsent == 0 && starved;
+		this->polls++;
+		while (!this->in_flight.empty() &&
+				now - this->in_flight.front().first >= CUSHION_TRANSITION_DELAY)
+		{ this->in_flight.pop_front(); }
+		if (empty) {
+			this->empties++;
+			this->boost = this->boost * 2 > CUSHION_BOOST_MAX ? CUSHION_BOOST_MAX : this->boost * 2;
+		}
+		else {
+			this->boost = this->boost * CUSHION_BOOST_DECAY < 1 ? 1 : this->boost * CUSHION_BOOST_DECAY;
+		}
+		if (this->sample_unsent < 0) {
+			this->sample_unsent = unsent;
+			this->sample_start = now;
+			this->sample_created = 0;
+		}
+		else if (now - this->sample_start >= CUSHION_RATE_WINDOW) {
+			int consumed = this->sample_unsent + this->sample_created - unsent;
+			this->rate = average(this->rate, (consumed < 0 ? 0 : consumed) / (now - this->sample_start));
+			this->sample_unsent = unsent;
+			this->sample_start = now;
+			this->sample_created = 0;
+		}
+		return empty;
+	}
+
+	/**
+	 * Registers the creation of 'nwus' work units (with 'nresults' results)
+	 * that took 'seconds'.
+	 */
+	void created(int nwus, int nresults, double now, double seconds) {
+		if (!nwus) { return; }
+		this->sample_created += nresults;
+		this->in_flight.push_back(std::make_pair(now, nresults));
+		this->create_time = average(this->create_time, seconds / nwus);
+	}
+
+	/**
+	 * Results created recently (not counted as unsent results yet).
+	 */
+	int getInFlight() {
+		int n = 0;
+		for(unsigned int i = 0; i < this->in_flight.size(); i++) { n += this->in_flight[i].second; }
+		return n;
+	}
+
+	double getPollInterval() {
+		if (this->rate <= 0) { return CUSHION_POLL_MAX; }
+		double poll = CUSHION_POLL_RESULTS / this->rate;
+		return poll < CUSHION_POLL_MIN ? CUSHION_POLL_MIN : poll > CUSHION_POLL_MAX ? CUSHION_POLL_MAX : poll;
+	}
+
+	/**
+	 * Returns the number of unsent results to keep. Creating work units
+	 * must be faster than consuming results; if it is not (or almost not),
+	 * the cushion is as large as possible.
+	 */
+	int getCushion() {
+		if (this->rate <= 0) { return CUSHION_MIN * this->boost; }
+		double busy = this->create_time > 0 ? this->rate * this->create_time : 0;
+		if (busy >= 0.9) { return CUSHION_MAX; }
+		double cushion = this->boost * this->rate *
+				(this->getPollInterval() + CUSHION_TRANSITION_DELAY) / (1 - busy);
+		return cushion < CUSHION_MIN ? CUSHION_MIN : cushion > CUSHION_MAX ? CUSHION_MAX : (int)cushion;
+	}
+
+	double getRate() { return this->rate < 0 ? 0 : this->rate; }
+	double getCreateTime() { return this->create_time < 0 ? 0 : this->create_time; }
+	uint64_t getPolls() { return this->polls; }
+	uint64_t getEmpties() { return this->empties; }
+};
+
+#endif /* MR_CUSHION_H_ */
@@ -0,0 +1,222 @@
+#ifndef __MR_FEED_H__
+#define __MR_FEED_H__
+
+/**
+ * This file contains the completion feed shared by the assimilator and the
+ * work generator. The feed (<jobtracker xml>.feed) is an append-only text file
+ * with one line per assimilated work unit: the work unit name followed by the
+ * ids of the hosts that returned a valid result (and therefore hold the task
+ * output), separated by spaces. The
+ * assimilator appends a line once the task output is in place; the work
+ * generator remembers how far it has read and only reads new lines, so the
+ * cost of tracking completions is proportional to the number of new events
+ * (and not to the number of tasks).
+ * Lines are appended with a single write on a O_APPEND descriptor, so a reader
+ * never sees interleaved lines (it may see a partial last line, which is left
+ * for the next poll).
+ * The feed would grow forever, so the work generator rotates it once the
+ * completions it has read are durable (see CompletionFeedReader::rotate): the
+ * feed is renamed to <jobtracker xml>.feed.old and a new feed starts with the
+ * lines that are still needed. The writer reopens the feed when it is renamed;
+ * lines it appends to the old feed meanwhile are still read.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <sstream>
+#include <set>
+#include <vector>
+#include <string>
+
+#define FEED_SUFFIX ".feed"
+#define FEED_OLD_SUFFIX ".old"
+
+/**
+ * Writer side of the feed (used by the assimilator).
+ */
+class CompletionFeedWriter {
+
+protected:
+	std::string path;
+	int fd;
+
+public:
+	CompletionFeedWriter(std::string path) : path(path + FEED_SUFFIX), fd(-1) {}
+	~CompletionFeedWriter() { if (this->fd >= 0) { close(this->fd); } }
+
+	/**
+	 * Appends a completion (one line). Returns zero on success.
+	 */
+	int append(const std::string& name, const std::vector<int>& hosts) {
+		struct stat current, opened;
+		std::ostringstream out;
+		out << name;
+		for(unsigned int i = 0; i < hosts.size(); i++) { out << ' ' << hosts[i]; }
+		out << '\n';
+		std::string line = out.str();
+		// The feed was rotated (renamed) by the reader.
+		if (this->fd >= 0 &&
+				(stat(this->path.c_str(), &current) || fstat(this->fd, &opened) ||
+				current.st_ino != opened.st_ino || current.st_dev != opened.st_dev)) {
+			close(this->fd);
+			this->fd = -1;
+		}
+		if (this->fd < 0 &&
+				(this->fd = open(this->path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0) {
+			fprintf(stderr,
+					"[CF-append] failed to open feed %s: %s\n",
+					this->path.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		if (write(this->fd, line.data(), line.size()) != (ssize_t)line.size()) {
+			fprintf(stderr,
+					"[CF-append] failed to write feed %s: %s\n",
+					this->path.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		return 0;
+	}
+};
+
+/**
+ * Splits a feed line into the work unit name and the host ids.
+ */
+void feed_split(const std::string& line, std::string& name, std::vector<int>& hosts) {
+	std::istringstream in(line);
+	int hostid;
+	in >> name;
+	while (in >> hostid) { hosts.push_back(hostid); }
+}
+
+/**
+ * Reader side of the feed (used by the work generator). The whole feed (and
+ * the old feed, left by the last rotation) is read on the first poll
+ * (completions are idempotent), then only new lines.
+ */
+class CompletionFeedReader {
+
+protected:
+	std::string path;
+	off_t offset;
+	off_t old_offset;
+
+	/**
+	 * Reads the complete lines of a file starting at 'offset' (which is
+	 * advanced past them) and ending before 'limit' (if not negative).
+	 * Returns non zero if the file exists but cannot be read.
+	 */
+	static int read_lines(
+			const std::string& path,
+			off_t& offset,
+			std::vector<std::string>& lines,
+			off_t limit = -1) {
+		struct stat buffer;
+		std::string chunk;
+		size_t start, end;
+		ssize_t n;
+		int fd;
+
+		if (stat(path.c_str(), &buffer)) { return 0; }
+		if (limit >= 0 && limit < buffer.st_size) { buffer.st_size = limit; }
+		if (buffer.st_size <= offset) { return 0; }
+		if ((fd = open(path.c_str(), O_RDONLY)) < 0) {
+			fprintf(stderr,
+					"[CF-read_lines] failed to open feed %s: %s\n",
+					path.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		chunk.resize(buffer.st_size - offset);
+		n = pread(fd, &chunk[0], chunk.size(), offset);
+		close(fd);
+		if (n < 0) {
+			fprintf(stderr,
+					"[CF-read_lines] failed to read feed %s: %s\n",
+					path.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		chunk.resize(n);
+		// Only complete lines are consumed.
+		for(start = 0; (end = chunk.find('\n', start)) != std::string::npos; start = end + 1)
+		{ if (end > start) { lines.push_back(chunk.substr(start, end - start)); } }
+		offset += start;
+		return 0;
+	}
+
+public:
+	CompletionFeedReader(std::string path) : path(path + FEED_SUFFIX), offset(0), old_offset(0) {}
+
+	/**
+	 * Places the lines appended since the last poll into "lines" (see
+	 * feed_split). Returns non zero if the feed exists but cannot be read.
+	 */
+	int poll(std::vector<std::string>& lines) {
+		// Lines appended to the old feed before the writer noticed the rotation.
+		if (read_lines(this->path + FEED_OLD_SUFFIX, this->old_offset, lines)) { return 1; }
+		return read_lines(this->path, this->offset, lines);
+	}
+
+	/**
+	 * Rotates the feed. Must only be called once the effects of all lines
+	 * read so far are durable: the lines read so far are dropped, except the
+	 * ones whose work unit name passes 'keep' (they are copied, once, to the
+	 * new feed and read again by the next poll). Lines of the old feed that
+	 * were not read yet are copied as well (the old feed is replaced).
+	 * Returns non zero on error.
+	 */
+	int rotate(bool (*keep)(const std::string& name)) {
+		std::string old = this->path + FEED_OLD_SUFFIX;
+		std::vector<std::string> lines, unread;
+		std::set<std::string> names;
+		std::vector<int> hosts;
+		std::string kept, name;
+		off_t read = 0, old_read = this->old_offset;
+		int fd;
+
+		if (!this->offset) { return 0; }
+		// Lines kept by the last rotation are in the feed, but the old feed
+		// still has them if it crashed before copying them.
+		if (read_lines(old, read, lines, this->old_offset)) { return 1; }
+		read = 0;
+		if (read_lines(this->path, read, lines, this->offset)) { return 1; }
+		// Lines appended to the old feed since the last poll.
+		if (read_lines(old, old_read, unread)) { return 1; }
+		for(unsigned int i = 0; i < lines.size(); i++) {
+			hosts.clear();
+			feed_split(lines[i], name, hosts);
+			if (keep(name) && names.insert(name).second) { kept += lines[i] + '\n'; }
+		}
+		for(unsigned int i = 0; i < unread.size(); i++) { kept += unread[i] + '\n'; }
+		if (rename(this->path.c_str(), old.c_str())) {
+			fprintf(stderr,
+					"[CF-rotate] failed to rename feed %s: %s\n",
+					this->path.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		this->old_offset = this->offset;
+		this->offset = 0;
+		if (kept.empty()) { return 0; }
+		if ((fd = open(this->path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644)) < 0 ||
+				write(fd, kept.data(), kept.size()) != (ssize_t)kept.size()) {
+			fprintf(stderr,
+					"[CF-rotate] failed to write feed %s: %s\n",
+					this->path.c_str(),
+					strerror(errno));
+			if (fd >= 0) { close(fd); }
+			return 1;
+		}
+		close(fd);
+		return 0;
+	}
+};
+
+#endif /* MR_FEED_H_ */
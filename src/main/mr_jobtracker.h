@@ -2,77 +2,234 @@
 #define __MR_JOBTRACKER_H__
 
 #include <vector>
+#include <map>
+#include <unordered_map>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string>
 
-#define TASK_WAITING "w"
-#define TASK_CREATED "c"
-#define TASK_FINISHED "f"
+/**
+ * Task states. Each value is the character used for the state in the
+ * jobtracker XML file and in the state store (see mr_state.h).
+ */
+enum TaskState {
+	TASK_WAITING = 'w',		// waiting to be created
+	TASK_CREATED = 'c',		// already created
+	TASK_FINISHED = 'f'		// finished
+};
+
+// Maximum number of digits of a sequence number stored apart from a path.
+#define PATH_SEQ_DIGITS 9
+
+class TaskTable;
 
 /**
- * A MapReduce tasks is either a map or a reduce task.
+ * A MapReduce tasks is either a map or a reduce task. It is a small handle
+ * (table + index) to a task stored in a TaskTable. A default constructed
+ * handle is invalid (no task).
  */
 class MapReduceTask {
 
 protected:
 	/**
-	 * Unique task identifier.
+	 * Table holding this task.
+	 */
+	TaskTable* table;
+	/**
+	 * Index of this task inside the table.
+	 */
+	uint32_t index;
+
+public:
+	MapReduceTask() : table(NULL), index(0) {}
+	MapReduceTask(TaskTable* task_table, uint32_t task_index) :
+		table(task_table),
+		index(task_index) {}
+	bool isValid() const { return this->table != NULL; }
+	TaskTable* getTable() const { return this->table; }
+	uint32_t getIndex() const { return this->index; }
+	inline void setState(TaskState task_state);
+	inline TaskState getState() const;
+	inline std::string getInputPath() const;
+	inline std::string getOutputPath() const;
+	inline std::string getName() const;
+	/**
+	 * Dumps the current task state.
+	 */
+	void dump(FILE* io) const {
+		fprintf(io,
+				"\tname=%s, state=%c, input=%s, output=%s\n",
+				this->getName().c_str(),
+				this->getState(),
+				this->getInputPath().c_str(),
+				this->getOutputPath().c_str());
+	}
+};
+
+/**
+ * A task path (or name) is stored as an interned prefix, a sequence number
+ * and an interned suffix. For example, "/tmp/1-map-17.torrent" is stored as
+ * ("/tmp/1-map-", 17, ".torrent"); all tasks of a job share the same prefix
+ * and suffix strings.
+ */
+struct CompactPath {
+	uint32_t prefix;
+	int32_t seq;	// -1 if the path has no sequence number
+	uint32_t suffix;
+};
+
+/**
+ * TaskTable stores all map (or reduce) tasks of a job as a structure of
+ * arrays: names and paths are compact paths and the state is one byte per
+ * task. Waiting tasks are tracked in a bitset, so finding the next waiting
+ * task does not scan the table.
+ */
+class TaskTable {
+
+protected:
+	/**
+	 * Interned path fragments (prefixes and suffixes).
 	 */
-	std::string name;
+	std::vector<std::string> fragments;
+	std::map<std::string, uint32_t> fragment_ids;
 	/**
-	 * State can be one of the following values:
-	 * - "w" (if the task is waiting to be created)
-	 * - "c" (if the task is already created)
-	 * - "f" (if the task is finished)
+	 * One entry per task.
 	 */
-	std::string state;
+	std::vector<CompactPath> names;
+	std::vector<CompactPath> inputs;
+	std::vector<CompactPath> outputs;
+	std::vector<unsigned char> states;
 	/**
-	 * This state offset is used when we need to change the state of the task.
-	 * This offset is used to place the file pointer pointing to the offset
-	 * byte.
+	 * Bitset of waiting tasks and index of the first word that may have a bit
+	 * set.
 	 */
-	unsigned long state_offset;
+	std::vector<uint64_t> waiting;
+	uint32_t first_waiting_word;
 	/**
-	 * Input file path.
+	 * Number of finished and waiting tasks.
 	 */
-	std::string input;
+	uint32_t nfinished;
+	uint32_t nwaiting;
+
+	uint32_t intern(const std::string& fragment) {
+		std::map<std::string, uint32_t>::iterator it = this->fragment_ids.find(fragment);
+		if (it != this->fragment_ids.end()) { return it->second; }
+		this->fragments.push_back(fragment);
+		return this->fragment_ids[fragment] = this->fragments.size() - 1;
+	}
+
 	/**
-	 * Output file path.
+	 * Splits a path into prefix, sequence number (the last run of digits)
+	 * and suffix. Numbers with leading zeros or too many digits are left
+	 * inside the prefix (so that unpack always returns the same string).
 	 */
-	std::string output;
+	CompactPath pack(const std::string& path) {
+		CompactPath cp;
+		size_t end = path.find_last_of("0123456789");
+		size_t start = end == std::string::npos ?
+				end : path.find_last_not_of("0123456789", end);
+		start = start == std::string::npos ? 0 : start + 1;
+		if (end == std::string::npos ||
+				end + 1 - start > PATH_SEQ_DIGITS ||
+				(end > start && path[start] == '0')) {
+			cp.prefix = this->intern(path);
+			cp.seq = -1;
+			cp.suffix = this->intern("");
+			return cp;
+		}
+		cp.prefix = this->intern(path.substr(0, start));
+		cp.seq = atoi(path.c_str() + start);
+		cp.suffix = this->intern(path.substr(end + 1));
+		return cp;
+	}
+
+	std::string unpack(const CompactPath& cp) const {
+		char buf[16];
+		if (cp.seq < 0) { return this->fragments[cp.prefix] + this->fragments[cp.suffix]; }
+		sprintf(buf, "%d", cp.seq);
+		return this->fragments[cp.prefix] + buf + this->fragments[cp.suffix];
+	}
+
+	void setWaiting(uint32_t i, bool value) {
+		uint32_t word = i / 64;
+		if (value) {
+			this->waiting[word] |= 1ULL << (i % 64);
+			if (word < this->first_waiting_word) { this->first_waiting_word = word; }
+		}
+		else { this->waiting[word] &= ~(1ULL << (i % 64)); }
+	}
 
 public:
-	MapReduceTask(
-			std::string task_name,
-			std::string task_state,
-			int task_offset,
-			std::string task_input,
-			std::string task_output) :
-		name(task_name),
-		state(task_state),
-		state_offset(task_offset),
-		input(task_input),
-		output(task_output) {}
-	void setState(std::string task_state) { this->state = task_state; }
-	unsigned long getStateOffset() { return this->state_offset; }
-	const std::string& getState() { return this->state; }
-	const std::string& getInputPath() { return this->input; }
-	const std::string& getOutputPath() { return this->output; }
-	const std::string& getName() { return this->name; }
+	TaskTable() : first_waiting_word(0), nfinished(0), nwaiting(0) {}
+
+	uint32_t size() const { return this->states.size(); }
+	MapReduceTask operator[](uint32_t i) { return MapReduceTask(this, i); }
+
 	/**
-	 * Dumps the current task state.
+	 * Adds a task. Returns its index.
 	 */
-	void dump(FILE* io) {
-		fprintf(io,
-				"\tname=%s, state=%s, input=%s, output=%s, offset=%lu\n",
-				this->name.c_str(),
-				this->state.c_str(),
-				this->input.c_str(),
-				this->output.c_str(),
-				this->state_offset);
+	uint32_t add(
+			const std::string& name,
+			TaskState state,
+			const std::string& input,
+			const std::string& output) {
+		uint32_t i = this->size();
+		this->names.push_back(this->pack(name));
+		this->inputs.push_back(this->pack(input));
+		this->outputs.push_back(this->pack(output));
+		this->states.push_back(TASK_CREATED);
+		if (this->waiting.size() * 64 < this->states.size()) { this->waiting.push_back(0); }
+		this->setState(i, state);
+		return i;
+	}
+
+	void setState(uint32_t i, TaskState state) {
+		TaskState old = (TaskState)this->states[i];
+		if (old == state && state != TASK_WAITING) { return; }
+		if (old == TASK_FINISHED) { this->nfinished--; }
+		if (state == TASK_FINISHED) { this->nfinished++; }
+		if (old == TASK_WAITING && state != TASK_WAITING) { this->nwaiting--; }
+		if (old != TASK_WAITING && state == TASK_WAITING) { this->nwaiting++; }
+		this->setWaiting(i, state == TASK_WAITING);
+		this->states[i] = state;
+	}
+	TaskState getState(uint32_t i) const { return (TaskState)this->states[i]; }
+	std::string getName(uint32_t i) const { return this->unpack(this->names[i]); }
+	std::string getInputPath(uint32_t i) const { return this->unpack(this->inputs[i]); }
+	std::string getOutputPath(uint32_t i) const { return this->unpack(this->outputs[i]); }
+	uint32_t getFinished() const { return this->nfinished; }
+	uint32_t getWaiting() const { return this->nwaiting; }
+	/**
+	 * Number of created tasks (sent and not finished).
+	 */
+	uint32_t getRunning() const { return this->size() - this->nfinished - this->nwaiting; }
+
+	/**
+	 * Returns the lowest index of a waiting task (or -1 if no task is
+	 * waiting). Amortized constant time: words before first_waiting_word are
+	 * known to be empty.
+	 */
+	int64_t nextWaiting() {
+		for(; this->first_waiting_word < this->waiting.size(); this->first_waiting_word++) {
+			uint64_t word = this->waiting[this->first_waiting_word];
+			if (word) { return this->first_waiting_word * 64LL + __builtin_ctzll(word); }
+		}
+		return -1;
 	}
 };
 
+void MapReduceTask::setState(TaskState task_state)
+{ this->table->setState(this->index, task_state); }
+TaskState MapReduceTask::getState() const
+{ return this->table->getState(this->index); }
+std::string MapReduceTask::getInputPath() const
+{ return this->table->getInputPath(this->index); }
+std::string MapReduceTask::getOutputPath() const
+{ return this->table->getOutputPath(this->index); }
+std::string MapReduceTask::getName() const
+{ return this->table->getName(this->index); }
+
 /**
  * A MapReduce job comprehends a set of map tasks and a set of reduce tasks.
  */
@@ -86,23 +243,11 @@ protected:
 	/**
 	 * Map tasks.
 	 */
-	std::vector<MapReduceTask> maps;
+	TaskTable maps;
 	/**
 	 * Reduce tasks.
 	 */
-	std::vector<MapReduceTask> reds;
-	/**
-	 * Index (within maps vector) of the next map task to send.
-	 */
-	unsigned int next_map;
-	/**
-	 * Index (within reds vector) of the next reduce task to send.
-	 */
-	unsigned int next_red;
-	/**
-	 * Number of finished map tasks.
-	 */
-	unsigned int finished_map;
+	TaskTable reds;
 	/**
 	 * False if all the map and reduce tasks have already been sent.
 	 */
@@ -112,83 +257,248 @@ protected:
 	 */
 	bool shuffled;
 	/**
-	 * This shuffled offset is used when we need to change the state file.
-	 * This offset is used to place the file pointer pointing to the offset
-	 * byte.
+	 * Percentage of map tasks that must be finished before reduce tasks are
+	 * sent (reduce slow-start). Reducers sent before all maps are finished
+	 * receive the remaining map outputs while running.
+	 */
+	uint8_t slowstart;
+	/**
+	 * Share of the job when several jobs have unsent tasks (see
+	 * mr_scheduler.h). Never zero.
 	 */
-	int shuffled_offset;
+	uint32_t weight;
+	/**
+	 * Ids of the jobs (stages) this job depends on. The map inputs of a
+	 * dependent stage are the reduce outputs of its dependencies (see
+	 * expand_stage); its tasks are not sent until they are finished (see
+	 * update_dependencies).
+	 */
+	std::vector<std::string> after;
+	bool blocked;
 
 public:
 	MapReduceJob(std::string job_id) :
 		id(job_id),
-		next_map(0),
-		next_red(0),
-		finished_map(0),
 		unsent_tasks(true),
 		shuffled(false),
-		shuffled_offset(-1) {}
-	std::vector<MapReduceTask>& getMapTasks() { return this->maps; }
-	std::vector<MapReduceTask>& getReduceTasks() { return this->reds; }
+		slowstart(100),
+		weight(1),
+		blocked(false) {}
+	TaskTable& getMapTasks() { return this->maps; }
+	TaskTable& getReduceTasks() { return this->reds; }
 	/**
 	 * This method searches for an unsent map task. It returns an unsent map
-	 * task or NULL if there isn't one (all map tasks are created or finished).
+	 * task or an invalid task if there isn't one (all map tasks are created
+	 * or finished).
 	 */
-	MapReduceTask* getNextMap() {
-		for(; this->next_map < this->maps.size(); this->next_map++) {
-			if (!this->maps[this->next_map].getState().compare(TASK_WAITING))
-			{ return &(this->maps[this->next_map]); }
-		}
-		return NULL;
+	MapReduceTask getNextMap() {
+		int64_t i = this->maps.nextWaiting();
+		return i < 0 ? MapReduceTask() : this->maps[i];
 	}
 	/**
 	 * This method searches for an unsent reduce task. It returns an unsent
-	 * reduce task or NULL if there isn't one (all reduce tasks are created or
-	 * finished) or if there are unfinished map tasks.
+	 * reduce task or an invalid task if there isn't one (all reduce tasks are
+	 * created or finished) or if not enough map tasks are finished (see
+	 * slowstart).
 	 */
-	MapReduceTask* getNextReduce() {
-		for(; this->finished_map < this->maps.size(); this->finished_map++) {
-			if (this->maps[this->finished_map].getState().compare(TASK_FINISHED))
-			{ return NULL;}
-		}
-		for(; this->next_red < this->reds.size(); this->next_red++) {
-			if (!this->reds[this->next_red].getState().compare(TASK_WAITING))
-			{ return &(this->reds[this->next_red]); }
-		}
+	MapReduceTask getNextReduce() {
+		if (!this->reachedSlowStart()) { return MapReduceTask(); }
+		int64_t i = this->reds.nextWaiting();
+		if (i >= 0) { return this->reds[i]; }
 		this->unsent_tasks = false;
-		return NULL;
+		return MapReduceTask();
 	}
 	/**
 	 * Method to test if the job needs to be shuffled.
 	 */
 	bool needShuffle() {
-		return !shuffled ? this->finished_map == this->maps.size() : false;
+		return !shuffled ? this->maps.getFinished() == this->maps.size() : false;
 	}
 	void setShuffled(bool new_shuffled) { this->shuffled = new_shuffled; }
-	void setShuffledOffset(int new_shuffled_offset)
-	{ this->shuffled_offset = new_shuffled_offset; }
-	int getShuffledOffset() { return this->shuffled_offset; }
+	bool isShuffled() { return this->shuffled; }
+	/**
+	 * True if enough map tasks are finished to start sending reduce tasks.
+	 */
+	bool reachedSlowStart() {
+		return (uint64_t)this->maps.getFinished() * 100 >=
+				(uint64_t)this->maps.size() * this->slowstart;
+	}
+	void setSlowStart(uint8_t new_slowstart)
+	{ this->slowstart = new_slowstart > 100 ? 100 : new_slowstart; }
+	uint8_t getSlowStart() { return this->slowstart; }
+	void setWeight(uint32_t new_weight) { this->weight = new_weight ? new_weight : 1; }
+	uint32_t getWeight() { return this->weight; }
+	void addDependency(const std::string& job_id) { this->after.push_back(job_id); }
+	std::vector<std::string>& getDependencies() { return this->after; }
+	void setBlocked(bool new_blocked) { this->blocked = new_blocked; }
+	bool isBlocked() { return this->blocked; }
+	/**
+	 * True if all map and reduce tasks are finished.
+	 */
+	bool isFinished() {
+		return this->maps.getFinished() == this->maps.size() &&
+				this->reds.getFinished() == this->reds.size();
+	}
 	std::string getID() { return this->id; }
-	void addMapTask(const MapReduceTask& mrt) { this->maps.push_back(mrt); }
-	void addReduceTask(const MapReduceTask& mrt) { this->reds.push_back(mrt); }
+	void addMapTask(
+			const std::string& name,
+			TaskState state,
+			const std::string& input,
+			const std::string& output)
+	{ this->maps.add(name, state, input, output); }
+	void addReduceTask(
+			const std::string& name,
+			TaskState state,
+			const std::string& input,
+			const std::string& output)
+	{ this->reds.add(name, state, input, output); }
 	bool hasUnsentTasks() { return this->unsent_tasks; }
 	/**
 	 * Dumps the current job state.
 	 */
 	void dump(FILE* io) {
 		fprintf(io,
-				"MapReduceJob: id=%s, shuffled=%d\n",
+				"MapReduceJob: id=%s, shuffled=%d, slowstart=%d, weight=%u\n",
 				this->id.c_str(),
-				this->shuffled);
+				this->shuffled,
+				this->slowstart,
+				this->weight);
+		for(uint32_t i = 0; i < this->after.size(); i++)
+		{ fprintf(io, "\tafter=%s\n", this->after[i].c_str()); }
 		// print map tasks
 		fprintf(io,"Map Tasks:\n");
-		for(	std::vector<MapReduceTask>::iterator it = this->maps.begin();
-				it != this->maps.end();
-				++it) { it->dump(io); }
+		for(uint32_t i = 0; i < this->maps.size(); i++) { this->maps[i].dump(io); }
 		// print reduce tasks
 		fprintf(io,"Reduce Tasks:\n");
-		for(	std::vector<MapReduceTask>::iterator it = this->reds.begin();
-				it != this->reds.end();
-				++it) { it->dump(io); }
+		for(uint32_t i = 0; i < this->reds.size(); i++) { this->reds[i].dump(io); }
+	}
+};
+
+/**
+ * Returns the job with the given id (or NULL). Linear in the number of jobs
+ * (see TaskRegistry::getJob for frequent lookups).
+ */
+MapReduceJob* find_job(std::vector<MapReduceJob>& jobs, const std::string& id) {
+	for(uint32_t j = 0; j < jobs.size(); j++)
+	{ if (!jobs[j].getID().compare(id)) { return &jobs[j]; } }
+	return NULL;
+}
+
+/**
+ * Blocks the jobs with unfinished (or unknown) dependencies and unblocks the
+ * others. Must be called when jobs are loaded and when a job finishes.
+ */
+void update_dependencies(std::vector<MapReduceJob>& jobs) {
+	for(uint32_t j = 0; j < jobs.size(); j++) {
+		std::vector<std::string>& after = jobs[j].getDependencies();
+		bool blocked = false;
+		for(uint32_t d = 0; d < after.size() && !blocked; d++) {
+			MapReduceJob* dep = find_job(jobs, after[d]);
+			blocked = dep == NULL || !dep->isFinished();
+		}
+		jobs[j].setBlocked(blocked);
+	}
+}
+
+/**
+ * Creates the map tasks of a dependent stage (a job with dependencies and no
+ * map tasks): one map task per reduce task of each dependency (in order),
+ * reading the reduce output (a .torrent file) directly. Map outputs are
+ * placed next to the reduce outputs. Returns non zero if a dependency is
+ * unknown.
+ */
+int expand_stage(MapReduceJob& mrj, std::vector<MapReduceJob>& jobs) {
+	std::vector<std::string>& after = mrj.getDependencies();
+	char buf[32];
+	uint32_t seq = 0;
+
+	if (after.empty() || mrj.getMapTasks().size()) { return 0; }
+	for(uint32_t d = 0; d < after.size(); d++) {
+		MapReduceJob* dep = find_job(jobs, after[d]);
+		if (dep == NULL) { return 1; }
+		TaskTable& reds = dep->getReduceTasks();
+		for(uint32_t r = 0; r < reds.size(); r++, seq++) {
+			std::string input = reds.getOutputPath(r);
+			size_t slash = input.rfind('/');
+			std::string dir = slash == std::string::npos ? "" : input.substr(0, slash + 1);
+			sprintf(buf, "-map-%u", seq);
+			std::string name = mrj.getID() + buf;
+			mrj.addMapTask(name, TASK_WAITING, input, dir + name + ".zip");
+		}
+	}
+	return 0;
+}
+
+/**
+ * Position of a task (job index, task table and task index).
+ */
+struct TaskRef {
+	uint32_t job;
+	bool reduce;
+	uint32_t task;
+};
+
+/**
+ * TaskRegistry indexes all jobs (by id) and all tasks (by work unit name) of
+ * a jobs vector. It must be rebuilt if jobs are added to the vector.
+ */
+class TaskRegistry {
+
+protected:
+	std::vector<MapReduceJob>& jobs;
+	std::unordered_map<std::string, uint32_t> job_ids;
+	std::unordered_map<std::string, TaskRef> tasks;
+
+	void add_tasks(uint32_t job, bool reduce) {
+		TaskTable& table = reduce ?
+				this->jobs[job].getReduceTasks() : this->jobs[job].getMapTasks();
+		for(uint32_t i = 0; i < table.size(); i++) {
+			TaskRef ref = { job, reduce, i };
+			this->tasks[table.getName(i)] = ref;
+		}
+	}
+
+public:
+	TaskRegistry(std::vector<MapReduceJob>& jobs) : jobs(jobs) {}
+
+	void build() {
+		size_t ntasks = 0;
+		this->job_ids.clear();
+		this->tasks.clear();
+		for(uint32_t j = 0; j < this->jobs.size(); j++) {
+			ntasks += this->jobs[j].getMapTasks().size();
+			ntasks += this->jobs[j].getReduceTasks().size();
+		}
+		this->tasks.rehash(ntasks);
+		for(uint32_t j = 0; j < this->jobs.size(); j++) {
+			this->job_ids[this->jobs[j].getID()] = j;
+			this->add_tasks(j, false);
+			this->add_tasks(j, true);
+		}
+	}
+
+	/**
+	 * Returns the job with the given id (or NULL).
+	 */
+	MapReduceJob* getJob(const std::string& id) {
+		std::unordered_map<std::string, uint32_t>::iterator it =
+				this->job_ids.find(id);
+		return it == this->job_ids.end() ? NULL : &this->jobs[it->second];
+	}
+
+	/**
+	 * Returns the task with the given name (invalid if there is no such
+	 * task). The job of the task is placed into mrj (if not NULL).
+	 */
+	MapReduceTask getTask(const std::string& name, MapReduceJob** mrj = NULL) {
+		std::unordered_map<std::string, TaskRef>::iterator it =
+				this->tasks.find(name);
+		if (it == this->tasks.end()) { return MapReduceTask(); }
+		MapReduceJob& job = this->jobs[it->second.job];
+		if (mrj != NULL) { *mrj = &job; }
+		return it->second.reduce ?
+				job.getReduceTasks()[it->second.task] :
+				job.getMapTasks()[it->second.task];
 	}
 };
 
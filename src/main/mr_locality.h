@@ -0,0 +1,92 @@
+#ifndef __MR_LOCALITY_H__
+#define __MR_LOCALITY_H__
+
+/**
+ * This file contains the locality tracker used by the work generator. It
+ * keeps, for each running job, how many map outputs every host holds (hosts
+ * that returned a valid map result keep seeding its output, see mr_feed.h).
+ * Every map output carries data for all reducers (one torrent per reducer,
+ * see mr_shuffle.h), so the hosts holding most map outputs of a job already
+ * have most of the input of any of its reduce tasks. The work generator
+ * assigns reduce tasks to these hosts (see simple_work_generator.cpp), so
+ * fewer bytes cross the WAN during the shuffle.
+ */
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+
+class LocalityTracker {
+
+protected:
+	/**
+	 * Map outputs held by each host (by job id and host id).
+	 */
+	std::map<std::string, std::map<int, uint32_t> > outputs;
+	/**
+	 * Map tasks already registered (by job id). Completions may be seen more
+	 * than once (e.g., re-appended to the feed after a crash).
+	 */
+	std::map<std::string, std::set<std::string> > tasks;
+
+	struct ByOutputs {
+		std::map<int, uint32_t>& held;
+		ByOutputs(std::map<int, uint32_t>& held) : held(held) {}
+		bool operator()(int a, int b) {
+			std::map<int, uint32_t>::iterator ia = held.find(a), ib = held.find(b);
+			return (ia == held.end() ? 0 : ia->second) > (ib == held.end() ? 0 : ib->second);
+		}
+	};
+
+public:
+	/**
+	 * Registers the hosts holding the output of a map task of a job (only
+	 * once per task).
+	 */
+	void add(const std::string& job, const std::string& task, const std::vector<int>& hosts) {
+		if (!this->tasks[job].insert(task).second) { return; }
+		std::map<int, uint32_t>& held = this->outputs[job];
+		for(unsigned int i = 0; i < hosts.size(); i++) { held[hosts[i]]++; }
+	}
+
+	/**
+	 * Returns the number of map outputs of a job held by a host.
+	 */
+	uint32_t held(const std::string& job, int hostid) {
+		std::map<std::string, std::map<int, uint32_t> >::iterator it = this->outputs.find(job);
+		if (it == this->outputs.end()) { return 0; }
+		std::map<int, uint32_t>::iterator hit = it->second.find(hostid);
+		return hit == it->second.end() ? 0 : hit->second;
+	}
+
+	/**
+	 * Sorts 'hosts' by the number of map outputs of the job they hold (most
+	 * first, keeping the original order between equals).
+	 */
+	void rank(const std::string& job, std::vector<int>& hosts) {
+		std::stable_sort(hosts.begin(), hosts.end(), ByOutputs(this->outputs[job]));
+	}
+
+	/**
+	 * Places the hosts holding map outputs of a job into 'hosts' (most
+	 * outputs first).
+	 */
+	void getHosts(const std::string& job, std::vector<int>& hosts) {
+		std::map<int, uint32_t>::iterator it;
+		std::map<int, uint32_t>& held = this->outputs[job];
+		for(it = held.begin(); it != held.end(); ++it) { hosts.push_back(it->first); }
+		this->rank(job, hosts);
+	}
+
+	/**
+	 * Drops the data of a finished job.
+	 */
+	void forget(const std::string& job) {
+		this->outputs.erase(job);
+		this->tasks.erase(job);
+	}
+};
+
+#endif /* MR_LOCALITY_H_ */
@@ -0,0 +1,223 @@
+#ifndef __MR_METRICS_H__
+#define __MR_METRICS_H__
+
+/**
+ * This file contains the metrics kept by the server daemons (work generator
+ * and assimilator). Metrics are counters (only go up), gauges (current
+ * values) and histograms (e.g., seconds spent in a step, with cumulative
+ * buckets). Each metric may have several series, identified by their labels
+ * (e.g., job="1",phase="map", see metric_label).
+ * Metrics are written (at most once every METRICS_WRITE_INTERVAL seconds) in
+ * the Prometheus text format to a file (see the --collector.textfile option
+ * of the node exporter). The file is replaced atomically, so readers never
+ * see a partial file.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+#include <string>
+
+// Minimum interval between writes of the metrics file (seconds).
+#define METRICS_WRITE_INTERVAL 15
+
+// Bucket bounds (seconds) of latency histograms (server steps).
+static const double METRICS_LATENCY_BUCKETS[] =
+{ 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 60 };
+// Bucket bounds (seconds) of duration histograms (tasks).
+static const double METRICS_DURATION_BUCKETS[] =
+{ 60, 300, 900, 1800, 3600, 7200, 14400, 43200, 86400, 259200 };
+
+#define METRICS_BUCKETS(b) (b), sizeof(b) / sizeof(b[0])
+
+enum MetricType { METRIC_COUNTER, METRIC_GAUGE, METRIC_HISTOGRAM };
+
+/**
+ * Returns the label 'name="value"' (quotes and backslashes in the value are
+ * escaped). Labels are joined with commas.
+ */
+std::string metric_label(const char* name, const std::string& value) {
+	std::string label = std::string(name) + "=\"";
+	for(unsigned int i = 0; i < value.size(); i++) {
+		if (value[i] == '"' || value[i] == '\\') { label += '\\'; }
+		if (value[i] == '\n') { label += "\\n"; }
+		else { label += value[i]; }
+	}
+	return label + "\"";
+}
+
+class MetricsRegistry {
+
+protected:
+	struct Series {
+		/**
+		 * Value of counters and gauges, sum of the samples of histograms.
+		 */
+		double value;
+		/**
+		 * Samples of histograms (per bucket, not cumulative) and their count.
+		 */
+		std::vector<uint64_t> buckets;
+		uint64_t count;
+		Series() : value(0), count(0) {}
+	};
+
+	struct Metric {
+		MetricType type;
+		std::string help;
+		std::vector<double> bounds;
+		/**
+		 * Series by labels.
+		 */
+		std::map<std::string, Series> series;
+		Metric() : type(METRIC_GAUGE) {}
+	};
+
+	/**
+	 * Metrics by name (written in name order).
+	 */
+	std::map<std::string, Metric> metrics;
+	/**
+	 * Path of the metrics file.
+	 */
+	std::string path;
+	time_t last_write;
+
+	/**
+	 * Returns a series (metrics that were not declared are gauges).
+	 */
+	Series& get(const std::string& name, const std::string& labels) {
+		Metric& m = this->metrics[name];
+		Series& s = m.series[labels];
+		if (s.buckets.size() != m.bounds.size() + 1) { s.buckets.resize(m.bounds.size() + 1, 0); }
+		return s;
+	}
+
+	static void print(std::string& out, const std::string& name, const std::string& labels, double value) {
+		char buf[64];
+		out += name;
+		if (labels.size()) { out += "{" + labels + "}"; }
+		snprintf(buf, sizeof(buf), " %.15g\n", value);
+		out += buf;
+	}
+
+	static std::string join(const std::string& labels, const std::string& label)
+	{ return labels.size() ? labels + "," + label : label; }
+
+public:
+	MetricsRegistry(const std::string& path) : path(path), last_write(0) {}
+
+	/**
+	 * Declares a metric. Histograms need the (increasing) upper bounds of
+	 * their buckets (see METRICS_BUCKETS); an implicit +Inf bucket is added.
+	 */
+	void declare(
+			const std::string& name,
+			MetricType type,
+			const std::string& help,
+			const double* bounds = NULL,
+			size_t nbounds = 0) {
+		Metric& m = this->metrics[name];
+		m.type = type;
+		m.help = help;
+		m.bounds.assign(bounds, bounds + nbounds);
+	}
+
+	/**
+	 * Adds 'value' to a counter (or gauge).
+	 */
+	void add(const std::string& name, double value = 1, const std::string& labels = "")
+	{ this->get(name, labels).value += value; }
+
+	/**
+	 * Sets a gauge.
+	 */
+	void set(const std::string& name, double value, const std::string& labels = "")
+	{ this->get(name, labels).value = value; }
+
+	/**
+	 * Adds a sample to a histogram.
+	 */
+	void observe(const std::string& name, double sample, const std::string& labels = "") {
+		std::vector<double>& bounds = this->metrics[name].bounds;
+		Series& s = this->get(name, labels);
+		unsigned int i = 0;
+		while (i < bounds.size() && sample > bounds[i]) { i++; }
+		s.buckets[i]++;
+		s.count++;
+		s.value += sample;
+	}
+
+	/**
+	 * Drops all series of a metric (e.g., gauges of jobs that are gone).
+	 */
+	void clear(const std::string& name) { this->metrics[name].series.clear(); }
+
+	std::string getPath() { return this->path; }
+
+	/**
+	 * Returns all metrics in the Prometheus text format.
+	 */
+	std::string format() {
+		static const char* types[] = { "counter", "gauge", "histogram" };
+		std::map<std::string, Metric>::iterator it;
+		std::map<std::string, Series>::iterator sit;
+		std::string out;
+		char le[64];
+
+		for(it = this->metrics.begin(); it != this->metrics.end(); ++it) {
+			Metric& m = it->second;
+			if (m.help.size()) { out += "# HELP " + it->first + " " + m.help + "\n"; }
+			out += "# TYPE " + it->first + " " + types[m.type] + "\n";
+			for(sit = m.series.begin(); sit != m.series.end(); ++sit) {
+				Series& s = sit->second;
+				if (m.type != METRIC_HISTOGRAM) {
+					print(out, it->first, sit->first, s.value);
+					continue;
+				}
+				uint64_t cumulative = 0;
+				for(unsigned int i = 0; i < m.bounds.size(); i++) {
+					cumulative += s.buckets[i];
+					snprintf(le, sizeof(le), "%.15g", m.bounds[i]);
+					print(out, it->first + "_bucket", join(sit->first, metric_label("le", le)), cumulative);
+				}
+				print(out, it->first + "_bucket", join(sit->first, metric_label("le", "+Inf")), s.count);
+				print(out, it->first + "_sum", sit->first, s.value);
+				print(out, it->first + "_count", sit->first, s.count);
+			}
+		}
+		return out;
+	}
+
+	/**
+	 * Writes the metrics file (through a temporary file, renamed over the
+	 * previous one) now. Returns 0 on success.
+	 */
+	int flush() {
+		std::string tmp = this->path + ".tmp";
+		std::string contents = this->format();
+		FILE* f = fopen(tmp.c_str(), "w");
+		if (!f) { return 1; }
+		if (fwrite(contents.data(), 1, contents.size(), f) != contents.size()) {
+			fclose(f);
+			return 1;
+		}
+		if (fclose(f)) { return 1; }
+		return rename(tmp.c_str(), this->path.c_str());
+	}
+
+	/**
+	 * Writes the metrics file if the last write is older than
+	 * METRICS_WRITE_INTERVAL seconds. Returns 0 on success.
+	 */
+	int write(time_t now) {
+		if (now - this->last_write < METRICS_WRITE_INTERVAL) { return 0; }
+		this->last_write = now;
+		return this->flush();
+	}
+};
+
+#endif /* MR_METRICS_H_ */
@@ -8,92 +8,122 @@
 #include "mr_jobtracker.h"
 
 
+/**
+ * Converts a state string (from the XML file) into a TaskState.
+ */
+TaskState parse_state(const std::string& state) {
+	if (!state.compare("c")) { return TASK_CREATED; }
+	if (!state.compare("f")) { return TASK_FINISHED; }
+	return TASK_WAITING;
+}
+
 /**
  * Function that parses a MapReduce tasks (either a map or a reduce task).
  * It receives the file to read from and the job to which the task belong.
+ * Returns ERR_XML_PARSE if the task is malformed or truncated.
  */
 int parse_task(FILE* f, MapReduceJob& mpr) {
 	char buf[512];
 	std::string state;
 	std::string name;
-	unsigned long stateOffset = 0;
 	std::string input;
 	std::string output;
 	while (fgets(buf, 512, f)) {
         if (match_tag(buf, "</map>")) {
-        	mpr.addMapTask(MapReduceTask(name, state, stateOffset, input, output));
-        	break;
+        	mpr.addMapTask(name, parse_state(state), input, output);
+        	return 0;
         }
         else if (match_tag(buf, "</reduce>")) {
-        	mpr.addReduceTask(MapReduceTask(name, state, stateOffset, input, output));
-        	break;
+        	mpr.addReduceTask(name, parse_state(state), input, output);
+        	return 0;
         }
         else if (match_tag(buf, "<input>")) { parse_str(buf, "<input>", input); }
         else if (match_tag(buf, "<name>")) { parse_str(buf, "<name>", name); }
         else if (match_tag(buf, "<output>")) { parse_str(buf, "<output>", output); }
-        else if (match_tag(buf, "<status>")) {
-        	// *ALERT* - magic number 11.
-        	stateOffset = ftell(f) - 11;
-        	parse_str(buf, "<status>", state);
-        }
+        else if (match_tag(buf, "<status>")) { parse_str(buf, "<status>", state); }
         else {
         	// TODO - print decent message
         	printf("error=%s", buf);
         	return ERR_XML_PARSE; }
 	}
-	return 0;
+	return ERR_XML_PARSE;
 }
 
 /**
  * Function that parses a MapReduce job (set of map and reduce tasks).
  * It receives the file to read from and the vector of jobs where the new job
- * must be added.
+ * must be added. Returns ERR_XML_PARSE if the job is malformed, truncated or
+ * has no <id> before its other fields.
  */
 int parse_job(FILE* f, std::vector<MapReduceJob>& jobs) {
 	char buf[512];
 	std::string id;
-	int shuffledOffset = 0;
 	bool shuffled = false;
+	int slowstart = 100;
+	int weight = 1;
+	std::string after;
+	int retval;
 
 	while (fgets(buf, 512, f)) {
         if (match_tag(buf, "<id>")) {
+        	if (!id.empty()) { return ERR_XML_PARSE; }
         	parse_str(buf, "<id>", id);
+        	if (id.empty()) { return ERR_XML_PARSE; }
         	jobs.push_back(MapReduceJob(id));
         }
-        else if (match_tag(buf, "<map>")) { parse_task(f, jobs.back()); }
-        else if (match_tag(buf, "<reduce>")) { parse_task(f, jobs.back()); }
+        else if (match_tag(buf, "</mr>")) { return id.empty() ? ERR_XML_PARSE : 0; }
+        else if (match_tag(buf, "</id>")) { continue; }
+        // All other fields belong to the job (it needs an id first).
+        else if (id.empty()) {
+        	printf("error=%s", buf);
+        	return ERR_XML_PARSE;
+        }
+        else if (match_tag(buf, "<map>") || match_tag(buf, "<reduce>")) {
+        	if ((retval = parse_task(f, jobs.back()))) { return retval; }
+        }
         else if (match_tag(buf, "<shuffled>")) {
-        	// *ALERT* - magic number 13.
-        	shuffledOffset = ftell(f) - 13;
         	parse_bool(buf,"<shuffled>", shuffled);
         	jobs.back().setShuffled(shuffled);
-        	jobs.back().setShuffledOffset(shuffledOffset);
         }
-        else if (match_tag(buf, "</mr>")) { break; }
-        else if (match_tag(buf, "</id>")) { continue; }
+        else if (match_tag(buf, "<slowstart>")) {
+        	parse_int(buf,"<slowstart>", slowstart);
+        	jobs.back().setSlowStart(slowstart < 0 ? 0 : slowstart > 100 ? 100 : slowstart);
+        }
+        else if (match_tag(buf, "<after>")) {
+        	parse_str(buf, "<after>", after);
+        	jobs.back().addDependency(after);
+        }
+        else if (match_tag(buf, "<weight>")) {
+        	parse_int(buf,"<weight>", weight);
+        	jobs.back().setWeight(weight < 1 ? 1 : weight);
+        }
         else {
         	// TODO - print decent message
         	printf("error=%s", buf);
         	return ERR_XML_PARSE;
         }
     }
-
-	return 0;
+	// Truncated (no </mr>).
+	return ERR_XML_PARSE;
 }
 
 /**
  * Function that parses jobtracker state file.
  * It receives a file to read from and a vector of jobs to where jobs should be
  * added.
+ * Note: the XML file is only used to describe new jobs. Task states are kept
+ * in the jobtracker state store (see mr_state.h).
  * Note: XML files are assumed to have only one open tag per line.
- * Note: XML files are assumed to be well written.
+ * Returns the error of the first malformed job (the jobs parsed so far, and
+ * possibly part of the malformed one, are left in 'jobs').
  */
 int parse_jobtracker(FILE* f, std::vector<MapReduceJob>& jobs) {
     char buf[512];
+    int retval;
 
     while (fgets(buf, 512, f)) {
         if (match_tag(buf, "<mr>")) {
-        	parse_job(f, jobs);
+        	if ((retval = parse_job(f, jobs))) { return retval; }
         }
     }
 
@@ -0,0 +1,107 @@
+#ifndef __MR_RELIABILITY_H__
+#define __MR_RELIABILITY_H__
+
+/**
+ * This file contains the host reliability scores used by the work generator.
+ * Scores are built from the outcome of every result returned (or not) by a
+ * host: valid results raise the score; invalid results, client errors and
+ * timeouts lower it. The score is the fraction of good results with one good
+ * and one bad result added (so hosts without history score 0.5).
+ * Scores drive the replication of new work units: the quorum depends on the
+ * reliability of the active hosts, and reduce tasks are assigned to trusted
+ * hosts (see simple_work_generator.cpp).
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+// Score needed to trust a host.
+#define RELIABILITY_TRUSTED 0.95
+// Results needed (per host) before trusting a host.
+#define RELIABILITY_MIN_RESULTS 10
+// Hosts with no results for this long (seconds) are not active.
+#define RELIABILITY_ACTIVE_PERIOD (24*3600)
+
+// Result history of one host.
+struct HostHistory {
+	int valid;
+	int invalid;
+	int errors;
+	int timeouts;
+	/**
+	 * Last time a result of this host was decided.
+	 */
+	time_t last_seen;
+
+	HostHistory() : valid(0), invalid(0), errors(0), timeouts(0), last_seen(0) {}
+	int total() const { return this->valid + this->invalid + this->errors + this->timeouts; }
+	double score() const { return (this->valid + 1.0) / (this->total() + 2.0); }
+};
+
+class HostReliability {
+
+protected:
+	std::map<int, HostHistory> hosts;
+
+	bool active(const HostHistory& h, time_t now)
+	{ return now - h.last_seen <= RELIABILITY_ACTIVE_PERIOD; }
+
+	static bool by_score(const std::pair<double, int>& a, const std::pair<double, int>& b)
+	{ return a.first > b.first; }
+
+public:
+	/**
+	 * Records one decided result of a host.
+	 */
+	void addValid(int hostid, time_t when) { this->touch(hostid, when).valid++; }
+	void addInvalid(int hostid, time_t when) { this->touch(hostid, when).invalid++; }
+	void addError(int hostid, time_t when) { this->touch(hostid, when).errors++; }
+	void addTimeout(int hostid, time_t when) { this->touch(hostid, when).timeouts++; }
+
+	HostHistory& touch(int hostid, time_t when) {
+		HostHistory& h = this->hosts[hostid];
+		if (when > h.last_seen) { h.last_seen = when; }
+		return h;
+	}
+
+	double score(int hostid) {
+		std::map<int, HostHistory>::iterator it = this->hosts.find(hostid);
+		return it == this->hosts.end() ? HostHistory().score() : it->second.score();
+	}
+
+	/**
+	 * Returns the mean score of the active hosts (or -1 if there is none).
+	 */
+	double poolScore(time_t now) {
+		std::map<int, HostHistory>::iterator it;
+		double sum = 0;
+		int n = 0;
+		for(it = this->hosts.begin(); it != this->hosts.end(); ++it) {
+			if (!this->active(it->second, now)) { continue; }
+			sum += it->second.score();
+			n++;
+		}
+		return n ? sum / n : -1;
+	}
+
+	/**
+	 * Places the active trusted hosts (best scores first) into 'trusted'.
+	 */
+	void getTrusted(time_t now, std::vector<int>& trusted) {
+		std::map<int, HostHistory>::iterator it;
+		std::vector<std::pair<double, int> > ranked;
+		for(it = this->hosts.begin(); it != this->hosts.end(); ++it) {
+			if (!this->active(it->second, now) ||
+					it->second.total() < RELIABILITY_MIN_RESULTS ||
+					it->second.score() < RELIABILITY_TRUSTED) { continue; }
+			ranked.push_back(std::make_pair(it->second.score(), it->first));
+		}
+		std::stable_sort(ranked.begin(), ranked.end(), by_score);
+		for(unsigned int i = 0; i < ranked.size(); i++) { trusted.push_back(ranked[i].second); }
+	}
+};
+
+#endif /* MR_RELIABILITY_H_ */
@@ -0,0 +1,161 @@
+#ifndef __MR_SCHEDULER_H__
+#define __MR_SCHEDULER_H__
+
+/**
+ * This file contains the job schedulers used by the work generator. When
+ * several jobs have unsent tasks, the scheduler decides which job gets the
+ * next task. Schedulers only order the jobs: the work generator takes a task
+ * from the first job that has one available (reduce tasks may be waiting for
+ * maps) and then tells the scheduler which job was served.
+ * Policies:
+ * - fifo: jobs in file order (the first job starves the others);
+ * - priority: jobs with higher weight first (file order breaks ties);
+ * - fair: weighted fair share, the job with the fewest running tasks per
+ *   unit of weight first;
+ * - deficit: deficit round robin, every job earns its weight (scaled by
+ *   total/unfinished tasks, so jobs close to completion earn more) each time
+ *   a task is sent and the job with the largest credit is served (and pays
+ *   for what all jobs earned).
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <string>
+
+#include "mr_jobtracker.h"
+
+class JobScheduler {
+
+protected:
+	/**
+	 * Places the jobs with unsent tasks (and no unfinished dependencies) into
+	 * 'candidates' (file order).
+	 */
+	void candidates(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& candidates) {
+		std::vector<MapReduceJob>::iterator it;
+		for(it = jobs.begin(); it != jobs.end(); ++it)
+		{ if (it->hasUnsentTasks() && !it->isBlocked()) { candidates.push_back(&(*it)); } }
+	}
+
+public:
+	virtual ~JobScheduler() {}
+	/**
+	 * Places the jobs with unsent tasks into 'order' (most preferred first).
+	 */
+	virtual void order(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& order) = 0;
+	/**
+	 * Registers that a task of 'mrj' was sent.
+	 */
+	virtual void sent(MapReduceJob& mrj) {}
+	/**
+	 * Registers that 'mrj' had no task available (e.g., reduce tasks waiting
+	 * for maps).
+	 */
+	virtual void idle(MapReduceJob& mrj) {}
+};
+
+class FifoScheduler : public JobScheduler {
+public:
+	void order(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& order)
+	{ this->candidates(jobs, order); }
+};
+
+class PriorityScheduler : public JobScheduler {
+
+protected:
+	static bool by_weight(MapReduceJob* a, MapReduceJob* b)
+	{ return a->getWeight() > b->getWeight(); }
+
+public:
+	void order(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& order) {
+		this->candidates(jobs, order);
+		std::stable_sort(order.begin(), order.end(), by_weight);
+	}
+};
+
+class FairShareScheduler : public JobScheduler {
+
+protected:
+	static uint64_t running(MapReduceJob* mrj)
+	{ return mrj->getMapTasks().getRunning() + mrj->getReduceTasks().getRunning(); }
+
+	/**
+	 * running(a)/weight(a) < running(b)/weight(b), without divisions.
+	 */
+	static bool by_share(MapReduceJob* a, MapReduceJob* b)
+	{ return running(a) * b->getWeight() < running(b) * a->getWeight(); }
+
+public:
+	void order(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& order) {
+		this->candidates(jobs, order);
+		std::stable_sort(order.begin(), order.end(), by_share);
+	}
+};
+
+class DeficitScheduler : public JobScheduler {
+
+protected:
+	/**
+	 * Credit of each job (by job id).
+	 */
+	std::map<std::string, double> deficit;
+	/**
+	 * Credit earned by all jobs in the last call to order (paid by the job
+	 * that is served).
+	 */
+	double earned;
+
+	/**
+	 * Credit earned by a job in one round: its weight times total tasks over
+	 * unfinished tasks.
+	 */
+	static double quantum(MapReduceJob* mrj) {
+		uint64_t total = mrj->getMapTasks().size() + mrj->getReduceTasks().size();
+		uint64_t left = total - mrj->getMapTasks().getFinished() - mrj->getReduceTasks().getFinished();
+		return (double)mrj->getWeight() * total / (left ? left : 1);
+	}
+
+	struct ByDeficit {
+		std::map<std::string, double>& deficit;
+		ByDeficit(std::map<std::string, double>& deficit) : deficit(deficit) {}
+		bool operator()(MapReduceJob* a, MapReduceJob* b)
+		{ return deficit[a->getID()] > deficit[b->getID()]; }
+	};
+
+public:
+	DeficitScheduler() : earned(0) {}
+
+	void order(std::vector<MapReduceJob>& jobs, std::vector<MapReduceJob*>& order) {
+		this->candidates(jobs, order);
+		this->earned = 0;
+		for(unsigned int i = 0; i < order.size(); i++) {
+			double q = quantum(order[i]);
+			this->deficit[order[i]->getID()] += q;
+			this->earned += q;
+		}
+		std::stable_sort(order.begin(), order.end(), ByDeficit(this->deficit));
+	}
+
+	void sent(MapReduceJob& mrj) { this->deficit[mrj.getID()] -= this->earned; }
+	/**
+	 * Idle jobs do not keep credit (they would take over once they have tasks
+	 * again).
+	 */
+	void idle(MapReduceJob& mrj) { this->deficit[mrj.getID()] = 0; }
+};
+
+/**
+ * Returns a new scheduler given its name (NULL if the name is unknown).
+ */
+JobScheduler* new_scheduler(const char* name) {
+	if (!strcmp(name, "fifo")) { return new FifoScheduler(); }
+	if (!strcmp(name, "priority")) { return new PriorityScheduler(); }
+	if (!strcmp(name, "fair")) { return new FairShareScheduler(); }
+	if (!strcmp(name, "deficit")) { return new DeficitScheduler(); }
+	return NULL;
+}
+
+#endif /* MR_SCHEDULER_H_ */
@@ -0,0 +1,342 @@
+#ifndef __MR_SHUFFLE_H__
+#define __MR_SHUFFLE_H__
+
+/**
+ * This file contains the shuffle planner used by the work generator. Map tasks
+ * upload a (stored) zip with one .torrent per reducer (<map>-<reducer>.torrent)
+ * or, with MAP_SINGLE_TORRENT, a single .torrent shared by all reducers. Each
+ * reducer's input is a zip holding the .torrent files of its partition plus a
+ * manifest (".files", see unzip_files in data_handler.h).
+ * Reducer inputs are built incrementally: every time a map task finishes, its
+ * .torrent files are appended (as zip entries, without touching the disk
+ * otherwise) to a partial file next to each reducer input (<input>.part).
+ * Once the last map finishes, each partial file only needs a manifest and a
+ * zip central directory to become the reducer input (see finish). With reduce
+ * slow-start, a reducer input is written (with the entries added so far) when
+ * the reducer is sent, and the remaining entries are sent to it later; such
+ * inputs also hold the number of entries the reducer must wait for
+ * (".inputs").
+ * Partial files are rebuilt from the map outputs when the work generator
+ * starts (see reset), so a crash never leaves duplicated or missing entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <set>
+#include <vector>
+#include <string>
+
+#include "mr_jobtracker.h"
+#include "mr_state.h"
+
+#define SHUFFLE_PART_SUFFIX ".part"
+#define SHUFFLE_MANIFEST ".files"
+#define SHUFFLE_EXPECTED ".inputs"
+
+#define ZIP_LOCAL_SIGNATURE 0x04034b50
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE 0x06054b50
+#define ZIP_LOCAL_HEADER_SIZE 30
+// Bit 3 of the general purpose flags (sizes follow the data).
+#define ZIP_FLAG_DATA_DESCRIPTOR 0x08
+
+/**
+ * One (stored) zip entry.
+ */
+struct ZipEntry {
+	std::string name;
+	std::string data;
+};
+
+/**
+ * Helpers to encode and decode little endian zip fields.
+ */
+void zip_put_u16(std::string& b, uint16_t v) {
+	b.push_back((char)(v & 0xFF));
+	b.push_back((char)(v >> 8));
+}
+void zip_put_u32(std::string& b, uint32_t v) {
+	zip_put_u16(b, (uint16_t)(v & 0xFFFF));
+	zip_put_u16(b, (uint16_t)(v >> 16));
+}
+uint32_t zip_get(const std::string& b, size_t pos, int bytes) {
+	uint32_t v = 0;
+	for(int i = bytes - 1; i >= 0; i--) { v = (v << 8) | (unsigned char)b[pos + i]; }
+	return v;
+}
+
+/**
+ * Appends a stored entry (local header followed by the data) to "b".
+ */
+void zip_put_entry(std::string& b, const std::string& name, const std::string& data) {
+	zip_put_u32(b, ZIP_LOCAL_SIGNATURE);
+	zip_put_u16(b, 10);							// version needed (1.0)
+	zip_put_u16(b, 0);							// flags
+	zip_put_u16(b, 0);							// method (stored)
+	zip_put_u16(b, 0);							// time
+	zip_put_u16(b, 0x21);						// date (1980-01-01)
+	zip_put_u32(b, state_crc32(data.data(), data.size()));
+	zip_put_u32(b, data.size());				// compressed size
+	zip_put_u32(b, data.size());				// size
+	zip_put_u16(b, name.size());
+	zip_put_u16(b, 0);							// extra field length
+	b.append(name);
+	b.append(data);
+}
+
+/**
+ * Parses the local entries of a zip file contents (which may lack a central
+ * directory). Only stored entries are accepted. Returns non zero if "b" is
+ * not a valid zip.
+ */
+int zip_get_entries(const std::string& b, std::vector<ZipEntry>& entries) {
+	size_t pos = 0;
+	while (pos + ZIP_LOCAL_HEADER_SIZE <= b.size() &&
+			zip_get(b, pos, 4) == ZIP_LOCAL_SIGNATURE) {
+		uint32_t flags = zip_get(b, pos + 6, 2);
+		uint32_t method = zip_get(b, pos + 8, 2);
+		uint32_t size = zip_get(b, pos + 18, 4);
+		uint32_t name_len = zip_get(b, pos + 26, 2);
+		uint32_t extra_len = zip_get(b, pos + 28, 2);
+		size_t data = pos + ZIP_LOCAL_HEADER_SIZE + name_len + extra_len;
+		if (method != 0 || (flags & ZIP_FLAG_DATA_DESCRIPTOR) || data + size > b.size())
+		{ return 1; }
+		entries.push_back(ZipEntry());
+		entries.back().name = b.substr(pos + ZIP_LOCAL_HEADER_SIZE, name_len);
+		entries.back().data = b.substr(data, size);
+		pos = data + size;
+	}
+	return pos == 0;
+}
+
+/**
+ * Appends the central directory (and end record) describing all local entries
+ * found in "b" (written with zip_put_entry).
+ */
+void zip_put_directory(std::string& b) {
+	std::string dir;
+	size_t pos = 0, dir_size;
+	uint16_t count = 0;
+	while (pos + ZIP_LOCAL_HEADER_SIZE <= b.size() &&
+			zip_get(b, pos, 4) == ZIP_LOCAL_SIGNATURE) {
+		uint32_t size = zip_get(b, pos + 18, 4);
+		uint32_t name_len = zip_get(b, pos + 26, 2);
+		uint32_t extra_len = zip_get(b, pos + 28, 2);
+		zip_put_u32(dir, ZIP_CENTRAL_SIGNATURE);
+		zip_put_u16(dir, 10);					// version made by
+		dir.append(b, pos + 4, 26);				// same as the local header
+		dir[dir.size() - 2] = 0;				// no extra field
+		dir[dir.size() - 1] = 0;
+		zip_put_u16(dir, 0);					// comment length
+		zip_put_u16(dir, 0);					// disk number
+		zip_put_u16(dir, 0);					// internal attributes
+		zip_put_u32(dir, 0);					// external attributes
+		zip_put_u32(dir, pos);					// local header offset
+		dir.append(b, pos + ZIP_LOCAL_HEADER_SIZE, name_len);
+		pos += ZIP_LOCAL_HEADER_SIZE + name_len + extra_len + size;
+		count++;
+	}
+	dir_size = dir.size();
+	zip_put_u32(dir, ZIP_END_SIGNATURE);
+	zip_put_u16(dir, 0);						// disk number
+	zip_put_u16(dir, 0);						// directory disk
+	zip_put_u16(dir, count);
+	zip_put_u16(dir, count);
+	zip_put_u32(dir, dir_size);
+	zip_put_u32(dir, pos);						// directory offset
+	zip_put_u16(dir, 0);						// comment length
+	b.append(dir);
+}
+
+/**
+ * ShufflePlanner builds the reducer inputs of jobs (see top of file).
+ */
+class ShufflePlanner {
+
+protected:
+	/**
+	 * Jobs (ids) with a partial file that could not be updated. Their
+	 * partial files are rebuilt before finishing the shuffle.
+	 */
+	std::set<std::string> dirty;
+
+	std::string part_path(MapReduceJob& mrj, uint32_t reducer)
+	{ return mrj.getReduceTasks().getInputPath(reducer) + SHUFFLE_PART_SUFFIX; }
+
+	/**
+	 * Appends a buffer to a partial file (one write).
+	 */
+	int append(const std::string& path, const std::string& b) {
+		int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (fd < 0) { return 1; }
+		if (write(fd, b.data(), b.size()) != (ssize_t)b.size()) {
+			close(fd);
+			return 1;
+		}
+		close(fd);
+		return 0;
+	}
+
+	/**
+	 * Returns the reducer of a map output entry (<map>-<reducer>.torrent) or
+	 * -1 if the name does not follow this format.
+	 */
+	int64_t reducer_of(const std::string& name) {
+		size_t dash = name.rfind('-');
+		char* end;
+		if (dash == std::string::npos) { return -1; }
+		long r = strtol(name.c_str() + dash + 1, &end, 10);
+		return (end != name.c_str() + dash + 1 && !strcmp(end, ".torrent")) ? r : -1;
+	}
+
+public:
+	/**
+	 * Appends the output of a finished map task to the partial file of every
+	 * reducer. Returns zero on success.
+	 */
+	int add(MapReduceJob& mrj, MapReduceTask map) {
+		uint32_t nreds = mrj.getReduceTasks().size();
+		std::vector<std::string> parts(nreds);
+		std::vector<ZipEntry> entries;
+		std::string output;
+		int64_t r;
+
+		if (state_read_file(map.getOutputPath(), output)) {
+			fprintf(stderr,
+					"[SP-add] failed to read map output %s.\n",
+					map.getOutputPath().c_str());
+			this->dirty.insert(mrj.getID());
+			return 1;
+		}
+		if (output.size() >= 4 && zip_get(output, 0, 4) == ZIP_LOCAL_SIGNATURE) {
+			if (zip_get_entries(output, entries)) {
+				fprintf(stderr,
+						"[SP-add] malformed map output %s.\n",
+						map.getOutputPath().c_str());
+				this->dirty.insert(mrj.getID());
+				return 1;
+			}
+			for(uint32_t i = 0; i < entries.size(); i++) {
+				if ((r = this->reducer_of(entries[i].name)) < 0 || r >= nreds) { continue; }
+				zip_put_entry(parts[r], entries[i].name, entries[i].data);
+			}
+		}
+		else {
+			// One .torrent for all reducers (MAP_SINGLE_TORRENT).
+			for(r = 0; r < nreds; r++)
+			{ zip_put_entry(parts[r], map.getName() + ".torrent", output); }
+		}
+		for(r = 0; r < nreds; r++) {
+			if (parts[r].empty()) { continue; }
+			if (this->append(this->part_path(mrj, r), parts[r])) {
+				fprintf(stderr,
+						"[SP-add] failed to write %s: %s\n",
+						this->part_path(mrj, r).c_str(),
+						strerror(errno));
+				this->dirty.insert(mrj.getID());
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * Rebuilds the partial files of a job from the outputs of its finished
+	 * map tasks. Returns zero on success.
+	 */
+	int reset(MapReduceJob& mrj) {
+		TaskTable& maps = mrj.getMapTasks();
+		int retval = 0;
+		this->dirty.erase(mrj.getID());
+		for(uint32_t r = 0; r < mrj.getReduceTasks().size(); r++)
+		{ unlink(this->part_path(mrj, r).c_str()); }
+		for(uint32_t i = 0; i < maps.size(); i++) {
+			if (maps.getState(i) != TASK_FINISHED) { continue; }
+			if ((retval = this->add(mrj, maps[i]))) { break; }
+		}
+		return retval;
+	}
+
+	/**
+	 * Places the entries added so far for a reducer into "entries". Returns
+	 * zero on success.
+	 */
+	int getEntries(MapReduceJob& mrj, uint32_t reducer, std::vector<ZipEntry>& entries) {
+		std::string part;
+		// A reducer without entries has no partial file.
+		state_read_file(this->part_path(mrj, reducer), part);
+		if (!part.empty() && zip_get_entries(part, entries)) {
+			fprintf(stderr,
+					"[SP-getEntries] failed to read %s.\n",
+					this->part_path(mrj, reducer).c_str());
+			return 1;
+		}
+		return 0;
+	}
+
+	/**
+	 * Writes the input of a reducer with the entries added so far (manifest
+	 * and central directory are added). Partial inputs (reduce slow-start)
+	 * also hold the number of entries expected: one per map task (the exact
+	 * number once all map tasks are finished). The number of entries is
+	 * placed into nentries (if not NULL). Returns zero on success.
+	 */
+	int writeInput(MapReduceJob& mrj, uint32_t reducer, size_t* nentries = NULL, bool partial = false) {
+		TaskTable& maps = mrj.getMapTasks();
+		char expected[32];
+		std::vector<ZipEntry> entries;
+		std::string part, manifest;
+		std::string input = mrj.getReduceTasks().getInputPath(reducer);
+
+		if (this->dirty.count(mrj.getID()) && this->reset(mrj)) { return 1; }
+		if (this->getEntries(mrj, reducer, entries)) { return 1; }
+		for(uint32_t i = 0; i < entries.size(); i++) {
+			manifest += (i ? " " : "") + entries[i].name;
+			zip_put_entry(part, entries[i].name, entries[i].data);
+		}
+		zip_put_entry(part, SHUFFLE_MANIFEST, manifest + "\n");
+		if (partial) {
+			sprintf(expected, "%lu\n", (unsigned long)(maps.getFinished() == maps.size() ?
+					entries.size() : maps.size()));
+			zip_put_entry(part, SHUFFLE_EXPECTED, expected);
+		}
+		zip_put_directory(part);
+		if (state_write_file(input, part)) {
+			fprintf(stderr,
+					"[SP-writeInput] failed to write %s: %s\n",
+					input.c_str(),
+					strerror(errno));
+			return 1;
+		}
+		if (nentries != NULL) { *nentries = entries.size(); }
+		return 0;
+	}
+
+	/**
+	 * Writes the inputs of all reducers of a job (all map tasks finished).
+	 * Returns zero on success.
+	 */
+	int finish(MapReduceJob& mrj) {
+		for(uint32_t r = 0; r < mrj.getReduceTasks().size(); r++)
+		{ if (this->writeInput(mrj, r)) { return 1; } }
+		return 0;
+	}
+
+	/**
+	 * Removes the partial files of a job. They are kept after the shuffle
+	 * until all reduce tasks are finished (reducers sent before the shuffle
+	 * get the remaining entries from them).
+	 */
+	void cleanup(MapReduceJob& mrj) {
+		for(uint32_t r = 0; r < mrj.getReduceTasks().size(); r++)
+		{ unlink(this->part_path(mrj, r).c_str()); }
+	}
+};
+
+#endif /* MR_SHUFFLE_H_ */
@@ -0,0 +1,573 @@
+#ifndef __MR_STATE_H__
+#define __MR_STATE_H__
+
+/**
+ * This file contains the jobtracker state store. The state of every job and
+ * task lives in two files next to the jobtracker XML file:
+ * - a snapshot (<xml>.snap): all jobs and tasks, in a compact binary format;
+ * - a journal (<xml>.journal): append-only, checksummed records describing
+ * every state change since the snapshot was written.
+ * Changes are buffered and written with a single write and fdatasync (group
+ * commit, see commit). On startup, the snapshot is loaded and the journal is
+ * replayed (a torn record at the end of the journal, left by a crash, is
+ * dropped). Jobs found in the XML file and unknown to the store are imported
+ * (and so are jobs submitted to the spool directory while running, see
+ * importSpool).
+ * When the journal grows too large, a new snapshot is written (checkpoint).
+ * Both files carry a generation number: a journal only applies to the
+ * snapshot with the same generation, so a crash between writing a snapshot
+ * and resetting the journal is harmless.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <vector>
+#include <string>
+
+#include "mr_jobtracker.h"
+#include "mr_parser.h"
+
+#define STATE_SNAPSHOT_SUFFIX ".snap"
+#define STATE_JOURNAL_SUFFIX ".journal"
+#define STATE_SPOOL_SUFFIX ".spool"
+#define STATE_SNAPSHOT_MAGIC "FCSNAP04"
+#define STATE_JOURNAL_MAGIC "FCJRNL01"
+#define STATE_MAGIC_SIZE 8
+// Journal header: magic + generation.
+#define STATE_JOURNAL_HEADER_SIZE (STATE_MAGIC_SIZE + 8)
+// Journal record header: payload length + payload crc32.
+#define STATE_RECORD_HEADER_SIZE 8
+// A checkpoint is taken once the journal holds this many records.
+#define STATE_CHECKPOINT_RECORDS 1000000
+
+// Journal record types.
+#define RECORD_TASK_STATE 1
+#define RECORD_SHUFFLED 2
+
+/**
+ * Returns the crc32 (IEEE 802.3 polynomial, as used by zip) of a buffer.
+ */
+uint32_t state_crc32(const char* data, size_t size, uint32_t crc = 0) {
+	static uint32_t table[256];
+	static bool table_ready = false;
+	if (!table_ready) {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int k = 0; k < 8; k++) { c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1; }
+			table[i] = c;
+		}
+		table_ready = true;
+	}
+	crc = ~crc;
+	for(size_t i = 0; i < size; i++)
+	{ crc = table[(crc ^ (unsigned char)data[i]) & 0xFF] ^ (crc >> 8); }
+	return ~crc;
+}
+
+/**
+ * Helpers to encode integers and strings (host byte order, the state files
+ * never leave the server).
+ */
+void state_put_u8(std::string& b, uint8_t v) { b.append((const char*)&v, 1); }
+void state_put_u32(std::string& b, uint32_t v) { b.append((const char*)&v, 4); }
+void state_put_u64(std::string& b, uint64_t v) { b.append((const char*)&v, 8); }
+void state_put_str(std::string& b, const std::string& s) {
+	state_put_u32(b, s.size());
+	b.append(s);
+}
+
+/**
+ * Decoder for buffers written with the state_put_* helpers. Reading past the
+ * end of the buffer clears ok (and returns zeros).
+ */
+struct StateReader {
+	const char* pos;
+	const char* end;
+	bool ok;
+
+	StateReader(const char* data, size_t size) :
+		pos(data), end(data + size), ok(true) {}
+	bool get(void* v, size_t size) {
+		if (!ok || (size_t)(end - pos) < size) { ok = false; memset(v, 0, size); }
+		else { memcpy(v, pos, size); pos += size; }
+		return ok;
+	}
+	uint8_t u8() { uint8_t v; get(&v, 1); return v; }
+	uint32_t u32() { uint32_t v; get(&v, 4); return v; }
+	uint64_t u64() { uint64_t v; get(&v, 8); return v; }
+	std::string str() {
+		uint32_t size = u32();
+		if (!ok || (size_t)(end - pos) < size) { ok = false; return std::string(); }
+		pos += size;
+		return std::string(pos - size, size);
+	}
+};
+
+/**
+ * Reads a whole file into a string. Returns non zero if the file does not
+ * exist (or cannot be read).
+ */
+int state_read_file(const std::string& path, std::string& contents) {
+	struct stat buffer;
+	FILE* f;
+	if (stat(path.c_str(), &buffer) || !(f = fopen(path.c_str(), "rb")))
+	{ return 1; }
+	contents.resize(buffer.st_size);
+	if (buffer.st_size &&
+			fread(&contents[0], 1, buffer.st_size, f) != (size_t)buffer.st_size) {
+		fclose(f);
+		return 1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Writes a whole file (temporary file, fsync, rename).
+ */
+int state_write_file(const std::string& path, const std::string& contents) {
+	std::string tmp = path + ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) { return 1; }
+	if (write(fd, contents.data(), contents.size()) != (ssize_t)contents.size() ||
+			fsync(fd)) {
+		close(fd);
+		return 1;
+	}
+	close(fd);
+	return rename(tmp.c_str(), path.c_str());
+}
+
+/**
+ * JobStore keeps the jobtracker state (see top of file). All jobs live in a
+ * vector owned by the caller; tasks are identified in the journal by their
+ * job index and task index.
+ */
+class JobStore {
+
+protected:
+	/**
+	 * Jobtracker XML file path (the state files use it as prefix).
+	 */
+	std::string path;
+	/**
+	 * Jobs being tracked.
+	 */
+	std::vector<MapReduceJob>& jobs;
+	/**
+	 * Generation of the current snapshot (and journal).
+	 */
+	uint64_t generation;
+	/**
+	 * Journal file descriptor (-1 if the store is read only).
+	 */
+	int journal_fd;
+	/**
+	 * Records waiting for the next commit.
+	 */
+	std::string pending;
+	/**
+	 * Number of records in the journal (including pending ones).
+	 */
+	unsigned long records;
+
+	/**
+	 * Returns the index of a job (in the jobs vector).
+	 */
+	uint32_t job_index(MapReduceJob& mrj) { return &mrj - &this->jobs[0]; }
+
+	/**
+	 * Appends a record to the pending buffer.
+	 */
+	void append(const std::string& payload) {
+		state_put_u32(this->pending, payload.size());
+		state_put_u32(this->pending, state_crc32(payload.data(), payload.size()));
+		this->pending.append(payload);
+		this->records++;
+	}
+
+	/**
+	 * Applies one journal record. Returns non zero if the record does not
+	 * match the loaded jobs.
+	 */
+	int apply(StateReader& r) {
+		uint8_t type = r.u8();
+		uint32_t job = r.u32();
+		if (!r.ok || job >= this->jobs.size()) { return 1; }
+		if (type == RECORD_TASK_STATE) {
+			uint8_t reduce = r.u8();
+			uint32_t task = r.u32();
+			TaskState state = (TaskState)r.u8();
+			TaskTable& tasks = reduce ?
+					this->jobs[job].getReduceTasks() :
+					this->jobs[job].getMapTasks();
+			if (!r.ok || task >= tasks.size()) { return 1; }
+			tasks.setState(task, state);
+			return 0;
+		}
+		if (type == RECORD_SHUFFLED) {
+			this->jobs[job].setShuffled(true);
+			return 0;
+		}
+		return 1;
+	}
+
+	/**
+	 * Encodes all jobs (and tasks) into a snapshot buffer.
+	 */
+	void encode_snapshot(std::string& b, uint64_t snapshot_generation) {
+		std::vector<MapReduceJob>::iterator jit;
+		b.append(STATE_SNAPSHOT_MAGIC, STATE_MAGIC_SIZE);
+		state_put_u64(b, snapshot_generation);
+		state_put_u32(b, this->jobs.size());
+		for(jit = this->jobs.begin(); jit != this->jobs.end(); ++jit) {
+			state_put_str(b, jit->getID());
+			state_put_u8(b, jit->isShuffled());
+			state_put_u8(b, jit->getSlowStart());
+			state_put_u32(b, jit->getWeight());
+			state_put_u32(b, jit->getDependencies().size());
+			for(uint32_t d = 0; d < jit->getDependencies().size(); d++)
+			{ state_put_str(b, jit->getDependencies()[d]); }
+			encode_tasks(b, jit->getMapTasks());
+			encode_tasks(b, jit->getReduceTasks());
+		}
+		state_put_u32(b, state_crc32(b.data(), b.size()));
+	}
+
+	void encode_tasks(std::string& b, TaskTable& tasks) {
+		state_put_u32(b, tasks.size());
+		for(uint32_t i = 0; i < tasks.size(); i++) {
+			state_put_str(b, tasks.getName(i));
+			state_put_u8(b, tasks.getState(i));
+			state_put_str(b, tasks.getInputPath(i));
+			state_put_str(b, tasks.getOutputPath(i));
+		}
+	}
+
+	/**
+	 * Decodes a snapshot buffer into the jobs vector.
+	 */
+	int decode_snapshot(const std::string& b) {
+		uint32_t crc;
+		if (b.size() < STATE_MAGIC_SIZE + 4 ||
+				b.compare(0, STATE_MAGIC_SIZE, STATE_SNAPSHOT_MAGIC)) { return 1; }
+		memcpy(&crc, b.data() + b.size() - 4, 4);
+		if (crc != state_crc32(b.data(), b.size() - 4)) { return 1; }
+
+		StateReader r(b.data() + STATE_MAGIC_SIZE, b.size() - STATE_MAGIC_SIZE - 4);
+		this->generation = r.u64();
+		uint32_t njobs = r.u32();
+		this->jobs.reserve(njobs);
+		for(uint32_t j = 0; j < njobs && r.ok; j++) {
+			this->jobs.push_back(MapReduceJob(r.str()));
+			this->jobs.back().setShuffled(r.u8());
+			this->jobs.back().setSlowStart(r.u8());
+			this->jobs.back().setWeight(r.u32());
+			uint32_t ndeps = r.u32();
+			for(uint32_t d = 0; d < ndeps && r.ok; d++) { this->jobs.back().addDependency(r.str()); }
+			for(int reduce = 0; reduce < 2; reduce++) {
+				uint32_t ntasks = r.u32();
+				TaskTable& tasks = reduce ?
+						this->jobs.back().getReduceTasks() :
+						this->jobs.back().getMapTasks();
+				for(uint32_t t = 0; t < ntasks && r.ok; t++) {
+					std::string name = r.str();
+					TaskState state = (TaskState)r.u8();
+					std::string input = r.str();
+					std::string output = r.str();
+					tasks.add(name, state, input, output);
+				}
+			}
+		}
+		return !r.ok;
+	}
+
+	/**
+	 * Replays the journal. Returns the size of its valid prefix (0 if the
+	 * journal does not belong to the current snapshot).
+	 */
+	off_t replay(const std::string& b) {
+		uint64_t journal_generation;
+		size_t pos = STATE_JOURNAL_HEADER_SIZE;
+
+		if (b.size() < STATE_JOURNAL_HEADER_SIZE ||
+				b.compare(0, STATE_MAGIC_SIZE, STATE_JOURNAL_MAGIC)) { return 0; }
+		memcpy(&journal_generation, b.data() + STATE_MAGIC_SIZE, 8);
+		if (journal_generation != this->generation) { return 0; }
+		while (pos + STATE_RECORD_HEADER_SIZE <= b.size()) {
+			uint32_t size, crc;
+			memcpy(&size, b.data() + pos, 4);
+			memcpy(&crc, b.data() + pos + 4, 4);
+			const char* payload = b.data() + pos + STATE_RECORD_HEADER_SIZE;
+			if (size > b.size() - pos - STATE_RECORD_HEADER_SIZE) { break; }
+			if (crc != state_crc32(payload, size)) { break; }
+			StateReader r(payload, size);
+			if (this->apply(r)) { break; }
+			pos += STATE_RECORD_HEADER_SIZE + size;
+			this->records++;
+		}
+		if (pos < b.size()) {
+			fprintf(stderr,
+					"[JS-replay] dropping %lu bytes at the end of the journal.\n",
+					(unsigned long)(b.size() - pos));
+		}
+		return pos;
+	}
+
+	/**
+	 * Opens the journal for appending. A new journal (with the current
+	 * generation) is created if "valid" (the size of the valid prefix of the
+	 * existing journal) is zero.
+	 */
+	int open_journal(off_t valid) {
+		std::string journal = this->path + STATE_JOURNAL_SUFFIX;
+		if (valid == 0) {
+			std::string header(STATE_JOURNAL_MAGIC, STATE_MAGIC_SIZE);
+			state_put_u64(header, this->generation);
+			if (state_write_file(journal, header)) { return 1; }
+			valid = header.size();
+		}
+		if ((this->journal_fd = open(journal.c_str(), O_WRONLY)) < 0) { return 1; }
+		// Drop any torn record (so new records follow the valid prefix).
+		if (ftruncate(this->journal_fd, valid) ||
+				lseek(this->journal_fd, valid, SEEK_SET) < 0) { return 1; }
+		return 0;
+	}
+
+public:
+	JobStore(std::string path, std::vector<MapReduceJob>& jobs) :
+		path(path),
+		jobs(jobs),
+		generation(0),
+		journal_fd(-1),
+		records(0) {}
+	~JobStore() {
+		if (this->journal_fd >= 0) {
+			this->commit();
+			close(this->journal_fd);
+		}
+	}
+
+	/**
+	 * Adds the jobs described in an XML file (and not in the store yet).
+	 * Returns the number of jobs added (none if the file cannot be parsed).
+	 * 'rejected' (if not NULL) is set if the file cannot be parsed or adds no
+	 * job (e.g., a duplicate job id).
+	 */
+	size_t import(const std::string& xml, bool* rejected = NULL) {
+		std::vector<MapReduceJob> described;
+		std::vector<MapReduceJob>::iterator it, jit;
+		size_t added = 0;
+		FILE* f;
+
+		if (rejected) { *rejected = false; }
+		if (!(f = fopen(xml.c_str(), "r"))) { return 0; }
+		if (parse_jobtracker(f, described)) {
+			// Whole files or nothing (a job may be partially parsed).
+			fprintf(stderr, "[JS-import] failed to parse %s.\n", xml.c_str());
+			if (rejected) { *rejected = true; }
+			fclose(f);
+			return 0;
+		}
+		fclose(f);
+		for(it = described.begin(); it != described.end(); ++it) {
+			for(jit = this->jobs.begin(); jit != this->jobs.end(); ++jit)
+			{ if (!jit->getID().compare(it->getID())) { break; } }
+			if (jit == this->jobs.end()) {
+				this->jobs.push_back(*it);
+				added++;
+			}
+		}
+		if (rejected && !added) { *rejected = true; }
+		return added;
+	}
+
+	/**
+	 * Creates the map tasks of dependent stages (see expand_stage) and
+	 * updates the dependencies of all jobs. Returns true if tasks were
+	 * created.
+	 */
+	bool expand() {
+		std::vector<MapReduceJob>::iterator jit;
+		bool expanded = false;
+		for(jit = this->jobs.begin(); jit != this->jobs.end(); ++jit) {
+			uint32_t nmaps = jit->getMapTasks().size();
+			if (expand_stage(*jit, this->jobs)) {
+				fprintf(stderr,
+						"[JS-expand] job %s depends on an unknown job.\n",
+						jit->getID().c_str());
+			}
+			if (jit->getMapTasks().size() != nmaps) { expanded = true; }
+		}
+		update_dependencies(this->jobs);
+		return expanded;
+	}
+
+	/**
+	 * Loads the snapshot, replays the journal and imports new jobs from the
+	 * XML file. Read only stores (e.g., used by the assimilator) never modify
+	 * the state files.
+	 */
+	int load(bool read_only = false) {
+		std::string snapshot, journal;
+		bool has_snapshot, added, expanded;
+		off_t valid = 0;
+
+		this->jobs.clear();
+		has_snapshot = !state_read_file(this->path + STATE_SNAPSHOT_SUFFIX, snapshot);
+		if (has_snapshot && this->decode_snapshot(snapshot)) {
+			fprintf(stderr,
+					"[JS-load] corrupted snapshot %s%s.\n",
+					this->path.c_str(),
+					STATE_SNAPSHOT_SUFFIX);
+			return 1;
+		}
+		if (!state_read_file(this->path + STATE_JOURNAL_SUFFIX, journal))
+		{ valid = this->replay(journal); }
+
+		// Import jobs described in the XML file (and not in the store yet).
+		added = this->import(this->path) > 0;
+		expanded = this->expand();
+
+		if (read_only) { return 0; }
+		// New jobs or stages (or no snapshot at all) require a new snapshot
+		// (journal records refer to tasks in the snapshot).
+		if (!has_snapshot || added || expanded) { return this->checkpoint(); }
+		return this->open_journal(valid);
+	}
+
+	/**
+	 * Imports the jobs submitted to the spool directory (<xml>.spool, see
+	 * util/bt/submit_job.cpp) while running. Submitted files are renamed
+	 * into the spool once complete and removed once their jobs are in a
+	 * snapshot. Rejected files (see import) are kept, renamed to
+	 * <file>.rejected. Returns the number of jobs added (-1 on error).
+	 */
+	int importSpool() {
+		std::string spool = this->path + STATE_SPOOL_SUFFIX;
+		std::vector<std::string> files;
+		std::vector<bool> rejected;
+		struct dirent* entry;
+		bool expanded, bad;
+		int added = 0;
+		DIR* dir;
+
+		if (!(dir = opendir(spool.c_str()))) { return 0; }
+		while ((entry = readdir(dir))) {
+			std::string name = entry->d_name;
+			if (name.size() > 4 && !name.compare(name.size() - 4, 4, ".xml"))
+			{ files.push_back(spool + "/" + name); }
+		}
+		closedir(dir);
+		if (files.empty()) { return 0; }
+
+		// Submission order (file names start with the job id).
+		std::sort(files.begin(), files.end());
+		for(size_t i = 0; i < files.size(); i++) {
+			added += this->import(files[i], &bad);
+			rejected.push_back(bad);
+		}
+		expanded = this->expand();
+		if ((added || expanded) && this->checkpoint()) { return -1; }
+		for(size_t i = 0; i < files.size(); i++) {
+			if (rejected[i]) {
+				fprintf(stderr,
+						"[JS-importSpool] rejected %s (kept as %s.rejected).\n",
+						files[i].c_str(),
+						files[i].c_str());
+				if (rename(files[i].c_str(), (files[i] + ".rejected").c_str())) {
+					fprintf(stderr,
+							"[JS-importSpool] failed to rename %s: %s\n",
+							files[i].c_str(),
+							strerror(errno));
+				}
+				continue;
+			}
+			if (unlink(files[i].c_str())) {
+				fprintf(stderr,
+						"[JS-importSpool] failed to remove %s: %s\n",
+						files[i].c_str(),
+						strerror(errno));
+			}
+		}
+		return added;
+	}
+
+	/**
+	 * Returns the generation of the current snapshot (incremented by every
+	 * checkpoint).
+	 */
+	uint64_t getGeneration() { return this->generation; }
+
+	/**
+	 * Changes the state of a task (the change is durable after commit).
+	 */
+	void setTaskState(MapReduceJob& mrj, MapReduceTask mrt, TaskState state) {
+		std::string payload;
+		mrt.setState(state);
+		state_put_u8(payload, RECORD_TASK_STATE);
+		state_put_u32(payload, this->job_index(mrj));
+		state_put_u8(payload, mrt.getTable() == &mrj.getReduceTasks());
+		state_put_u32(payload, mrt.getIndex());
+		state_put_u8(payload, state);
+		this->append(payload);
+	}
+
+	/**
+	 * Marks a job as shuffled (the change is durable after commit).
+	 */
+	void setShuffled(MapReduceJob& mrj) {
+		std::string payload;
+		mrj.setShuffled(true);
+		state_put_u8(payload, RECORD_SHUFFLED);
+		state_put_u32(payload, this->job_index(mrj));
+		this->append(payload);
+	}
+
+	/**
+	 * Writes all pending records with one write and one fdatasync (group
+	 * commit). A checkpoint is taken if the journal is too large.
+	 */
+	int commit() {
+		if (this->journal_fd < 0 || this->pending.empty()) { return 0; }
+		if (write(this->journal_fd, this->pending.data(), this->pending.size()) !=
+				(ssize_t)this->pending.size() || fdatasync(this->journal_fd)) {
+			fprintf(stderr,
+					"[JS-commit] failed to write journal: %s\n",
+					strerror(errno));
+			return 1;
+		}
+		this->pending.clear();
+		if (this->records >= STATE_CHECKPOINT_RECORDS) { return this->checkpoint(); }
+		return 0;
+	}
+
+	/**
+	 * Writes a new snapshot (next generation) and starts an empty journal.
+	 */
+	int checkpoint() {
+		std::string snapshot;
+		this->encode_snapshot(snapshot, this->generation + 1);
+		if (state_write_file(this->path + STATE_SNAPSHOT_SUFFIX, snapshot)) {
+			fprintf(stderr,
+					"[JS-checkpoint] failed to write snapshot: %s\n",
+					strerror(errno));
+			return 1;
+		}
+		this->generation++;
+		this->pending.clear();
+		this->records = 0;
+		if (this->journal_fd >= 0) { close(this->journal_fd); }
+		return this->open_journal(0);
+	}
+};
+
+#endif /* MR_STATE_H_ */
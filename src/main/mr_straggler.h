@@ -0,0 +1,150 @@
+#ifndef __MR_STRAGGLER_H__
+#define __MR_STRAGGLER_H__
+
+/**
+ * This file contains the straggler monitor used by the work generator. It
+ * keeps the time at which every running task was sent (its first result, the
+ * time spent waiting in the feeder queue is not running time) and the
+ * durations of finished tasks (per job and phase, the last STRAGGLER_MAX_SAMPLES
+ * of each). A running task is a straggler once it
+ * has been running for longer than STRAGGLER_FACTOR times the median duration
+ * of its finished peers (at least STRAGGLER_MIN_SAMPLES of them) and for at
+ * least STRAGGLER_MIN_RUNTIME seconds. The work generator issues extra
+ * replicas of stragglers (see simple_work_generator.cpp).
+ */
+
+#include <time.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+#include <string>
+
+// A task is a straggler if it runs for longer than this times the median.
+#define STRAGGLER_FACTOR 1.5
+// Finished peers needed before looking for stragglers.
+#define STRAGGLER_MIN_SAMPLES 3
+// Durations kept per phase (the median follows the most recent ones).
+#define STRAGGLER_MAX_SAMPLES 100
+// Extra replicas issued for one task.
+#define STRAGGLER_MAX_REPLICAS 1
+// Tasks running for less than this (seconds) are never stragglers.
+#define STRAGGLER_MIN_RUNTIME 300
+
+class StragglerMonitor {
+
+protected:
+	struct RunningTask {
+		/**
+		 * Job and phase (see phase_key) of the task.
+		 */
+		std::string phase;
+		/**
+		 * Sent time of the first result (0 if none was sent yet).
+		 */
+		time_t start;
+		int replicas;
+	};
+	/**
+	 * Running tasks (by work unit name).
+	 */
+	std::map<std::string, RunningTask> running;
+	/**
+	 * Durations (seconds) of the last finished tasks, by job and phase.
+	 */
+	std::map<std::string, std::deque<time_t> > durations;
+
+	std::string phase_key(const std::string& job, bool reduce)
+	{ return job + (reduce ? "/reduce" : "/map"); }
+
+	/**
+	 * Returns the median duration of a phase (or -1 if there are not enough
+	 * samples).
+	 */
+	time_t median(const std::string& phase) {
+		std::map<std::string, std::deque<time_t> >::iterator it = this->durations.find(phase);
+		if (it == this->durations.end() || it->second.size() < STRAGGLER_MIN_SAMPLES) { return -1; }
+		std::vector<time_t> samples(it->second.begin(), it->second.end());
+		std::nth_element(samples.begin(), samples.begin() + samples.size() / 2, samples.end());
+		return samples[samples.size() / 2];
+	}
+
+public:
+	/**
+	 * Registers a task (work unit) that was created (none of its results was
+	 * sent yet, see sent).
+	 */
+	void started(const std::string& name, const std::string& job, bool reduce) {
+		RunningTask& rt = this->running[name];
+		rt.phase = this->phase_key(job, reduce);
+		rt.start = 0;
+		rt.replicas = 0;
+	}
+
+	/**
+	 * Registers that a result of a task was sent at 'when' (the earliest one
+	 * is the start of the task).
+	 */
+	void sent(const std::string& name, time_t when) {
+		std::map<std::string, RunningTask>::iterator it = this->running.find(name);
+		if (it == this->running.end() || !when) { return; }
+		if (!it->second.start || when < it->second.start) { it->second.start = when; }
+	}
+
+	/**
+	 * Registers the completion of a task and returns its duration. Tasks
+	 * created before the work generator (re)started, or never sent, are
+	 * ignored (-1 is returned).
+	 */
+	time_t finished(const std::string& name, time_t end) {
+		std::map<std::string, RunningTask>::iterator it = this->running.find(name);
+		if (it == this->running.end()) { return -1; }
+		if (!it->second.start) {
+			this->running.erase(it);
+			return -1;
+		}
+		time_t duration = end - it->second.start;
+		std::deque<time_t>& samples = this->durations[it->second.phase];
+		samples.push_back(duration);
+		if (samples.size() > STRAGGLER_MAX_SAMPLES) { samples.pop_front(); }
+		this->running.erase(it);
+		return duration;
+	}
+
+	/**
+	 * Drops the durations of a job (once all its tasks finished).
+	 */
+	void forget(const std::string& job) {
+		this->durations.erase(this->phase_key(job, false));
+		this->durations.erase(this->phase_key(job, true));
+	}
+
+	/**
+	 * Counts an extra replica of a task.
+	 */
+	void replicated(const std::string& name) {
+		std::map<std::string, RunningTask>::iterator it = this->running.find(name);
+		if (it != this->running.end()) { it->second.replicas++; }
+	}
+
+	/**
+	 * Places the running (sent) tasks that should get an extra replica into
+	 * 'stragglers' (see replicated).
+	 */
+	void getStragglers(time_t now, std::vector<std::string>& stragglers) {
+		std::map<std::string, RunningTask>::iterator it;
+		std::map<std::string, time_t> medians;
+		for(it = this->running.begin(); it != this->running.end(); ++it) {
+			if (it->second.replicas >= STRAGGLER_MAX_REPLICAS || !it->second.start) { continue; }
+			if (!medians.count(it->second.phase))
+			{ medians[it->second.phase] = this->median(it->second.phase); }
+			time_t m = medians[it->second.phase];
+			if (m < 0 || now - it->second.start <= STRAGGLER_MIN_RUNTIME ||
+					now - it->second.start <= STRAGGLER_FACTOR * m) { continue; }
+			stragglers.push_back(it->first);
+		}
+	}
+};
+
+#endif /* MR_STRAGGLER_H_ */
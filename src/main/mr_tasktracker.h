@@ -15,6 +15,7 @@
 
 #include <sstream>
 #include <map>
+#include <algorithm>
 #include <vector>
 #include <string>
 
@@ -51,9 +52,21 @@ protected:
 	 * Number of reducers in the current job.
 	 */
 	int nreds;
+	/**
+	 * Intermediate <K,V> pairs (sorted by key) loaded from the inputs.
+	 */
+	std::map<string, vector<string> > imap;
+	/**
+	 * Number of inputs (prefix of the inputs vector) already merged into imap.
+	 */
+	unsigned int merged;
+	/**
+	 * Non zero if the inputs could not be fetched (see getStatus).
+	 */
+	int status;
 
 public:
-	TaskTracker(int nmaps, int nreds) : nmaps(nmaps), nreds(nreds)  {
+	TaskTracker(int nmaps, int nreds) : nmaps(nmaps), nreds(nreds), merged(0), status(0) {
 		inputs = vector<string>();
 		outputs = vector<string>();
 	}
@@ -104,22 +117,29 @@ public:
 					string k,
 					vector<string> v,
 					std::map<string, vector<string> >* o)) {
-		vector<string>::iterator vit;
 		std::map<string, vector<string> >::iterator mit;
-		std::map<string, vector<string> > imap;
 		std::map<string, vector<string> > omap;
 
-		// For every input path, open file and load key,values.
-		for(vit = this->inputs.begin(); vit != this->inputs.end(); vit++)
-		{ this->readData(*vit, &imap); }
-		// For every <K,V> pair, call reduce function.
-		for(mit = imap.begin(); mit != imap.end(); mit++)
-		{ reduce_func(mit->first, mit->second, &omap); }
+		// For every input path not merged yet, open file and load key,values.
+		for(; this->merged < this->inputs.size(); this->merged++)
+		{ this->readData(this->inputs[this->merged], &this->imap); }
+		// For every <K,V> pair, call reduce function. Values are sorted first
+		// (inputs may be merged in any order, see INCREMENTAL_REDUCE) so that
+		// every replica produces the same output.
+		for(mit = this->imap.begin(); mit != this->imap.end(); mit++) {
+			std::sort(mit->second.begin(), mit->second.end());
+			reduce_func(mit->first, mit->second, &omap);
+		}
 		this->writeData(this->outputs.front(), &omap);
 		return 0;
 	}
 
 	virtual ~TaskTracker() { }
+	/**
+	 * Returns non zero if the inputs could not be fetched (the task must
+	 * fail, its inputs are incomplete).
+	 */
+	int getStatus() { return this->status; }
 	std::vector<std::string>* getInputs() { return &this->inputs; }
 	std::vector<std::string>* getOutputs() { return &this->outputs; }
 
@@ -205,7 +225,7 @@ public:
 			TaskTracker(nmaps, nreds) {
 		char buf[64];
 		this->inputs.push_back(string());
-		dh->get_input(this->inputs[0]);
+		this->status = dh->get_input(this->inputs[0]);
 		for(int i = 0; i < nreds; i++) {
 			sprintf(buf,"%d",i);
 			this->outputs.push_back(output_prefix + std::string(buf));
@@ -225,9 +245,26 @@ public:
 	 */
 	ReduceTracker(DataHandler* dh, string output, int nmaps, int nreds) :
 			TaskTracker(nmaps, nreds) {
-		dh->get_zipped_input(this->inputs);
+#if INCREMENTAL_REDUCE
+		// Inputs are merged while the remaining ones are being downloaded.
+		this->status = dh->get_incremental_input(this->inputs, merge_input, this);
+#else
+		this->status = dh->get_zipped_input(this->inputs);
+#endif
 		this->outputs.push_back(output);
 	}
+
+	/**
+	 * Callback for the incremental input mode. It merges a newly available
+	 * input file into the sorted intermediate map.
+	 * Note: inputs are handed over in the same order they are pushed into the
+	 * inputs vector (so merged is always a prefix of that vector).
+	 */
+	static void merge_input(const string& path, void* args) {
+		ReduceTracker* rt = (ReduceTracker*)args;
+		rt->readData(path, &rt->imap);
+		rt->merged++;
+	}
 };
 
 
@@ -0,0 +1,149 @@
+#ifndef __PIECE_HASHER_H__
+#define __PIECE_HASHER_H__
+
+/**
+ * This file contains a parallel replacement for libtorrent::set_piece_hashes.
+ * Pieces are split into contiguous ranges (one per thread) so that every
+ * thread reads its files sequentially and large inputs (or many small files)
+ * are hashed by all cores at once.
+ * SHA-1 is computed by libtorrent::hasher which, when libtorrent is built with
+ * TORRENT_USE_OPENSSL (see the Makefiles), uses OpenSSL. OpenSSL selects the
+ * fastest SHA-1 implementation at run time (SHA extensions, AVX2, SSSE3 or
+ * plain C) so no CPU detection is done here.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <vector>
+#include <string>
+
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/create_torrent.hpp"
+
+using std::string;
+using std::vector;
+
+/**
+ * Range of pieces hashed by one thread.
+ */
+struct PieceHasherJob {
+	/**
+	 * Files being hashed (shared by all threads, read only).
+	 */
+	const libtorrent::file_storage* fs;
+	/**
+	 * Directory containing the files (see set_piece_hashes).
+	 */
+	string root;
+	/**
+	 * First piece and one past the last piece of this range.
+	 */
+	int first, last;
+	/**
+	 * Hashes of the pieces in this range.
+	 */
+	vector<libtorrent::sha1_hash> hashes;
+	/**
+	 * Non zero if a file could not be read.
+	 */
+	int error;
+};
+
+/**
+ * Thread body: hashes all pieces of a PieceHasherJob. Pad files are hashed
+ * as zeros (they are never written to disk).
+ */
+void* hash_piece_range(void* args) {
+	PieceHasherJob* job = (PieceHasherJob*)args;
+	const libtorrent::file_storage& fs = *job->fs;
+	vector<char> buf(fs.piece_length());
+	vector<libtorrent::file_slice> slices;
+	vector<libtorrent::file_slice>::iterator sit;
+	int fd = -1, fd_index = -1, pos, size;
+
+	for(int piece = job->first; piece < job->last && !job->error; piece++) {
+		size = fs.piece_size(piece);
+		slices = fs.map_block(piece, 0, size);
+		for(pos = 0, sit = slices.begin(); sit != slices.end(); sit++) {
+			if (fs.pad_file_at(sit->file_index)) {
+				memset(&buf[0] + pos, 0, sit->size);
+				pos += sit->size;
+				continue;
+			}
+			// Keep the current file open (pieces are hashed in order).
+			if (sit->file_index != fd_index) {
+				string path = job->root + "/" + fs.file_path(sit->file_index);
+				if (fd >= 0) { close(fd); }
+				fd_index = sit->file_index;
+				if ((fd = open(path.c_str(), O_RDONLY)) < 0) {
+					fprintf(stderr,
+							"[PH-hash_piece_range] failed to open file %s: %s\n",
+							path.c_str(),
+							strerror(errno));
+					job->error = 1;
+					break;
+				}
+			}
+			if (pread(fd, &buf[0] + pos, sit->size, sit->offset) != sit->size) {
+				fprintf(stderr,
+						"[PH-hash_piece_range] failed to read piece %d\n",
+						piece);
+				job->error = 1;
+				break;
+			}
+			pos += sit->size;
+		}
+		job->hashes.push_back(libtorrent::hasher(&buf[0], size).final());
+	}
+	if (fd >= 0) { close(fd); }
+	return NULL;
+}
+
+/**
+ * Computes every piece hash of "t" (files are read from "root", as for
+ * set_piece_hashes) using "nthreads" threads (0 means one per core).
+ * Returns zero on success.
+ */
+int hash_pieces_parallel(
+		libtorrent::create_torrent& t,
+		const string& root,
+		int nthreads = 0) {
+	int npieces = t.num_pieces(), retval = 0;
+	vector<PieceHasherJob> jobs;
+	vector<pthread_t> threads;
+
+	if (nthreads <= 0) { nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN); }
+	if (nthreads > npieces) { nthreads = npieces; }
+	if (nthreads < 1) { nthreads = 1; }
+
+	jobs.resize(nthreads);
+	threads.resize(nthreads);
+	for(int i = 0; i < nthreads; i++) {
+		jobs[i].fs = &t.files();
+		jobs[i].root = root;
+		jobs[i].first = (int)((long long)npieces * i / nthreads);
+		jobs[i].last = (int)((long long)npieces * (i + 1) / nthreads);
+		jobs[i].error = 0;
+		if (pthread_create(&threads[i], NULL, hash_piece_range, &jobs[i])) {
+			// Hash this range in the calling thread instead.
+			hash_piece_range(&jobs[i]);
+			threads[i] = pthread_self();
+		}
+	}
+	for(int i = 0; i < nthreads; i++) {
+		if (!pthread_equal(threads[i], pthread_self()))
+		{ pthread_join(threads[i], NULL); }
+		if (jobs[i].error) { retval = 1; continue; }
+		// create_torrent is not thread safe (hashes are set here).
+		for(int piece = jobs[i].first; piece < jobs[i].last; piece++)
+		{ t.set_hash(piece, jobs[i].hashes[piece - jobs[i].first]); }
+	}
+	return retval;
+}
+
+#endif /* PIECE_HASHER_H_ */
@@ -0,0 +1,38 @@
+#ifndef __PIECE_SIZE_H__
+#define __PIECE_SIZE_H__
+
+/**
+ * This file contains the piece size selection used for every torrent created
+ * by freeCycles (inputs staged by scripts/setup_mr.sh and task outputs).
+ * Small pieces lower the latency of small files (a piece can only be shared
+ * after being fully downloaded and checked) but every piece costs 20 bytes of
+ * metadata and one HAVE message per peer. Large pieces do the opposite.
+ * Note: all replicas of a task must choose the same piece size (otherwise the
+ * resulting .torrent files, and info-hashes, would differ).
+ */
+
+// Smallest piece size (one BitTorrent block).
+#define PIECE_SIZE_MIN (16*1024)
+// Largest piece size.
+#define PIECE_SIZE_MAX (4*1024*1024)
+// Number of pieces wanted per expected downloader (so that downloaders have
+// enough pieces to trade among themselves).
+#define PIECES_PER_DOWNLOADER 64
+// Upper bound on the number of pieces (keeps .torrent files around 30KB).
+#define PIECES_MAX 1536
+
+/**
+ * Returns the piece size (a power of two between PIECE_SIZE_MIN and
+ * PIECE_SIZE_MAX) for a torrent with "total" bytes, expected to be downloaded
+ * by "downloaders" peers (e.g., the replication factor times the number of
+ * reducers for a map output).
+ */
+int choose_piece_size(long long total, int downloaders) {
+	long long pieces = PIECES_PER_DOWNLOADER * (long long)(downloaders > 0 ? downloaders : 1);
+	long long size = PIECE_SIZE_MIN;
+	if (pieces > PIECES_MAX) { pieces = PIECES_MAX; }
+	while (size < PIECE_SIZE_MAX && size * pieces < total) { size *= 2; }
+	return (int)size;
+}
+
+#endif /* PIECE_SIZE_H_ */
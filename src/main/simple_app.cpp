@@ -17,12 +17,16 @@
 #include "benchmarks.h"
 
 /*
- * Usage: freeCycles-wrapper [-d D] [-u U] [-s S] [-t T] -map M -red R
+ * Usage: freeCycles-wrapper [-d D] [-u U] [-s S] [-t T] [-c C] [-a A] [-r R] -map M -red R
  * Options:
  *  -d    Download rate limit (KBps)
  *  -u    Upload rate limit (KBps)
  *  -s    Location for the shared directory
  *  -t    Tracker to use for peer discovery
+ *  -c    Shared directory cache budget (MB)
+ *  -a    BitTorrent agent executable (started if not running, default: the
+ *        "bt_agent" file of the app version)
+ *  -r    Replication factor (replicas of each task, used to size pieces)
  *  -map  Number of mappers
  *  -red  Number of reducers
  */
@@ -36,8 +40,13 @@
 int download_rate=0;
 // Upload limit: KBps (default = 0, unlimited)
 int upload_rate=0;
+// Shared directory budget: bytes (default = 4GB)
+long long cache_budget=CACHE_DEFAULT_BUDGET;
 // Shared uploads.
 std::string shared_dir = "/tmp/freeCycles-shared/";
+// Host BitTorrent agent (default: the "bt_agent" file of the app version).
+#define BT_AGENT_FILENAME "bt_agent"
+std::string agent_path;
 // Private downloads.
 std::string working_dir;
 // Tracker URL to use.
@@ -53,6 +62,63 @@ std::string wu_name;
 int nmaps = 0;
 // Number of reducers
 int nreds = 0;
+// Replicas of each task (default = 3, same as the work generator)
+int replication = 3;
+
+#if not STANDALONE
+// Largest late input message (same as a BOINC message to host).
+#define LATE_INPUT_MSG_SIZE 262144
+// Interval between requests for late inputs (seconds).
+#define LATE_INPUT_POLL_INTERVAL 300
+
+/*
+ * Late inputs (reduce slow-start). Map outputs finished after a reduce task
+ * was created are sent by the work generator as trickle-down messages, each
+ * one with a list of <torrent><name>N</name><data>HEX</data></torrent> (see
+ * send_late_inputs in simple_work_generator.cpp). Once all map tasks are
+ * finished, a message also holds the final number of inputs
+ * (<inputs>N</inputs>), placed into 'expected'. While inputs are missing, a
+ * trickle-up is sent every LATE_INPUT_POLL_INTERVAL seconds so that the
+ * client contacts the scheduler (and gets pending messages).
+ */
+void receive_late_inputs(
+		const std::string& wdir,
+		std::vector<std::string>& torrents,
+		unsigned int& expected) {
+	static char* msg = new char[LATE_INPUT_MSG_SIZE];
+	static double last_poll = 0;
+	std::string m, name, data;
+	size_t pos, end;
+	FILE* f;
+
+	while (boinc_receive_trickle_down(msg, LATE_INPUT_MSG_SIZE)) {
+		m = msg;
+		if ((pos = m.find("<inputs>")) != std::string::npos)
+		{ expected = strtoul(m.c_str() + pos + 8, NULL, 10); }
+		for(pos = m.find("<torrent>"); pos != std::string::npos; pos = m.find("<torrent>", end)) {
+			if ((end = m.find("</torrent>", pos)) == std::string::npos) { break; }
+			size_t n = m.find("<name>", pos), d = m.find("<data>", pos);
+			if (n > end || d > end) { continue; }
+			name = m.substr(n + 6, m.find("</name>", n) - n - 6);
+			data.clear();
+			for(d += 6; d + 1 < end && m[d] != '<'; d += 2)
+			{ data += (char)strtol(m.substr(d, 2).c_str(), NULL, 16); }
+			if (name.empty() || name.find('/') != std::string::npos) { continue; }
+			if (!(f = fopen((wdir + name).c_str(), "wb"))) {
+				error_log("WRAPPER-receive_late_inputs", "failed to write", name.c_str());
+				continue;
+			}
+			fwrite(data.data(), 1, data.size(), f);
+			fclose(f);
+			torrents.push_back(wdir + name);
+		}
+	}
+	if (dtime() - last_poll > LATE_INPUT_POLL_INTERVAL) {
+		boinc_send_trickle_up((char*)"late_input", (char*)"<waiting/>\n");
+		last_poll = dtime();
+	}
+}
+#endif
 
 /*
  * Command line processing.
@@ -68,6 +134,12 @@ int process_cmd_args(int argc, char** argv) {
 		{ shared_dir = argv[++arg_index]; }
 		else if (!strcmp(argv[arg_index], "-t"))
 		{ tracker_url = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-c"))
+		{ cache_budget = atoll(argv[++arg_index]) * 1024 * 1024; }
+		else if (!strcmp(argv[arg_index], "-a"))
+		{ agent_path = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-r"))
+		{ replication = atoi(argv[++arg_index]); }
 		else if (!strcmp(argv[arg_index], "-map"))
 		{ nmaps = atoi(argv[++arg_index]); }
 		else if (!strcmp(argv[arg_index], "-red"))
@@ -87,7 +159,9 @@ int process_cmd_args(int argc, char** argv) {
 
 int main(int argc, char **argv) {
 	std::string input_path, output_path;
-#if BITTORRENT
+#if BITTORRENT && BT_AGENT
+	AgentHandler* dh = NULL;
+#elif BITTORRENT
 	BitTorrentHandler* dh = NULL;
 #else
 	DataHandler* dh = NULL;
@@ -97,9 +171,10 @@ int main(int argc, char **argv) {
 	pid_t pid;
 #if not STANDALONE
     APP_INIT_DATA boinc_data;
+    BOINC_OPTIONS boinc_options;
 #endif
 
-#if BITTORRENT
+#if BITTORRENT && !BT_AGENT
     // Ignore SIGTERM (I use this to keep a child process running for a bit
     // longer after the parent calls boinc_finish).
     if (signal(SIGTERM, SIG_IGN) == SIG_ERR) {
@@ -110,8 +185,10 @@ int main(int argc, char **argv) {
     if((retval = process_cmd_args(argc, argv))) { goto fail; }
 
 #if not STANDALONE
-    // Initialize BOINC.
-    if ((retval = boinc_init())) {
+    // Initialize BOINC (trickle-down messages carry late inputs).
+    boinc_options_defaults(boinc_options);
+    boinc_options.handle_trickle_downs = true;
+    if ((retval = boinc_init_options(&boinc_options))) {
     	// FIXME - send the error value
     	error_log("WRAPPER-main", "boinc_init returned with error", "");
         goto fail;
@@ -119,6 +196,14 @@ int main(int argc, char **argv) {
     // Resolve input and output files' logical name (.torrent files).
     boinc_resolve_filename_s(BOINC_INPUT_FILENAME, input_path);
     boinc_resolve_filename_s(BOINC_OUTPUT_FILENAME, output_path);
+#if BITTORRENT && BT_AGENT
+    if (agent_path.empty() &&
+    		boinc_resolve_filename_s(BT_AGENT_FILENAME, agent_path)) {
+    	error_log("WRAPPER-main", "failed to resolve", BT_AGENT_FILENAME);
+    	retval = 1;
+    	goto fail;
+    }
+#endif
     // Resolve WU name.
     boinc_get_init_data(boinc_data);
     wu_name = std::string(boinc_data.wu_name);
@@ -146,15 +231,35 @@ int main(int argc, char **argv) {
 
     working_dir = std::string("/tmp/") + wu_name + "/";
 
-#if BITTORRENT
+#if BITTORRENT && BT_AGENT
+    dh = new AgentHandler(
+    		input_path,	output_path,
+    		working_dir, shared_dir,
+    		tracker_url, wu_name, agent_path);
+    if((retval = dh->init(download_rate, upload_rate, cache_budget))) {
+    	error_log("WRAPPER-main", "failed to contact BitTorrent agent", "");
+    	goto fail;
+    }
+#elif BITTORRENT
     dh = new BitTorrentHandler(
     		input_path,	output_path,
     		working_dir, shared_dir,
     		tracker_url, wu_name);
-    dh->init(download_rate, upload_rate);
+    dh->init(download_rate, upload_rate, cache_budget);
 #else
     dh = new DataHandler(input_path, output_path, working_dir);
 #endif
+#if BITTORRENT
+    // Map outputs are downloaded by every replica of the reducer(s) that need
+    // them. Reduce outputs are only downloaded by the server.
+    if(wu_name.find("map") != std::string::npos) {
+#if MAP_SINGLE_TORRENT
+    	dh->setDownloaders(replication * nreds);
+#else
+    	dh->setDownloaders(replication);
+#endif
+    }
+#endif
 
 #if DEBUG
     	debug_log("[WRAPPER-main]", "running task:", wu_name.c_str());
@@ -164,11 +269,19 @@ int main(int argc, char **argv) {
 
     // map task
     if(wu_name.find("map") != std::string::npos) {
-#if BITTORRENT
+#if BITTORRENT && MAP_SINGLE_TORRENT
+    	// All map outputs go into one directory (one multi-file torrent).
+    	init_dir(shared_dir + wu_name + "/");
+    	tt = new MapTracker(dh, shared_dir + wu_name + "/" + wu_name+"-", nmaps, nreds);
+#elif BITTORRENT
     	tt = new MapTracker(dh, shared_dir + wu_name+"-", nmaps, nreds);
 #else
     	tt = new MapTracker(dh, working_dir + wu_name+"-", nmaps, nreds);
 #endif
+    	if ((retval = tt->getStatus())) {
+    		error_log("WRAPPER-main", "failed to get input of", wu_name.c_str());
+    		goto fail;
+    	}
 #if DEBUG
     	debug_log("[WRAPPER-main]", "input downloaded.", "");
 #endif
@@ -181,27 +294,45 @@ int main(int argc, char **argv) {
 #if DEBUG
     	debug_log("[WRAPPER-main]", "map done.", "");
 #endif
-    	dh->stage_zipped_output(*(tt->getOutputs()));
+    	if ((retval = dh->stage_zipped_output(*(tt->getOutputs())))) {
+    		error_log("WRAPPER-main", "failed to stage outputs of", wu_name.c_str());
+    		goto fail;
+    	}
     }
     // reduce task
     else if (wu_name.find("reduce") != std::string::npos){
+#if BITTORRENT && INCREMENTAL_REDUCE && !STANDALONE
+    	// Reducers may start before all map outputs exist (slow-start, the
+    	// input tells how many to wait for).
+    	dh->setLateInputs(receive_late_inputs);
+#endif
 #if BITTORRENT
     	tt = new ReduceTracker(dh, shared_dir + wu_name, nmaps, nreds);
 #else
     	tt = new ReduceTracker(dh, working_dir + wu_name, nmaps, nreds);
 #endif
+    	if ((retval = tt->getStatus())) {
+    		error_log("WRAPPER-main", "failed to get inputs of", wu_name.c_str());
+    		goto fail;
+    	}
         tt->reduce(pr_reduce);
         dh->stage_output(tt->getOutputs()->front());
     }
     // parallel task // TODO - test! Check server side scripts!
     else if (wu_name.find("parallel") != std::string::npos){
     	std::string input, output;
-    	dh->get_input(input);
+    	if ((retval = dh->get_input(input))) {
+    		error_log("WRAPPER-main", "failed to get input of", wu_name.c_str());
+    		goto fail;
+    	}
     	output = wu_name+"-0";
     	canny(input,output);
     	std::vector<std::string> outputs = std::vector<std::string>();
     	outputs.push_back(output);
-    	dh->stage_zipped_output(outputs);
+    	if ((retval = dh->stage_zipped_output(outputs))) {
+    		error_log("WRAPPER-main", "failed to stage outputs of", wu_name.c_str());
+    		goto fail;
+    	}
     }
     // unknown task
     else {
@@ -221,7 +352,8 @@ int main(int argc, char **argv) {
 
     // Hack: process is cloned. Parent calls boinc_finish and the child keeps
     // running a BitTorrent client for some time.
-#if BITTORRENT
+    // Note: not needed with the host agent (it keeps seeding the outputs).
+#if BITTORRENT && !BT_AGENT
     if(!(pid = fork())) {
 
     	// Child.
@@ -229,7 +361,7 @@ int main(int argc, char **argv) {
         		input_path, output_path,
         		working_dir, shared_dir,
         		tracker_url, wu_name);
-    	dh->init(download_rate, upload_rate);
+    	dh->init(download_rate, upload_rate, cache_budget);
     	boinc_sleep(3600);
     	delete dh;
     	exit(retval);
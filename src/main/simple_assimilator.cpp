@@ -20,8 +20,10 @@
 // 2) if failure, append a message to an error log
 
 #include <vector>
+#include <set>
 #include <string>
 #include <cstdlib>
+#include <cstdarg>
 
 #include "boinc_db.h"
 #include "error_numbers.h"
@@ -29,90 +31,148 @@
 #include "sched_msgs.h"
 #include "validate_util.h"
 #include "sched_config.h"
+#include "util.h"
 
 #include "mr_jobtracker.h"
 #include "mr_parser.h"
+#include "mr_state.h"
+#include "mr_feed.h"
+#include "mr_metrics.h"
 
 const char* jobtracker_file_path = "/home/boincadm/projects/test4vm/mr/jobtracker.xml";
-FILE* jobtracker_file = NULL;
+JobStore* jobstore = NULL;
 std::vector<MapReduceJob> jobs;
+TaskRegistry registry(jobs);
+CompletionFeedWriter* feed = NULL;
+// Jobs of unknown tasks that are not in the jobtracker state (and how many
+// of them are remembered).
+#define MISSING_JOBS_MAX 10000
+std::set<std::string> missing_jobs;
+// Assimilated work units and time spent on them (written to
+// <jobtracker_file>.assimilator.prom).
+MetricsRegistry* metrics = NULL;
+
+// Log levels (messages above the current level are dropped). The level can
+// be set with the FREECYCLES_LOG_LEVEL environment variable.
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_TRACE 2
+// Log buffer size (errors are always flushed right away).
+#define LOG_BUFFER_SIZE (64*1024)
+
+int log_level = LOG_INFO;
+FILE* log_file = NULL;
+
+int log_open() {
+	const char* level = getenv("FREECYCLES_LOG_LEVEL");
+	if (level) { log_level = atoi(level); }
+	log_file = fopen(config.project_path("sample_results/errors"), "a");
+	if (!log_file) return ERR_FOPEN;
+	setvbuf(log_file, NULL, _IOFBF, LOG_BUFFER_SIZE);
+	return 0;
+}
+
+void log_msg(int level, const char* format, ...) {
+	va_list args;
+	if (level > log_level) { return; }
+	if (!log_file && log_open()) { return; }
+	va_start(args, format);
+	vfprintf(log_file, format, args);
+	va_end(args);
+	if (level == LOG_ERROR) { fflush(log_file); }
+}
 
 int write_error(char* p) {
-    static FILE* f = 0;
-    if (!f) {
-        f = fopen(config.project_path("sample_results/errors"), "a");
-        if (!f) return ERR_FOPEN;
-    }
-    fprintf(f, "%s", p);
-    fflush(f);
+    if (!log_file && log_open()) return ERR_FOPEN;
+    log_msg(LOG_ERROR, "%s", p);
     return 0;
 }
 
 void debug(const char* what, const char* with) {
-	char buf[1024];
-	sprintf(buf, "%s %s\n", what, with);
-	write_error(buf);
+	log_msg(LOG_TRACE, "%s %s\n", what, with);
+}
+
+/**
+ * Returns the job id of a task name (empty if the name is not a task name).
+ */
+std::string task_job_id(const std::string& name) {
+	size_t pos = name.rfind("-map-");
+	if (pos == std::string::npos) { pos = name.rfind("-reduce-"); }
+	return pos == std::string::npos ? std::string() : name.substr(0, pos);
 }
 
 /**
  * This helper function searches for a MapReduce task which is identified by
- * the given 'wu_name'.
+ * the given 'wu_name'. Jobs added after the jobtracker state was loaded are
+ * picked up by reloading the state right away. Jobs still unknown after a
+ * reload (stale work units of removed jobs) are remembered and never trigger
+ * another reload.
  * Note: Task names follow the format: id-[map|reduce]-seq.number
+ * Note: the returned task is invalid if there is no such task.
  */
-MapReduceTask* get_task_by_name(std::vector<MapReduceJob>& jobs_ref, char* wu_name) {
-	std::string id = std::string(wu_name, strchr(wu_name, '-')  - wu_name);
-	std::vector<MapReduceJob>::iterator it;
-	std::vector<MapReduceTask>::iterator it2;
+MapReduceTask get_task_by_name(char* wu_name) {
+	MapReduceTask mrt = registry.getTask(wu_name);
+	std::string job = task_job_id(wu_name);
 
 	debug("get_task_by_name", wu_name);
 
-	for(it = jobs_ref.begin(); it != jobs_ref.end(); ++it) {
-		debug("job", id.c_str());
-		if (it->getID().compare(id)) { continue; }
-		// Search wu_name among map tasks
-		for(	it2 = it->getMapTasks().begin();
-				it2 != it->getMapTasks().end();
-				++it2)
-			{
-			debug("map task", it2->getName().c_str());
-			if(!strcmp(wu_name, it2->getName().c_str())) { return &(*it2); }
-			}
-		// Search wu_name among reduce tasks
-		for(	it2 = it->getReduceTasks().begin();
-				it2 != it->getReduceTasks().end();
-				++it2)
-			{
-			debug("reduce task", it2->getName().c_str());
-			if(!strcmp(wu_name, it2->getName().c_str())) { return &(*it2); }
-			}
+	if (mrt.isValid()) { return mrt; }
+	if (job.empty() || missing_jobs.count(job)) { return MapReduceTask(); }
+	// Only the first task of each new job (or stage) reloads the state.
+	log_msg(LOG_INFO, "Unknown task %s, reloading jobtracker state\n", wu_name);
+	metrics->add("freecycles_state_reloads_total");
+	if (jobstore->load(true)) { return MapReduceTask(); }
+	registry.build();
+	mrt = registry.getTask(wu_name);
+	if (!mrt.isValid() && !registry.getJob(job)) {
+		if (missing_jobs.size() >= MISSING_JOBS_MAX) { missing_jobs.clear(); }
+		missing_jobs.insert(job);
 	}
-	return NULL;
+	return mrt;
 }
 
-int assimilate_handler(
+/**
+ * Declares the metrics of the assimilator (see mr_metrics.h).
+ */
+void declare_metrics() {
+	metrics->declare("freecycles_assimilated_total", METRIC_COUNTER,
+			"Work units assimilated by outcome.");
+	metrics->declare("freecycles_state_reloads_total", METRIC_COUNTER,
+			"Reloads of the jobtracker state (tasks of new jobs).");
+	metrics->declare("freecycles_assimilate_seconds", METRIC_HISTOGRAM,
+			"Time spent assimilating one work unit.",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
+	metrics->declare("freecycles_output_copy_seconds", METRIC_HISTOGRAM,
+			"Time spent copying the output of a task.",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
+	metrics->declare("freecycles_feed_append_seconds", METRIC_HISTOGRAM,
+			"Time spent recording a completion in the feed.",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
+}
+
+int assimilate_work_unit(
 		WORKUNIT& wu,
-		std::vector<RESULT>& /*results*/,
+		std::vector<RESULT>& results,
 		RESULT& canonical_result) {
     int retval;
     char buf[1024];
-    MapReduceTask* mrt = NULL;
+    MapReduceTask mrt;
+    std::vector<int> hosts;
+    double start;
 
     // First time initialization (loads jobtracker state).
     // This information is loaded into memory but we only need the output paths
-    // and wu names. We are not updating the file here.
-    if(jobtracker_file == NULL) {
-		// Open jobtracker state file.
-		jobtracker_file = fopen(jobtracker_file_path, "r+");
-		if (!jobtracker_file){
-			sprintf(buf, "Can't jobtracker file (%s).\n", jobtracker_file_path);
-			return write_error(buf);
-		}
-		// Parse jobtracker state file.
-		retval = parse_jobtracker(jobtracker_file, jobs);
+    // and wu names. The store is read only here (owned by the work generator).
+    if(jobstore == NULL) {
+		jobstore = new JobStore(jobtracker_file_path, jobs);
+		retval = jobstore->load(true);
 		if(retval) {
-			sprintf(buf, "Error parsing jobtracker file\n");
+			sprintf(buf, "Can't load jobtracker state (%s).\n", jobtracker_file_path);
 			return write_error(buf);
 		}
+		// Index all tasks by work unit name.
+		registry.build();
+		feed = new CompletionFeedWriter(jobtracker_file_path);
     }
 
     retval = boinc_mkdir(config.project_path("sample_results"));
@@ -125,24 +185,67 @@ int assimilate_handler(
         bool file_copied = false;
 
         // Get the task identified by the work unit name.
-        mrt = get_task_by_name(jobs, wu.name);
-        if (mrt == NULL) {
+        mrt = get_task_by_name(wu.name);
+        if (!mrt.isValid()) {
 			sprintf(buf, "Can't find MapRedureTask %s\n", wu.name);
 			return write_error(buf);
         }
 		// FIXME - if wu.name contains reduce, also copy to bt new. -> put mrt output task = bt new
-		retval = boinc_copy(output_files[0].path.c_str() , mrt->getOutputPath().c_str());
+		start = dtime();
+		retval = boinc_copy(output_files[0].path.c_str() , mrt.getOutputPath().c_str());
+		metrics->observe("freecycles_output_copy_seconds", dtime() - start);
 		if (!retval) { file_copied = true; }
+		// Hosts with a valid result hold (and seed) the task output.
+		for (unsigned int i = 0; i < results.size(); i++) {
+			if (results[i].validate_state == VALIDATE_STATE_VALID && results[i].hostid)
+			{ hosts.push_back(results[i].hostid); }
+		}
+		// Tell the work generator that the task output is in place (and where).
+		start = dtime();
+		retval = file_copied ? feed->append(wu.name, hosts) : 0;
+		if (file_copied) { metrics->observe("freecycles_feed_append_seconds", dtime() - start); }
+		if (retval) {
+			// Fail (the work unit is assimilated again on restart).
+			sprintf(buf, "Can't record completion of %s\n", wu.name);
+			write_error(buf);
+			return ERR_WRITE;
+		}
 
 
+        metrics->add("freecycles_assimilated_total", 1, metric_label("outcome", file_copied ? "success" : "no_output"));
         if (!file_copied) {
             copy_path = config.project_path("sample_results/%s_%s", wu.name, "no_output_files");
             FILE* f = fopen(copy_path, "w");
             fclose(f);
         }
     } else {
+        metrics->add("freecycles_assimilated_total", 1, metric_label("outcome", "error"));
         sprintf(buf, "%s: 0x%x\n", wu.name, wu.error_mask);
         return write_error(buf);
     }
+    // Flush buffered messages once per work unit.
+    if (log_file) { fflush(log_file); }
     return 0;
 }
+
+/**
+ * Assimilates a work unit (see assimilate_work_unit), timing it. Metrics are
+ * written at most once every METRICS_WRITE_INTERVAL seconds, so they are only
+ * refreshed while there are work units to assimilate.
+ */
+int assimilate_handler(
+		WORKUNIT& wu,
+		std::vector<RESULT>& results,
+		RESULT& canonical_result) {
+	double start = dtime();
+	int retval;
+
+	if (metrics == NULL) {
+		metrics = new MetricsRegistry(std::string(jobtracker_file_path) + ".assimilator.prom");
+		declare_metrics();
+	}
+	retval = assimilate_work_unit(wu, results, canonical_result);
+	metrics->observe("freecycles_assimilate_seconds", dtime() - start);
+	if (metrics->write(time(0))) { log_msg(LOG_ERROR, "Can't write metrics (%s)\n", metrics->getPath().c_str()); }
+	return retval;
+}
@@ -0,0 +1,228 @@
+// This file is part of BOINC.
+// http://boinc.berkeley.edu
+// Copyright (C) 2008 University of California
+//
+// BOINC is free software; you can redistribute it and/or modify it
+// under the terms of the GNU Lesser General Public License
+// as published by the Free Software Foundation,
+// either version 3 of the License, or (at your option) any later version.
+//
+// BOINC is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with BOINC.  If not, see <http://www.gnu.org/licenses/>.
+
+// A validator that compares replicas of MapReduce tasks by info-hash:
+// 1) map outputs are (stored) zips of .torrent files, one per partition;
+// 2) reduce outputs (and map outputs with MAP_SINGLE_TORRENT) are .torrent
+//    files;
+// 3) any other output (tasks running without BitTorrent) is hashed as is (map
+//    outputs are then zips of the partition files, and every entry is hashed).
+// Replicas match if every info-hash matches. Torrents created by the clients
+// only depend on the data (see make_torrent_file in data_handler.h), so the
+// data itself never needs to reach the server.
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+#include <openssl/sha.h>
+
+#include "boinc_db.h"
+#include "error_numbers.h"
+#include "sched_msgs.h"
+#include "validate_util.h"
+
+// Zip local file header signature and size (see zip_files in data_handler.h,
+// entries are only stored, never compressed).
+#define ZIP_HEADER_SIGNATURE 0x04034b50
+#define ZIP_HEADER_SIZE 30
+#define ZIP_CENTRAL_SIGNATURE 0x02014b50
+#define ZIP_END_SIGNATURE 0x06054b50
+// Maximum nesting of bencoded lists and dictionaries (outputs are uploaded by
+// volunteers, deeper values are rejected).
+#define BDECODE_MAX_DEPTH 100
+
+/**
+ * Returns the hex representation of a SHA-1 digest.
+ */
+std::string sha1_hex(const char* data, size_t size) {
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	char hex[2*SHA_DIGEST_LENGTH+1];
+	SHA1((const unsigned char*)data, size, digest);
+	for(int i = 0; i < SHA_DIGEST_LENGTH; i++)
+	{ sprintf(hex + 2*i, "%02x", digest[i]); }
+	return std::string(hex, 2*SHA_DIGEST_LENGTH);
+}
+
+/**
+ * Skips one bencoded value starting at "pos" ("depth" lists or dictionaries
+ * deep). Returns the position right after the value or std::string::npos if
+ * the value is malformed or nested too deep (see BDECODE_MAX_DEPTH).
+ */
+size_t bdecode_skip(const std::string& b, size_t pos, int depth = 0) {
+	if (pos >= b.size()) { return std::string::npos; }
+	switch(b[pos]) {
+	case 'i':
+		pos = b.find('e', pos);
+		return pos == std::string::npos ? pos : pos + 1;
+	case 'l':
+	case 'd':
+		if (depth >= BDECODE_MAX_DEPTH) { return std::string::npos; }
+		for(pos++; pos < b.size() && b[pos] != 'e';) {
+			if ((pos = bdecode_skip(b, pos, depth + 1)) == std::string::npos)
+			{ return pos; }
+		}
+		return pos < b.size() ? pos + 1 : std::string::npos;
+	default: {
+		// String: <length>:<bytes> (the length only has digits).
+		size_t colon = b.find_first_not_of("0123456789", pos);
+		if (colon == pos || colon == std::string::npos || b[colon] != ':')
+		{ return std::string::npos; }
+		size_t len = strtoul(b.c_str() + pos, NULL, 10);
+		return len <= b.size() - colon - 1 ? colon + 1 + len : std::string::npos;
+	}
+	}
+}
+
+/**
+ * Returns the info-hash (hex) of a .torrent file contents: the SHA-1 of the
+ * bencoded "info" dictionary. Returns an empty string if "b" is not a torrent.
+ */
+std::string torrent_info_hash(const std::string& b) {
+	size_t pos = 1, next;
+	if (b.empty() || b[0] != 'd') { return std::string(); }
+	while (pos < b.size() && b[pos] != 'e') {
+		// Keys are strings.
+		if ((next = bdecode_skip(b, pos)) == std::string::npos) { break; }
+		bool info = !b.compare(pos, next - pos, "4:info");
+		pos = next;
+		if ((next = bdecode_skip(b, pos)) == std::string::npos) { break; }
+		if (info) { return sha1_hex(b.data() + pos, next - pos); }
+		pos = next;
+	}
+	return std::string();
+}
+
+/**
+ * Reads a 16 or 32 bits little endian integer from a zip header.
+ */
+unsigned int zip_read(const std::string& b, size_t pos, int bytes) {
+	unsigned int v = 0;
+	for(int i = bytes - 1; i >= 0; i--) { v = (v << 8) | (unsigned char)b[pos + i]; }
+	return v;
+}
+
+/**
+ * Fills "hashes" with the info-hashes of every .torrent inside a zip file
+ * contents (in zip order). Zips without .torrent entries (map outputs of tasks
+ * running without BitTorrent) hold the partition files: the SHA-1 of each
+ * entry is used instead. Returns non zero if the zip cannot be parsed.
+ */
+int zip_info_hashes(const std::string& b, std::vector<std::string>& hashes) {
+	std::vector<std::string> data_hashes;
+	size_t pos = 0;
+	while (pos + ZIP_HEADER_SIZE <= b.size() &&
+			zip_read(b, pos, 4) == ZIP_HEADER_SIGNATURE) {
+		unsigned int method = zip_read(b, pos + 8, 2);
+		unsigned int size = zip_read(b, pos + 18, 4);
+		unsigned int name_len = zip_read(b, pos + 26, 2);
+		unsigned int extra_len = zip_read(b, pos + 28, 2);
+		size_t data = pos + ZIP_HEADER_SIZE + name_len + extra_len;
+		std::string name = b.substr(pos + ZIP_HEADER_SIZE, name_len);
+		// Only stored entries are expected (zip -0).
+		if (method != 0 || data + size > b.size()) { return 1; }
+		if (name.size() > 8 && !name.compare(name.size() - 8, 8, ".torrent")) {
+			std::string hash = torrent_info_hash(b.substr(data, size));
+			if (hash.empty()) { return 1; }
+			hashes.push_back(hash);
+		}
+		data_hashes.push_back(sha1_hex(b.data() + data, size));
+		pos = data + size;
+	}
+	// Anything but the central directory after the entries is garbage.
+	if (pos + 4 <= b.size() && zip_read(b, pos, 4) != ZIP_CENTRAL_SIGNATURE &&
+			zip_read(b, pos, 4) != ZIP_END_SIGNATURE) { return 1; }
+	if (hashes.empty()) { hashes.swap(data_hashes); }
+	return 0;
+}
+
+/**
+ * Reads a whole file into a string.
+ */
+int read_file(const std::string& path, std::string& contents) {
+	char buf[4096];
+	size_t n;
+	FILE* f = fopen(path.c_str(), "rb");
+	if (!f) { return ERR_FOPEN; }
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { contents.append(buf, n); }
+	fclose(f);
+	return 0;
+}
+
+/**
+ * Loads the info-hashes describing a result's output.
+ */
+int init_result(RESULT& result, void*& data) {
+	std::vector<OUTPUT_FILE_INFO> output_files;
+	std::vector<std::string>* hashes = new std::vector<std::string>();
+	std::string contents, hash;
+	int retval;
+
+	retval = get_output_file_infos(result, output_files);
+	if (retval || output_files.empty()) {
+		log_messages.printf(MSG_CRITICAL,
+				"[RESULT#%d %s] failed to get output file\n",
+				result.id, result.name);
+		delete hashes;
+		return retval ? retval : ERR_FOPEN;
+	}
+	if ((retval = read_file(output_files[0].path, contents))) {
+		log_messages.printf(MSG_CRITICAL,
+				"[RESULT#%d %s] failed to read %s\n",
+				result.id, result.name, output_files[0].path.c_str());
+		delete hashes;
+		return retval;
+	}
+
+	if (contents.size() >= 4 && zip_read(contents, 0, 4) == ZIP_HEADER_SIGNATURE) {
+		retval = zip_info_hashes(contents, *hashes);
+	}
+	else if (!(hash = torrent_info_hash(contents)).empty()) {
+		hashes->push_back(hash);
+	}
+	else {
+		hashes->push_back(sha1_hex(contents.data(), contents.size()));
+	}
+	if (retval) {
+		log_messages.printf(MSG_CRITICAL,
+				"[RESULT#%d %s] malformed output %s\n",
+				result.id, result.name, output_files[0].path.c_str());
+		delete hashes;
+		return ERR_XML_PARSE;
+	}
+	data = (void*)hashes;
+	return 0;
+}
+
+/**
+ * Two results match if they describe exactly the same torrents.
+ */
+int compare_results(
+		RESULT& /*r1*/, void* data1,
+		RESULT const& /*r2*/, void* data2,
+		bool& match) {
+	std::vector<std::string>* h1 = (std::vector<std::string>*)data1;
+	std::vector<std::string>* h2 = (std::vector<std::string>*)data2;
+	match = (*h1 == *h2);
+	return 0;
+}
+
+int cleanup_result(RESULT const& /*result*/, void* data) {
+	delete (std::vector<std::string>*)data;
+	return 0;
+}
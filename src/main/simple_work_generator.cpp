@@ -20,7 +20,8 @@
 // (you may need to change some or all of these):
 //
 // - Runs as a daemon, and creates an unbounded supply of work.
-//   It attempts to maintain a "cushion" of 100 unsent job instances.
+//   It attempts to maintain a "cushion" of unsent job instances
+//   (sized from the rate at which volunteers take them, see mr_cushion.h).
 //   (your app may not work this way; e.g. you might create work in batches)
 // - Creates work for the application "example_app".
 // - Creates a new input file for each job;
@@ -32,12 +33,16 @@
 #include <cstdlib>
 #include <string>
 #include <cstring>
+#include <cerrno>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <sys/stat.h>
+#include <ctime>
+#include <map>
+#include <set>
 
 #include "boinc_db.h"
 #include "error_numbers.h"
+#include "filesys.h"
 #include "backend_lib.h"
 #include "parse.h"
 #include "util.h"
@@ -50,125 +55,711 @@
 
 #include "mr_parser.h"
 #include "mr_jobtracker.h"
+#include "mr_state.h"
+#include "mr_feed.h"
+#include "mr_shuffle.h"
+#include "mr_straggler.h"
+#include "mr_reliability.h"
+#include "mr_scheduler.h"
+#include "mr_locality.h"
+#include "mr_cushion.h"
+#include "mr_metrics.h"
 
-#define CUSHION 10
-    // maintain at least this many unsent results
 #define REPLICATION_FACTOR  3
+    // replicas of each task (until host reliability is known)
+#define REPLICATION_MIN 2
+    // replicas if the active hosts are reliable (and of reduces sent to
+    // trusted hosts)
+#define REPLICATION_MAX 5
+    // replicas if the active hosts are unreliable
+#define RELIABILITY_POOR 0.8
+    // pool score below which REPLICATION_MAX is used
+#define RELIABILITY_HISTORY 100000
+    // results read (at startup) to score hosts
+// Variety of the messages carrying late reducer inputs (trickle-down).
+#define LATE_INPUT_VARIETY "late_input"
+// Interval between searches for stragglers (seconds).
+#define STRAGGLER_CHECK_INTERVAL 60
+// Interval between searches for lazy work units needing replicas (seconds).
+#define LAZY_CHECK_INTERVAL 60
+// Work units whose results are read by one query (see check_lazy_replicas).
+#define LAZY_QUERY_UNITS 500
+// Assigned work units not sent after this (seconds) go to any host.
+#define ASSIGNMENT_TIMEOUT 3600
+// Interval between reports of the cushion controller (seconds).
+#define CUSHION_LOG_INTERVAL 60
 
 // TODO - put some decent names.
 const char* app_name = "example_app";
 const char* in_template_file = "example_app_in";
 const char* out_template_file = "example_app_out";
 const char* jobtracker_file_path = "/home/boincadm/projects/test4vm/mr/jobtracker.xml";
-const char* shuffle_script = "/home/boincadm/git/freeCycles/src/scripts/shuffle.sh";
+// Lazy replication: work units start with one replica and get another one
+// every lazy_replication seconds (0 disables it, see check_lazy_replicas).
+int lazy_replication = 0;
+const char* scheduler_name = "fifo";
+// Metrics file (default: <jobtracker_file>.generator.prom).
+const char* metrics_file_path = NULL;
 
 char* in_template;
 DB_APP app;
 std::vector<MapReduceJob> jobs;
-FILE* jobtracker_file = NULL;
+JobStore* jobstore = NULL;
+TaskRegistry registry(jobs);
+CompletionFeedReader* feed = NULL;
+ShufflePlanner planner;
+// Chooses the job of each new task (see --scheduler).
+JobScheduler* scheduler = NULL;
+// Reduce slow-start: number of map outputs already sent to each reducer,
+// by work unit (input file) and by result (trickle-down messages).
+std::map<std::string, size_t> reducer_inputs;
+std::map<int, size_t> result_inputs;
+// Reducer results told the final number of their inputs.
+std::set<int> result_ended;
+// Lazy work units that may still need replicas (see check_lazy_replicas).
+struct LazyUnit {
+	std::string name;
+	int target_nresults;
+	int min_quorum;
+};
+std::map<int, LazyUnit> lazy_units;
+// Running tasks (creation times) and durations of finished tasks.
+StragglerMonitor stragglers;
+// Host reliability (from result history).
+HostReliability reliability;
+// Hosts holding the map outputs of each job.
+LocalityTracker locality;
+// Sizes the unsent results buffer and the poll interval.
+CushionController cushion;
+// Dispatch rates, queue depths, job progress and time spent in each step.
+MetricsRegistry* metrics = NULL;
 
 /**
- * Helper function that copies file(s).
- * It uses the cp (unix program) do perform the copy.
+ * Declares the metrics of the work generator (see mr_metrics.h).
  */
-int copy_file(const char* source, const char* dest) {
-  pid_t pid;
-  int childExitStatus;
-  pid = fork();
-  
-  if(pid == 0) {
-    return execl("/bin/cp", "/bin/cp", source, dest, (char *)0);
-  }
-  else if (pid < 0) {
-    log_messages.printf(MSG_CRITICAL, "can't fork to perform cp (input staging)\n");
-    return -1;
-  }
-  else {
-    pid_t ws = waitpid( pid, &childExitStatus, 0);
-    if (ws == -1) { 
-      log_messages.printf(MSG_CRITICAL, "can't wait for child (input staging)\n");
-      return -2;
-    }
-    if (WIFSIGNALED(childExitStatus)) { /* killed */
-      log_messages.printf(MSG_CRITICAL, "signaled child (input staging)\n");
-      return -3;
-    }
-    else if (WIFSTOPPED(childExitStatus)) { /* stopped */
-      log_messages.printf(MSG_CRITICAL, "stopped child (input staging)\n");
-      return -4;
-    }
-    return 0;
-  }
+void declare_metrics() {
+	metrics->declare("freecycles_tasks_sent_total", METRIC_COUNTER,
+			"Tasks handed out as new work units.");
+	metrics->declare("freecycles_tasks_finished_total", METRIC_COUNTER,
+			"Tasks reported finished by the assimilator.");
+	metrics->declare("freecycles_task_duration_seconds", METRIC_HISTOGRAM,
+			"Time from work unit creation to task completion.",
+			METRICS_BUCKETS(METRICS_DURATION_BUCKETS));
+	metrics->declare("freecycles_workunits_created_total", METRIC_COUNTER,
+			"Work units created.");
+	metrics->declare("freecycles_results_created_total", METRIC_COUNTER,
+			"Results (replicas) requested for new work units.");
+	metrics->declare("freecycles_replicas_added_total", METRIC_COUNTER,
+			"Replicas added to running work units.");
+	metrics->declare("freecycles_late_inputs_sent_total", METRIC_COUNTER,
+			"Map outputs sent to running reducers.");
+	metrics->declare("freecycles_jobs_imported_total", METRIC_COUNTER,
+			"Jobs submitted while running.");
+	metrics->declare("freecycles_feeder_empty_total", METRIC_COUNTER,
+			"Polls that found no unsent results while there was work to create.");
+	metrics->declare("freecycles_unsent_results", METRIC_GAUGE,
+			"Unsent results at the last poll.");
+	metrics->declare("freecycles_cushion_results", METRIC_GAUGE,
+			"Unsent results the work generator tries to keep.");
+	metrics->declare("freecycles_in_flight_results", METRIC_GAUGE,
+			"Results created recently (not unsent results yet).");
+	metrics->declare("freecycles_dispatch_rate", METRIC_GAUGE,
+			"Results sent to volunteers per second (moving average).");
+	metrics->declare("freecycles_poll_interval_seconds", METRIC_GAUGE,
+			"Sleep between passes of the work generator.");
+	metrics->declare("freecycles_job_tasks", METRIC_GAUGE,
+			"Tasks of each job by phase and state.");
+	metrics->declare("freecycles_job_progress", METRIC_GAUGE,
+			"Finished tasks over all tasks of each job.");
+	metrics->declare("freecycles_job_blocked", METRIC_GAUGE,
+			"1 if the job waits for the jobs it depends on.");
+	metrics->declare("freecycles_step_seconds", METRIC_HISTOGRAM,
+			"Time spent in each step of the work generator.",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
+	metrics->declare("freecycles_shuffle_seconds", METRIC_HISTOGRAM,
+			"Time spent shuffling map outputs (add, finish and reducer input).",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
+	metrics->declare("freecycles_create_work_seconds", METRIC_HISTOGRAM,
+			"Time spent in create_work (per work unit).",
+			METRICS_BUCKETS(METRICS_LATENCY_BUCKETS));
 }
 
 /**
- * Helper function that shuffles the intermediate data.
- * It uses an external script to perform the shuffle.
+ * Returns the phase label of a task.
  */
-int shuffle(const char* job_id, const char* nreds) {
-  pid_t pid;
-  int childExitStatus;
-  pid = fork();
-
-  if(pid == 0) {
-    return execl(shuffle_script, shuffle_script, job_id, nreds, (char*)0);
-  }
-  else if (pid < 0) {
-    log_messages.printf(MSG_CRITICAL, "can't fork to perform cp (input staging)\n");
-    return -1;
-  }
-  else {
-    pid_t ws = waitpid( pid, &childExitStatus, 0);
-    if (ws == -1) {
-      log_messages.printf(MSG_CRITICAL, "can't wait for child (input staging)\n");
-      return -2;
-    }
-    if (WIFSIGNALED(childExitStatus)) { /* killed */
-      log_messages.printf(MSG_CRITICAL, "signaled child (input staging)\n");
-      return -3;
+std::string phase_label(MapReduceJob& mrj, MapReduceTask& mrt)
+{ return metric_label("phase", mrt.getTable() == &mrj.getReduceTasks() ? "reduce" : "map"); }
+
+/**
+ * Updates the gauges of every job (tasks per phase and state, progress).
+ */
+void update_job_metrics() {
+	std::vector<MapReduceJob>::iterator it;
+	static const char* phases[] = { "map", "reduce" };
+	metrics->clear("freecycles_job_tasks");
+	metrics->clear("freecycles_job_progress");
+	metrics->clear("freecycles_job_blocked");
+	for(it = jobs.begin(); it != jobs.end(); ++it) {
+		std::string job = metric_label("job", it->getID());
+		TaskTable* tables[] = { &it->getMapTasks(), &it->getReduceTasks() };
+		uint64_t total = 0, finished = 0;
+		for(unsigned int i = 0; i < 2; i++) {
+			std::string labels = job + "," + metric_label("phase", phases[i]) + ",";
+			metrics->set("freecycles_job_tasks", tables[i]->getWaiting(), labels + metric_label("state", "waiting"));
+			metrics->set("freecycles_job_tasks", tables[i]->getRunning(), labels + metric_label("state", "running"));
+			metrics->set("freecycles_job_tasks", tables[i]->getFinished(), labels + metric_label("state", "finished"));
+			total += tables[i]->size();
+			finished += tables[i]->getFinished();
+		}
+		metrics->set("freecycles_job_progress", total ? (double)finished / total : 1, job);
+		metrics->set("freecycles_job_blocked", it->isBlocked(), job);
+	}
+}
+
+/**
+ * Places a task input in the download dir hierarchy. The input is hard linked
+ * (nothing is copied and no process is forked); it is only copied if it lives
+ * on another file system. Inputs already in place (staged before a restart)
+ * are kept, as long as they are the same file (or a copy of the same size).
+ */
+int stage_input(const char* source, const char* dest) {
+    struct stat from, to;
+    if (!link(source, dest)) return 0;
+    if (errno == EEXIST) {
+        if (!stat(source, &from) && !stat(dest, &to) &&
+                ((from.st_dev == to.st_dev && from.st_ino == to.st_ino) ||
+                (from.st_dev != to.st_dev && from.st_size == to.st_size))) return 0;
+        log_messages.printf(
+        		MSG_CRITICAL,
+        		"can't stage %s: %s is another file\n",
+        		source,
+        		dest);
+        return ERR_WRITE;
     }
-    else if (WIFSTOPPED(childExitStatus)) { /* stopped */
-      log_messages.printf(MSG_CRITICAL, "stopped child (input staging)\n");
-      return -4;
+    if (errno != EXDEV && errno != EPERM) {
+        log_messages.printf(
+        		MSG_CRITICAL,
+        		"can't link %s to %s: %s\n",
+        		source,
+        		dest,
+        		strerror(errno));
+        return ERR_WRITE;
     }
-    return 0;
-  }
+    return boinc_copy(source, dest);
 }
 
 /**
- * Helper function that writes to the jobtracker state file.
+ * Adds a decided result to the history of its host.
  */
-void write_task_state(MapReduceTask* mrt, const char* state) {
-	fseek(jobtracker_file, mrt->getStateOffset(),SEEK_SET);
-	fwrite(TASK_CREATED, 1, 1, jobtracker_file);
-	fflush(jobtracker_file);
-	mrt->setState(state);
+void record_result(DB_RESULT& result) {
+	time_t when = result.received_time ? result.received_time : time(0);
+	if (result.server_state != RESULT_SERVER_STATE_OVER || !result.hostid) { return; }
+	if (result.outcome == RESULT_OUTCOME_SUCCESS) {
+		if (result.validate_state == VALIDATE_STATE_VALID)
+		{ reliability.addValid(result.hostid, when); }
+		else if (result.validate_state == VALIDATE_STATE_INVALID)
+		{ reliability.addInvalid(result.hostid, when); }
+	}
+	else if (result.outcome == RESULT_OUTCOME_CLIENT_ERROR)
+	{ reliability.addError(result.hostid, when); }
+	else if (result.outcome == RESULT_OUTCOME_NO_REPLY)
+	{ reliability.addTimeout(result.hostid, when); }
 }
 
 /**
- * Helper function that writes to the jobtracker state file.
- * It is called when the shuffle is performed.
+ * Scores hosts with the last RELIABILITY_HISTORY results of the application.
  */
-void write_shuffled_state(MapReduceJob* mrj) {
-	fseek(jobtracker_file, mrj->getShuffledOffset(),SEEK_SET);
-	fwrite("1", 1, 1, jobtracker_file);
-	fflush(jobtracker_file);
-	mrj->setShuffled(true);
+void load_host_history() {
+	DB_RESULT result;
+	char buf[256];
+	sprintf(buf,
+			"where appid=%d and server_state=%d order by id desc limit %d",
+			app.id,
+			RESULT_SERVER_STATE_OVER,
+			RELIABILITY_HISTORY);
+	while (!result.enumerate(buf)) { record_result(result); }
 }
 
 /**
- * This function checks if the map output is ready. This is important to start
- * the reduce phase.
+ * Handles the results of an assimilated work unit: decided results go into
+ * the history of their hosts and results still running are cancelled (the
+ * scheduler tells their hosts to abort them if it has <send_result_abort/>
+ * enabled). The sent times of the results are passed to the straggler
+ * monitor (so the task duration starts when its first result was sent).
  */
-void check_maps_state(MapReduceJob& mrj) {
-	std::vector<MapReduceTask>& maps = mrj.getMapTasks();
-	std::vector<MapReduceTask>::iterator it;
-	for( it = maps.begin(); it != maps.end();	++it) {
-		struct stat buffer;
-		if (!stat(it->getOutputPath().c_str(), &buffer)) {
-			log_messages.printf(MSG_NORMAL, "Map task %s finished\n", it->getName().c_str());
-			it->setState(std::string(TASK_FINISHED));
-			write_task_state(&(*it), TASK_FINISHED);
+void finish_work_unit(const std::string& name) {
+	DB_WORKUNIT wu;
+	DB_RESULT result;
+	std::vector<int> losers;
+	char buf[256];
+
+	sprintf(buf, "where name='%s'", name.c_str());
+	if (wu.lookup(buf)) { return; }
+	lazy_units.erase(wu.id);
+	sprintf(buf, "where workunitid=%d", wu.id);
+	while (!result.enumerate(buf)) {
+		stragglers.sent(name, result.sent_time);
+		if (result.server_state == RESULT_SERVER_STATE_IN_PROGRESS) { losers.push_back(result.id); }
+		else { record_result(result); }
+	}
+	for(unsigned int i = 0; i < losers.size(); i++) {
+		result.id = losers[i];
+		sprintf(buf, "server_state=%d, outcome=%d", RESULT_SERVER_STATE_OVER, RESULT_OUTCOME_DIDNT_NEED);
+		if (result.update_field(buf)) {
+			log_messages.printf(MSG_CRITICAL, "can't cancel result %d of %s\n", losers[i], name.c_str());
+		}
+	}
+	if (losers.size()) {
+		log_messages.printf(MSG_NORMAL, "Cancelled %lu results of %s\n", (unsigned long)losers.size(), name.c_str());
+	}
+}
+
+/**
+ * Issues one more replica of a straggling task (the transitioner creates the
+ * new result). Whichever replicas finish first complete the quorum. Work
+ * units without results in progress (e.g., waiting for a replica to be sent)
+ * are skipped. Returns true if a replica was added.
+ */
+bool add_replica(const std::string& name) {
+	DB_WORKUNIT wu;
+	DB_RESULT result;
+	char buf[256];
+	int nrunning;
+
+	sprintf(buf, "where name='%s'", name.c_str());
+	if (wu.lookup(buf) || wu.canonical_resultid) { return false; }
+	sprintf(buf, "where workunitid=%d and server_state=%d", wu.id, RESULT_SERVER_STATE_IN_PROGRESS);
+	if (result.count(nrunning, buf) || !nrunning) { return false; }
+	// The replica goes to any host (also for assigned work units).
+	sprintf(buf, "target_nresults=target_nresults+1, transitioner_flags=0, transition_time=%d", (int)time(0));
+	if (wu.update_field(buf)) {
+		log_messages.printf(MSG_CRITICAL, "can't add replica of %s\n", name.c_str());
+		return false;
+	}
+	metrics->add("freecycles_replicas_added_total", 1, metric_label("reason", "straggler"));
+	log_messages.printf(MSG_NORMAL, "Straggler %s, adding a replica\n", name.c_str());
+	return true;
+}
+
+/**
+ * Looks for stragglers (at most once every STRAGGLER_CHECK_INTERVAL seconds).
+ * Tasks start once their first result is sent: the results sent since the
+ * last check are passed to the straggler monitor (result names are the work
+ * unit name followed by _<replica>).
+ */
+void check_stragglers() {
+	static time_t last_check = 0;
+	std::vector<std::string> names;
+	DB_RESULT result;
+	time_t now = time(0);
+	std::string name;
+	char buf[256];
+
+	if (now - last_check < STRAGGLER_CHECK_INTERVAL) { return; }
+	sprintf(buf,
+			"where appid=%d and server_state=%d and sent_time>=%d",
+			app.id,
+			RESULT_SERVER_STATE_IN_PROGRESS,
+			(int)last_check);
+	while (!result.enumerate(buf)) {
+		name = result.name;
+		stragglers.sent(name.substr(0, name.rfind('_')), result.sent_time);
+	}
+	last_check = now;
+	stragglers.getStragglers(now, names);
+	for(unsigned int i = 0; i < names.size(); i++)
+	{ if (add_replica(names[i])) { stragglers.replicated(names[i]); } }
+}
+
+/**
+ * Loads the lazy work units that still need replicas (once, at startup;
+ * work units created afterwards are added by make_job).
+ */
+void load_lazy_units() {
+	DB_WORKUNIT wu;
+	char buf[256];
+	sprintf(buf,
+			"where appid=%d and canonical_resultid=0 and error_mask=0 and target_nresults<min_quorum",
+			app.id);
+	while (!wu.enumerate(buf)) {
+		LazyUnit& unit = lazy_units[wu.id];
+		unit.name = wu.name;
+		unit.target_nresults = wu.target_nresults;
+		unit.min_quorum = wu.min_quorum;
+	}
+}
+
+/**
+ * Adds replicas to lazy work units (created with a single replica, see
+ * make_job). A work unit gets all the replicas its quorum needs once one
+ * result is waiting for votes, and one more replica for every
+ * lazy_replication seconds it has been running since its first result was
+ * sent (i.e., whenever the previous replicas missed their deadline).
+ * The results of LAZY_QUERY_UNITS work units are read by a single query.
+ */
+void check_lazy_replicas() {
+	static time_t last_check = 0;
+	std::map<int, time_t> first_sent;
+	std::set<int> succeeded;
+	std::map<int, LazyUnit>::iterator it, qit;
+	std::vector<int> done;
+	std::string query;
+	DB_WORKUNIT wu;
+	DB_RESULT result;
+	time_t now = time(0);
+	char buf[256];
+	int target;
+
+	if (!lazy_replication || now - last_check < LAZY_CHECK_INTERVAL) { return; }
+	if (!last_check) { load_lazy_units(); }
+	last_check = now;
+
+	for(qit = lazy_units.begin(); qit != lazy_units.end();) {
+		query = "where workunitid in (";
+		for(int n = 0; qit != lazy_units.end() && n < LAZY_QUERY_UNITS; ++qit, n++) {
+			sprintf(buf, "%s%d", n ? "," : "", qit->first);
+			query += buf;
+		}
+		query += ")";
+		while (!result.enumerate(query.c_str())) {
+			if (result.server_state == RESULT_SERVER_STATE_OVER &&
+					result.outcome == RESULT_OUTCOME_SUCCESS) { succeeded.insert(result.workunitid); }
+			if (result.sent_time && (!first_sent[result.workunitid] ||
+					result.sent_time < first_sent[result.workunitid]))
+			{ first_sent[result.workunitid] = result.sent_time; }
+		}
+	}
+
+	for(it = lazy_units.begin(); it != lazy_units.end(); ++it) {
+		bool votes = succeeded.count(it->first) > 0;
+		if (votes) { target = it->second.min_quorum; }
+		// Not running until a result is sent.
+		else if (!first_sent[it->first]) { continue; }
+		else { target = 1 + (now - first_sent[it->first]) / lazy_replication; }
+		if (target > it->second.min_quorum) { target = it->second.min_quorum; }
+		if (target <= it->second.target_nresults) { continue; }
+
+		wu.id = it->first;
+		sprintf(buf, "target_nresults=%d, transition_time=%d", target, (int)now);
+		if (wu.update_field(buf)) {
+			log_messages.printf(MSG_CRITICAL, "can't add replicas of %s\n", it->second.name.c_str());
+			continue;
+		}
+		metrics->add(
+				"freecycles_replicas_added_total",
+				target - it->second.target_nresults,
+				metric_label("reason", votes ? "votes" : "late"));
+		log_messages.printf(
+				MSG_NORMAL,
+				"%s %s, now with %d replicas\n",
+				votes ? "Waiting for votes" : "Late",
+				it->second.name.c_str(),
+				target);
+		it->second.target_nresults = target;
+		// Fully replicated, nothing left to add.
+		if (target >= it->second.min_quorum) { done.push_back(it->first); }
+	}
+	for(unsigned int i = 0; i < done.size(); i++) { lazy_units.erase(done[i]); }
+}
+
+/**
+ * Releases the assigned work units (see make_job) that were not sent to all
+ * their hosts within ASSIGNMENT_TIMEOUT seconds (e.g., a host left): the
+ * transitioner creates their missing results, which go to any host.
+ */
+void check_assignments() {
+	static time_t last_check = 0;
+	std::vector<WORKUNIT> late;
+	DB_WORKUNIT wu;
+	time_t now = time(0);
+	char buf[256];
+
+	if (now - last_check < STRAGGLER_CHECK_INTERVAL) { return; }
+	last_check = now;
+	sprintf(buf,
+			"where appid=%d and transitioner_flags=%d and canonical_resultid=0 and error_mask=0 and create_time<%d",
+			app.id,
+			TRANSITION_NO_NEW_RESULTS,
+			(int)(now - ASSIGNMENT_TIMEOUT));
+	while (!wu.enumerate(buf)) { late.push_back(wu); }
+	for(unsigned int i = 0; i < late.size(); i++) {
+		wu.id = late[i].id;
+		sprintf(buf, "transitioner_flags=0, transition_time=%d", (int)now);
+		if (wu.update_field(buf)) {
+			log_messages.printf(MSG_CRITICAL, "can't release %s\n", late[i].name);
+			continue;
+		}
+		log_messages.printf(MSG_NORMAL, "Assigned %s not sent, released\n", late[i].name);
+	}
+}
+
+/**
+ * Registers the tasks that are running (created before the work generator
+ * started) with the straggler monitor (their sent times are read by the
+ * first check_stragglers).
+ */
+void load_start_times() {
+	std::vector<MapReduceJob>::iterator it;
+	MapReduceJob* mrj = NULL;
+	MapReduceTask mrt;
+	DB_WORKUNIT wu;
+	char buf[256];
+
+	for(it = jobs.begin(); it != jobs.end(); ++it) {
+		if (it->getReduceTasks().getFinished() == it->getReduceTasks().size()) { continue; }
+		sprintf(buf, "where name like '%s-%%' and canonical_resultid=0", it->getID().c_str());
+		while (!wu.enumerate(buf)) {
+			mrt = registry.getTask(wu.name, &mrj);
+			if (!mrt.isValid() || mrt.getState() != TASK_CREATED) { continue; }
+			stragglers.started(wu.name, mrj->getID(), mrt.getTable() == &mrj->getReduceTasks());
+		}
+	}
+}
+
+/**
+ * Marks a task as finished (its output is held by 'hosts'). Completions are
+ * idempotent. Finished map tasks are what allows the reduce phase to start.
+ */
+void complete_task(const std::string& name, std::vector<int>& hosts) {
+	MapReduceJob* mrj = NULL;
+	MapReduceTask mrt;
+	time_t duration;
+	double start;
+
+	mrt = registry.getTask(name, &mrj);
+	if (!mrt.isValid()) {
+		log_messages.printf(MSG_NORMAL, "Unknown task %s in feed\n", name.c_str());
+		return;
+	}
+	// Map output locations (also rebuilt when the whole feed is read
+	// after a restart).
+	if (mrt.getTable() == &mrj->getMapTasks() &&
+			mrj->getReduceTasks().getFinished() < mrj->getReduceTasks().size()) {
+		locality.add(mrj->getID(), name, hosts);
+	}
+	if (mrt.getState() == TASK_FINISHED) { return; }
+	log_messages.printf(MSG_NORMAL, "Task %s finished\n", name.c_str());
+	jobstore->setTaskState(*mrj, mrt, TASK_FINISHED);
+	metrics->add("freecycles_tasks_finished_total", 1, phase_label(*mrj, mrt));
+	finish_work_unit(name);
+	if ((duration = stragglers.finished(name, time(0))) >= 0) {
+		metrics->observe(
+				"freecycles_task_duration_seconds",
+				duration,
+				metric_label("job", mrj->getID()) + "," + phase_label(*mrj, mrt));
+	}
+	// Map outputs are added to the reducer inputs right away.
+	if (mrt.getTable() == &mrj->getMapTasks() && !mrj->isShuffled()) {
+		start = dtime();
+		if (planner.add(*mrj, mrt)) {
+			log_messages.printf(MSG_CRITICAL, "can't shuffle output of %s\n", name.c_str());
+		}
+		metrics->observe("freecycles_shuffle_seconds", dtime() - start, metric_label("step", "add"));
+	}
+	// Partial reducer inputs are no longer needed once the job is done.
+	if (mrt.getTable() == &mrj->getReduceTasks() &&
+			mrj->getReduceTasks().getFinished() == mrj->getReduceTasks().size()) {
+		planner.cleanup(*mrj);
+		locality.forget(mrj->getID());
+		stragglers.forget(mrj->getID());
+		// Stages depending on this job may start.
+		update_dependencies(jobs);
+	}
+}
+
+/**
+ * This function consumes the completions recorded by the assimilator since the
+ * last call (see mr_feed.h) and marks the corresponding tasks as finished.
+ */
+void check_completions() {
+	std::vector<std::string> lines;
+	std::string name;
+	std::vector<int> hosts;
+
+	if (feed->poll(lines)) { return; }
+	for(unsigned int i = 0; i < lines.size(); i++) {
+		hosts.clear();
+		feed_split(lines[i], name, hosts);
+		complete_task(name, hosts);
+	}
+}
+
+/**
+ * Returns true if a feed line is still needed after the completion is
+ * durable: map output locations of jobs still reducing (see
+ * CompletionFeedReader::rotate).
+ */
+bool feed_keep(const std::string& name) {
+	MapReduceJob* mrj = NULL;
+	MapReduceTask mrt = registry.getTask(name, &mrj);
+	return mrt.isValid() &&
+			mrt.getTable() == &mrj->getMapTasks() &&
+			mrj->getReduceTasks().getFinished() < mrj->getReduceTasks().size();
+}
+
+/**
+ * Rotates the feed after each checkpoint of the jobtracker state (all the
+ * completions read so far are durable, see check_completions).
+ */
+void rotate_feed() {
+	static uint64_t generation = 0;
+
+	if (generation == jobstore->getGeneration()) { return; }
+	if (feed->rotate(feed_keep)) {
+		log_messages.printf(MSG_CRITICAL, "can't rotate completion feed\n");
+		return;
+	}
+	generation = jobstore->getGeneration();
+}
+
+/**
+ * Checks the tasks created before a restart:
+ * - tasks whose work units were assimilated but whose completions are not in
+ * the feed (e.g., lost with the feed) are finished: the work unit has a
+ * canonical result, it was assimilated and the task output is in place;
+ * - tasks without work units (the work generator stopped after making the
+ * batch durable but before creating all its work units, see main_loop) are
+ * waiting again.
+ */
+void check_created_tasks() {
+	std::vector<MapReduceJob>::iterator it;
+	std::vector<int> hosts;
+	MapReduceJob* mrj = NULL;
+	DB_WORKUNIT wu;
+	DB_RESULT result;
+	struct stat buffer;
+	char buf[256];
+	int retval;
+
+	for(it = jobs.begin(); it != jobs.end(); ++it) {
+		for(int reduce = 0; reduce < 2; reduce++) {
+			TaskTable& tasks = reduce ? it->getReduceTasks() : it->getMapTasks();
+			for(uint32_t i = 0; i < tasks.size(); i++) {
+				if (tasks.getState(i) != TASK_CREATED) { continue; }
+				sprintf(buf, "where name='%s'", tasks.getName(i).c_str());
+				if ((retval = wu.lookup(buf)) == ERR_DB_NOT_FOUND) {
+					log_messages.printf(MSG_NORMAL, "Task %s has no work unit\n", tasks.getName(i).c_str());
+					jobstore->setTaskState(*it, registry.getTask(tasks.getName(i), &mrj), TASK_WAITING);
+					continue;
+				}
+				if (retval ||
+						!wu.canonical_resultid ||
+						wu.assimilate_state != ASSIMILATE_DONE ||
+						stat(tasks.getOutputPath(i).c_str(), &buffer)) { continue; }
+				hosts.clear();
+				sprintf(buf, "where workunitid=%d and validate_state=%d", wu.id, VALIDATE_STATE_VALID);
+				while (!result.enumerate(buf)) { if (result.hostid) { hosts.push_back(result.hostid); } }
+				log_messages.printf(MSG_NORMAL, "Completion of %s not in feed\n", wu.name);
+				complete_task(tasks.getName(i), hosts);
+			}
+		}
+	}
+}
+
+/**
+ * Sends map outputs (.torrent files) to the host running a reducer, starting
+ * at entry 'from' (see feed_reducers). Each message holds as many entries as
+ * fit in a message to host. If the entries are 'complete' (all map tasks
+ * finished), the last message also holds their number, so the reducer stops
+ * waiting. Returns zero on success.
+ */
+int send_late_inputs(DB_RESULT& result, std::vector<ZipEntry>& entries, size_t from, bool complete) {
+	DB_MSG_TO_HOST mth;
+	std::string xml, entry;
+	const char* hex = "0123456789abcdef";
+	const std::string head = std::string("<trickle_down>\n<result_name>") +
+			result.name + "</result_name>\n";
+	const std::string tail = "</trickle_down>\n";
+	char count[64];
+	size_t i = from;
+
+	sprintf(count, "<inputs>%lu</inputs>\n", (unsigned long)entries.size());
+	do {
+		xml = head;
+		for(; i < entries.size(); i++) {
+			entry = "<torrent>\n<name>" + entries[i].name + "</name>\n<data>";
+			for(size_t c = 0; c < entries[i].data.size(); c++) {
+				entry += hex[(unsigned char)entries[i].data[c] >> 4];
+				entry += hex[(unsigned char)entries[i].data[c] & 0xF];
+			}
+			entry += "</data>\n</torrent>\n";
+			if (xml.size() + entry.size() + strlen(count) + tail.size() >= sizeof(mth.xml)) { break; }
+			xml += entry;
+		}
+		if (i < entries.size() && xml.size() == head.size()) {
+			log_messages.printf(MSG_CRITICAL, "%s is too large for a message\n", entries[i].name.c_str());
+			return ERR_BUFFER_OVERFLOW;
+		}
+		if (complete && i == entries.size()) { xml += count; }
+		xml += tail;
+		mth.clear();
+		mth.create_time = time(0);
+		mth.hostid = result.hostid;
+		mth.handled = false;
+		strcpy(mth.variety, LATE_INPUT_VARIETY);
+		strcpy(mth.xml, xml.c_str());
+		if (mth.insert()) {
+			log_messages.printf(MSG_CRITICAL, "can't send late inputs to %s\n", result.name);
+			return ERR_DB_CANT_INIT;
+		}
+	} while (i < entries.size());
+	return 0;
+}
+
+/**
+ * Reduce slow-start: reducers sent before all maps were finished receive the
+ * map outputs finished since then through trickle-down messages (the
+ * scheduler must have <msg_to_host/> enabled). Only results in progress are
+ * considered; unsent results get them once they are sent. Once all maps are
+ * finished, every reducer is told the final number of its inputs (it may be
+ * smaller than the number of map tasks, see ShufflePlanner::writeInput).
+ * Note: after a restart, all map outputs are sent again (the client ignores
+ * the ones it already has).
+ */
+void feed_reducers() {
+	std::vector<MapReduceJob>::iterator it;
+	std::map<uint32_t, std::vector<ZipEntry> > entries;
+	MapReduceTask mrt;
+	DB_RESULT result;
+	char clause[256];
+	size_t from;
+	bool complete;
+
+	for(it = jobs.begin(); it != jobs.end(); ++it) {
+		TaskTable& reds = it->getReduceTasks();
+		complete = it->getMapTasks().getFinished() == it->getMapTasks().size();
+		if (it->getSlowStart() >= 100 || !it->reachedSlowStart() ||
+				reds.getFinished() == reds.size()) { continue; }
+		entries.clear();
+		sprintf(clause,
+				"where name like '%s-reduce-%%' and server_state=%d",
+				it->getID().c_str(),
+				RESULT_SERVER_STATE_IN_PROGRESS);
+		while (!result.enumerate(clause)) {
+			std::string wu_name(result.name, strrchr(result.name, '_') ?
+					strrchr(result.name, '_') - result.name : strlen(result.name));
+			mrt = registry.getTask(wu_name);
+			if (!mrt.isValid() || mrt.getTable() != &reds) { continue; }
+			if (result_inputs.count(result.id)) { from = result_inputs[result.id]; }
+			else if (reducer_inputs.count(wu_name)) { from = reducer_inputs[wu_name]; }
+			else { from = 0; }
+			if (!entries.count(mrt.getIndex()) &&
+					planner.getEntries(*it, mrt.getIndex(), entries[mrt.getIndex()])) {
+				continue;
+			}
+			std::vector<ZipEntry>& available = entries[mrt.getIndex()];
+			if (available.size() <= from && (!complete || result_ended.count(result.id))) { continue; }
+			log_messages.printf(
+					MSG_NORMAL,
+					"Sending %lu late inputs to %s%s\n",
+					(unsigned long)(available.size() - from),
+					result.name,
+					complete ? " (all inputs)" : "");
+			if (!send_late_inputs(result, available, from, complete)) {
+				metrics->add("freecycles_late_inputs_sent_total", available.size() - from);
+				result_inputs[result.id] = available.size();
+				if (complete) { result_ended.insert(result.id); }
+			}
 		}
 	}
 }
@@ -176,96 +767,175 @@ void check_maps_state(MapReduceJob& mrj) {
 /**
  * This function tries to find a task to sent to a volunteer. The algorithm
  * proceeds as follows:
- * - for each job
+ * - for each job (in the order chosen by the scheduler, see mr_scheduler.h)
  * 	- tries to find a map task
- * 	- tries to find a reduce task (if all map tasks are finished)
+ * 	- tries to find a reduce task (if enough map tasks are finished, see
+ * 	  MapReduceJob::reachedSlowStart)
+ * The job of the returned task is placed into mrj. If there is no task, the
+ * returned task is invalid.
  */
-MapReduceTask* get_MapReduce_task(std::vector<MapReduceJob>& jobs_ref) {
-	std::vector<MapReduceJob>::iterator it;
-	MapReduceTask* mrt = NULL;
-	char buf[128];
-	for( it = jobs_ref.begin(); it != jobs_ref.end(); ++it) {
-		// if this job is already deployed (maps and reduces), nothing to do.
-		if(!it->hasUnsentTasks()) { continue; }
+MapReduceTask get_MapReduce_task(
+		std::vector<MapReduceJob>& jobs_ref,
+		MapReduceJob*& mrj) {
+	std::vector<MapReduceJob*> order;
+	std::vector<MapReduceJob*>::iterator jit;
+	MapReduceJob* it;
+	MapReduceTask mrt;
+	double start;
+	int retval;
+	// jobs already deployed (maps and reduces) are left out.
+	scheduler->order(jobs_ref, order);
+	for( jit = order.begin(); jit != order.end(); ++jit) {
+		it = mrj = *jit;
 		mrt = it->getNextMap();
 		// if all map tasks were already delivered.
-		if(mrt == NULL) {
+		if(!mrt.isValid()) {
 			log_messages.printf(MSG_NORMAL, "No more map tasks\n");
-			check_maps_state(*it);
 			mrt = it->getNextReduce();
 			// this means that we might be waiting for map results.
-			if(mrt == NULL) {
+			if(!mrt.isValid()) {
 				log_messages.printf(MSG_NORMAL, "No new reduce tasks.\n");
+				scheduler->idle(*it);
 				continue;
 			}
 			else {
 				// before returning a reduce task, make sure that the input is
-				// shuffled already.
+				// shuffled already (only the reducer zips are left to write).
 				if(it->needShuffle()) {
-					log_messages.printf(MSG_NORMAL, "Go go shuffle!\n");
-					sprintf(buf, "%lu", it->getReduceTasks().size());
-					shuffle(it->getID().c_str(), buf);
-					write_shuffled_state(&(*it));
+					log_messages.printf(MSG_NORMAL, "Finishing shuffle of job %s\n", it->getID().c_str());
+					start = dtime();
+					retval = planner.finish(*it);
+					metrics->observe("freecycles_shuffle_seconds", dtime() - start, metric_label("step", "finish"));
+					if (retval) {
+						log_messages.printf(MSG_CRITICAL, "can't shuffle job %s\n", it->getID().c_str());
+						scheduler->idle(*it);
+						continue;
+					}
+					jobstore->setShuffled(*it);
+				}
+				// Reduce slow-start: the input holds the map outputs finished
+				// so far (the others are sent later, see feed_reducers).
+				if (it->getSlowStart() < 100) {
+					size_t nentries;
+					start = dtime();
+					retval = planner.writeInput(*it, mrt.getIndex(), &nentries, true);
+					metrics->observe("freecycles_shuffle_seconds", dtime() - start, metric_label("step", "input"));
+					if (retval) {
+						log_messages.printf(MSG_CRITICAL, "can't write input of %s\n", mrt.getName().c_str());
+						scheduler->idle(*it);
+						continue;
+					}
+					reducer_inputs[mrt.getName()] = nentries;
 				}
-				log_messages.printf(MSG_NORMAL, "New reduce task: %s\n", mrt->getName().c_str());
+				log_messages.printf(MSG_NORMAL, "New reduce task: %s\n", mrt.getName().c_str());
+				metrics->add("freecycles_tasks_sent_total", 1, metric_label("phase", "reduce"));
+				scheduler->sent(*it);
 				return mrt;
 			}
 		}
 		else {
-			log_messages.printf(MSG_NORMAL, "Next map task: %s\n", mrt->getName().c_str());
+			log_messages.printf(MSG_NORMAL, "Next map task: %s\n", mrt.getName().c_str());
+			metrics->add("freecycles_tasks_sent_total", 1, metric_label("phase", "map"));
+			scheduler->sent(*it);
 			return mrt;
 		}
 	}
 	// if no job has more tasks to deliver.
 	log_messages.printf(MSG_NORMAL, "No job has more tasks to deliver\n");
-	return NULL;
+	return MapReduceTask();
+}
+
+/**
+ * Chooses the number of replicas (quorum) of a new work unit; the quorum
+ * depends on the reliability of the active hosts. Reduce tasks are assigned
+ * to hosts (placed into 'hosts'):
+ * - to trusted hosts (with a smaller quorum) if there are enough of them,
+ *   preferring those that hold map outputs of the job;
+ * - otherwise, to the hosts holding most map outputs of the job (if there are
+ *   enough of them).
+ * Reduces are spread (round robin) over the hosts holding map outputs (or
+ * over all trusted hosts if not enough of them hold any).
+ */
+int choose_replication(MapReduceJob& mrj, bool reduce, std::vector<int>& hosts) {
+	static unsigned int next_host = 0;
+	std::vector<int> candidates;
+	time_t now = time(0);
+	double pool = reliability.poolScore(now);
+	unsigned int nlocal = 0;
+	int replication;
+
+	if (pool < 0) { replication = REPLICATION_FACTOR; }
+	else if (pool >= RELIABILITY_TRUSTED) { replication = REPLICATION_MIN; }
+	else if (pool >= RELIABILITY_POOR) { replication = REPLICATION_FACTOR; }
+	else { replication = REPLICATION_MAX; }
+	if (!reduce) { return replication; }
+
+	reliability.getTrusted(now, candidates);
+	if (candidates.size() >= REPLICATION_MIN) {
+		replication = REPLICATION_MIN;
+		locality.rank(mrj.getID(), candidates);
+	}
+	else {
+		candidates.clear();
+		locality.getHosts(mrj.getID(), candidates);
+	}
+	while (nlocal < candidates.size() && locality.held(mrj.getID(), candidates[nlocal]))
+	{ nlocal++; }
+	if (nlocal < (unsigned int)replication) {
+		// Not enough hosts holding map outputs: any trusted host will do.
+		if (replication != REPLICATION_MIN || candidates.size() < REPLICATION_MIN)
+		{ return replication; }
+		nlocal = candidates.size();
+	}
+	for(int i = 0; i < replication; i++)
+	{ hosts.push_back(candidates[(next_host + i) % nlocal]); }
+	next_host += replication;
+	return replication;
 }
 
 /**
- * Creates a new job.
+ * Creates a new job. The work unit gets 'replication' replicas (all needed
+ * to agree). Work units assigned to 'hosts' (the scheduler must have
+ * <enable_assignment/>) are targeted: the transitioner creates no results,
+ * the scheduler creates one result for each host when it asks for work (see
+ * check_assignments). With lazy replication, unassigned work units start with
+ * a single replica (see check_lazy_replicas).
  */
-int make_job(MapReduceTask* mrt) {
+int make_job(MapReduceTask mrt, int replication, std::vector<int>& hosts) {
     DB_WORKUNIT wu;
     char path[MAXPATHLEN];
     const char* infiles[1];
+    std::string name = mrt.getName();
+    double start;
     int retval;
 
-    // Put the input file at the right place in the download dir hierarchy.s
-    retval = config.download_path(mrt->getName().c_str(), path);
-    if (retval) return retval;
-
-
-    log_messages.printf(MSG_NORMAL, "Making workunit %s\n", path);
-
-    retval = copy_file(mrt->getInputPath().c_str(), path);
-    if (retval) return retval;
+    log_messages.printf(MSG_NORMAL, "Making workunit %s\n", name.c_str());
 
     // Fill in the job parameters
     //
     wu.clear();
     wu.appid = app.id;
-    strcpy(wu.name, mrt->getName().c_str());
+    strcpy(wu.name, name.c_str());
     wu.rsc_fpops_est = 1e12;
     wu.rsc_fpops_bound = 1e14;
     wu.rsc_memory_bound = 1e8;
     wu.rsc_disk_bound = 1e8;
     wu.delay_bound = 86400;
-    wu.min_quorum = 1;      /* FIXME <- should be 3. Implement a zipped validator */
-    wu.target_nresults = REPLICATION_FACTOR; /* TODO <- 5 if map, 3 if reduce */
-    wu.max_error_results = REPLICATION_FACTOR*4;
-    wu.max_total_results = REPLICATION_FACTOR*8;
-    wu.max_success_results = REPLICATION_FACTOR*4;
+    wu.min_quorum = replication; /* replicas are compared by info-hash (see simple_validator.cpp) */
+    wu.target_nresults = lazy_replication && hosts.empty() ? 1 : replication;
+    if (hosts.size()) wu.transitioner_flags = TRANSITION_NO_NEW_RESULTS;
+    wu.max_error_results = replication*4;
+    wu.max_total_results = replication*8;
+    wu.max_success_results = replication*4;
 
     // Extracts the file name from path.
-    infiles[0] = mrt->getName().c_str();
+    infiles[0] = name.c_str();
     log_messages.printf(MSG_NORMAL, "In File %s", infiles[0]);
 
-    // Updates the MapReduceTask state and updates the jobtracker state file.
-    write_task_state(mrt, TASK_CREATED);
-
     // Register the job with BOINC.
     sprintf(path, "templates/%s", out_template_file);
-    return create_work(
+    start = dtime();
+    retval = create_work(
         wu,
         in_template,
         path,
@@ -274,13 +944,94 @@ int make_job(MapReduceTask* mrt) {
         1,
         config
     );
+    metrics->observe("freecycles_create_work_seconds", dtime() - start);
+    if (retval) return retval;
+    metrics->add("freecycles_workunits_created_total");
+    metrics->add("freecycles_results_created_total", wu.target_nresults);
+    if (wu.target_nresults < wu.min_quorum) {
+        LazyUnit& unit = lazy_units[wu.id];
+        unit.name = name;
+        unit.target_nresults = wu.target_nresults;
+        unit.min_quorum = wu.min_quorum;
+    }
+
+    for (unsigned int i=0; i<hosts.size(); i++) {
+        DB_ASSIGNMENT assignment;
+        assignment.clear();
+        assignment.create_time = time(0);
+        assignment.target_id = hosts[i];
+        assignment.target_type = ASSIGN_HOST;
+        assignment.multi = 0;
+        assignment.workunitid = wu.id;
+        // Targeted work units have no other way to get results.
+        if ((retval = assignment.insert())) {
+            log_messages.printf(MSG_CRITICAL, "can't assign %s to host %d\n", wu.name, hosts[i]);
+            return retval;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Reports the state of the cushion controller (at most once every
+ * CUSHION_LOG_INTERVAL seconds).
+ */
+void log_cushion() {
+	static time_t last_log = 0;
+	time_t now = time(0);
+
+	if (now - last_log < CUSHION_LOG_INTERVAL) { return; }
+	last_log = now;
+	log_messages.printf(
+			MSG_NORMAL,
+			"Cushion %d results, poll every %.1fs (%.2f results/s, %.3fs per work unit, %lu empty feeder events)\n",
+			cushion.getCushion(),
+			cushion.getPollInterval(),
+			cushion.getRate(),
+			cushion.getCreateTime(),
+			(unsigned long)cushion.getEmpties());
 }
 
 void main_loop() {
     int retval;
-    MapReduceTask* mrt = NULL;
+    MapReduceTask mrt;
+    MapReduceJob* mrj = NULL;
+    std::vector<MapReduceTask> batch;
+    // Replication and assigned hosts of each task of the batch.
+    std::vector<int> replications;
+    std::vector<std::vector<int> > assigned;
+    // True if the last batch was limited by the cushion (not by the tasks).
+    bool starved = false;
+    double step;
     while (1) {
         check_stop_daemons();
+        // Completions and late reducer inputs are handled on every pass.
+        step = dtime();
+        check_completions();
+        metrics->observe("freecycles_step_seconds", dtime() - step, metric_label("step", "check_completions"));
+        if ((retval = jobstore->commit())) {
+            log_messages.printf(MSG_CRITICAL, "can't write jobtracker state\n");
+            exit(ERR_WRITE);
+        }
+        // Jobs submitted while running (see util/bt/submit_job.cpp).
+        if ((retval = jobstore->importSpool()) < 0) {
+            log_messages.printf(MSG_CRITICAL, "can't import submitted jobs\n");
+            exit(ERR_WRITE);
+        }
+        if (retval > 0) {
+            log_messages.printf(MSG_NORMAL, "Imported %d submitted jobs\n", retval);
+            metrics->add("freecycles_jobs_imported_total", retval);
+            registry.build();
+        }
+        rotate_feed();
+        step = dtime();
+        feed_reducers();
+        metrics->observe("freecycles_step_seconds", dtime() - step, metric_label("step", "feed_reducers"));
+        step = dtime();
+        check_stragglers();
+        check_lazy_replicas();
+        check_assignments();
+        metrics->observe("freecycles_step_seconds", dtime() - step, metric_label("step", "replicas"));
         int n;
         retval = count_unsent_results(n, 0);
         if (retval) {
@@ -290,14 +1041,74 @@ void main_loop() {
             		boincerror(retval));
             exit(retval);
         }
-        if (n > CUSHION) { daemon_sleep(10); }
-        else {
-            int njobs = (CUSHION-n)/REPLICATION_FACTOR;;
-            for (int i=0; i<njobs; i++) {
+        metrics->set("freecycles_unsent_results", n);
+        if (cushion.observe(n, dtime(), starved)) {
+            metrics->add("freecycles_feeder_empty_total");
+            log_messages.printf(
+            		MSG_NORMAL,
+            		"Feeder ran dry (%lu times), cushion now %d\n",
+            		(unsigned long)cushion.getEmpties(),
+            		cushion.getCushion());
+        }
+        log_cushion();
+        // Results created recently may not be unsent results yet.
+        int target = cushion.getCushion() - cushion.getInFlight();
+        starved = false;
+        if (n < target) {
+            int nresults = 0;
+            double start;
+            batch.clear();
+            replications.clear();
+            assigned.clear();
+            step = dtime();
+            // Tasks are added until their results fill the cushion (the
+            // replication of each task is known once it is chosen).
+            while (n + nresults < target) {
             	// get MapReduce task if available.
-            	mrt = get_MapReduce_task(jobs);
-            	if(mrt == NULL) { break; }
-                retval = make_job(mrt);
+            	mrt = get_MapReduce_task(jobs, mrj);
+            	if(!mrt.isValid()) { break; }
+            	jobstore->setTaskState(*mrj, mrt, TASK_CREATED);
+            	batch.push_back(mrt);
+            	assigned.push_back(std::vector<int>());
+            	replications.push_back(choose_replication(
+            			*mrj, mrt.getTable() == &mrj->getReduceTasks(), assigned.back()));
+            	nresults += lazy_replication && assigned.back().empty() ? 1 : replications.back();
+            }
+            // All state changes of this batch are made durable at once
+            // (before the work units exist). If the work units are not
+            // created (failures exit), the tasks are waiting again after a
+            // restart (see check_created_tasks).
+            if ((retval = jobstore->commit())) {
+                log_messages.printf(MSG_CRITICAL, "can't write jobtracker state\n");
+                exit(ERR_WRITE);
+            }
+            starved = n + nresults >= target;
+            metrics->observe("freecycles_step_seconds", dtime() - step, metric_label("step", "choose_tasks"));
+            start = dtime();
+            // Put the input files at the right place in the download dir
+            // hierarchy (all of them before any work unit exists).
+            for (unsigned int i=0; i<batch.size(); i++) {
+                char path[MAXPATHLEN];
+                retval = config.download_path(batch[i].getName().c_str(), path);
+                if (!retval) retval = stage_input(batch[i].getInputPath().c_str(), path);
+                if (retval) {
+                    log_messages.printf(
+                    		MSG_CRITICAL,
+                    		"can't stage input of %s: %s\n",
+                    		batch[i].getName().c_str(),
+                    		boincerror(retval));
+                    exit(retval);
+                }
+            }
+            // All work units of this batch (and their assignments) are
+            // inserted in one transaction.
+            if (batch.size() && (retval = boinc_db.start_transaction())) {
+                log_messages.printf(MSG_CRITICAL, "can't start transaction\n");
+                exit(retval);
+            }
+            for (unsigned int i=0; i<batch.size(); i++) {
+                registry.getTask(batch[i].getName(), &mrj);
+                retval = make_job(batch[i], replications[i], assigned[i]);
                 if (retval) {
                     log_messages.printf(
                     		MSG_CRITICAL,
@@ -305,12 +1116,29 @@ void main_loop() {
                     		boincerror(retval));
                     exit(retval);
                 }
+                stragglers.started(
+                		batch[i].getName(),
+                		mrj->getID(),
+                		batch[i].getTable() == &mrj->getReduceTasks());
             }
-            // Now sleep for a few seconds to let the transitioner
-            // create instances for the jobs we just created.
-            // Otherwise we could end up creating an excess of jobs.
-            daemon_sleep(5);
+            if (batch.size() && (retval = boinc_db.commit_transaction())) {
+                log_messages.printf(MSG_CRITICAL, "can't commit work units\n");
+                exit(retval);
+            }
+            cushion.created(batch.size(), nresults, dtime(), dtime() - start);
+            metrics->observe("freecycles_step_seconds", dtime() - start, metric_label("step", "create_batch"));
+        }
+        metrics->set("freecycles_cushion_results", cushion.getCushion());
+        metrics->set("freecycles_in_flight_results", cushion.getInFlight());
+        metrics->set("freecycles_dispatch_rate", cushion.getRate());
+        metrics->set("freecycles_poll_interval_seconds", cushion.getPollInterval());
+        update_job_metrics();
+        if (metrics->write(time(0))) {
+            log_messages.printf(MSG_CRITICAL, "can't write metrics (%s)\n", metrics->getPath().c_str());
         }
+        // The transitioner creates the instances of the jobs just created
+        // meanwhile (they are counted as in flight until then).
+        boinc_sleep(cushion.getPollInterval());
     }
 }
 
@@ -318,7 +1146,8 @@ void usage(char *name) {
     fprintf(stderr, "This is an example BOINC work generator.\n"
         "This work generator has the following properties\n"
         "(you may need to change some or all of these):\n"
-        "  It attempts to maintain a \"cushion\" of 100 unsent job instances.\n"
+        "  It attempts to maintain a \"cushion\" of unsent job instances\n"
+        "  (sized from the rate at which volunteers take them).\n"
         "  (your app may not work this way; e.g. you might create work in batches)\n"
         "- Creates work for the application \"example_app\".\n"
         "- Creates a new input file for each job;\n"
@@ -329,7 +1158,16 @@ void usage(char *name) {
         "  [ --app X                Application name (default: example_app)\n"
         "  [ --in_template_file     Input template (default: example_app_in)\n"
         "  [ --out_template_file    Output template (default: example_app_out)\n"
-    	"  [ --jobtracker_file    	MapReduce state file (default: $PROJECT_HOME/mr/jobtracker.xml)\n"
+    	"  [ --jobtracker_file    	MapReduce jobs file (default: $PROJECT_HOME/mr/jobtracker.xml)\n"
+    	"                           State is kept in <file>.snap and <file>.journal\n"
+    	"                           New jobs are read from <file>.spool\n"
+    	"                           Completed tasks are read from <file>.feed\n"
+        "  [ --metrics_file X       Prometheus text file with the work generator metrics\n"
+        "                           (default: <jobtracker_file>.generator.prom)\n"
+        "  [ --scheduler X          Job scheduler: fifo, priority, fair or deficit\n"
+        "                           (default: fifo; weights are set with <weight>)\n"
+        "  [ --lazy_replication X   Start tasks with one replica, add one every X seconds\n"
+        "                           (and all that validation needs once a result arrives)\n"
         "  [ -d X ]                 Sets debug level to X.\n"
         "  [ -h | --help ]          Shows this help text.\n"
         "  [ -v | --version ]       Shows version information.\n",
@@ -363,6 +1201,12 @@ int main(int argc, char** argv) {
             out_template_file = argv[++i];
         } else if (!strcmp(argv[i], "--jobtracker_file")) {
             jobtracker_file_path = argv[++i];
+        } else if (!strcmp(argv[i], "--scheduler")) {
+            scheduler_name = argv[++i];
+        } else if (!strcmp(argv[i], "--lazy_replication")) {
+            lazy_replication = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--metrics_file")) {
+            metrics_file_path = argv[++i];
         } else if (is_arg(argv[i], "h") || is_arg(argv[i], "help")) {
             usage(argv[0]);
             exit(0);
@@ -380,6 +1224,16 @@ int main(int argc, char** argv) {
         }
     }
 
+    scheduler = new_scheduler(scheduler_name);
+    if (!scheduler) {
+        log_messages.printf(MSG_CRITICAL, "unknown scheduler: %s\n\n", scheduler_name);
+        usage(argv[0]);
+        exit(1);
+    }
+    metrics = new MetricsRegistry(metrics_file_path ?
+    		metrics_file_path : std::string(jobtracker_file_path) + ".generator.prom");
+    declare_metrics();
+
     retval = config.parse_file();
     if (retval) {
         log_messages.printf(
@@ -389,21 +1243,23 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
-    // Open jobtracker state file.
-	jobtracker_file = fopen(jobtracker_file_path, "r+");
-    if (!jobtracker_file){
+    // Load jobtracker state (snapshot, journal and new jobs in the XML file).
+    jobstore = new JobStore(jobtracker_file_path, jobs);
+    retval = jobstore->load();
+    if(retval) {
     	log_messages.printf(
     			MSG_CRITICAL,
-    			"Error opening jobtracker file (%s).\n",
+    			"Error loading jobtracker state (%s).\n",
     			jobtracker_file_path);
     	exit(ERR_FOPEN);
     }
-
-    // Parse jobtracker state file.
-    retval = parse_jobtracker(jobtracker_file, jobs);
-    if(retval) {
-    	log_messages.printf(MSG_CRITICAL, "Error parsing jobtracker file\n");
-    	exit(ERR_XML_PARSE);
+    registry.build();
+    feed = new CompletionFeedReader(jobtracker_file_path);
+    // Rebuild the partial reducer inputs of jobs not shuffled yet.
+    for (std::vector<MapReduceJob>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+        if (!it->isShuffled() && planner.reset(*it)) {
+            log_messages.printf(MSG_CRITICAL, "can't shuffle job %s\n", it->getID().c_str());
+        }
     }
 
     retval = boinc_db.open(
@@ -426,6 +1282,16 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    load_host_history();
+    // Completions recorded while stopped (and the ones missing from the feed).
+    check_completions();
+    check_created_tasks();
+    if (jobstore->commit()) {
+        log_messages.printf(MSG_CRITICAL, "can't write jobtracker state\n");
+        exit(ERR_WRITE);
+    }
+    load_start_times();
+
     log_messages.printf(MSG_NORMAL, "Starting\n");
 
     main_loop();
@@ -9,11 +9,31 @@
 # - split the file in 'nmaps' files with the same number of lines;
 # - create .torrent files for each of the file parts and will place them inside
 # a well known location.
+# With '--after ids', it adds a stage that runs after the jobs 'ids' (comma
+# separated) instead: the stage has 'nreds' reducers and its map inputs are
+# the reduce outputs of those jobs (created by the work generator, see
+# expand_stage in main/mr_jobtracker.h), so nothing is split or hashed.
+# util/bt/submit_job does the same as this script for a running work generator
+# (the job is picked up without a restart), splitting the input by size on line
+# boundaries and writing and hashing the splits in parallel.
 
 PRE_STAGE_DIR=/tmp
 UPLOAD_DIR=/tmp
 MAKE_TORRENT=/home/underscore/git/freeCycles/src/util/bt/make_torrent
 TRACKER=udp://boinc.rnl.ist.utl.pt:6969
+# Replicas of each map task (every replica downloads the map input). Must
+# match REPLICATION_FACTOR in the work generator.
+REPLICATION=3
+# Number of make_torrent processes running at the same time (each one hashes
+# with HASH_THREADS threads).
+STAGE_JOBS=4
+HASH_THREADS=$(( ($(nproc) + STAGE_JOBS - 1) / STAGE_JOBS ))
+# Percentage of map tasks that must finish before reduce tasks are sent
+# (100 waits for all maps).
+SLOWSTART=100
+# Share of the job when several jobs run at the same time (see --scheduler in
+# the work generator).
+WEIGHT=1
 JOBTRACKER_FILE=/tmp/jobtracker.xml
 
 function split_input_file {
@@ -41,6 +61,10 @@ function print_jobtracker {
   echo "<id>"$id"</id>"
   # write the shuffle status (initialized to false)
   echo "<shuffled>0</shuffled>"
+  # write the reduce slow-start threshold
+  echo "<slowstart>$SLOWSTART</slowstart>"
+  # write the scheduling weight
+  echo "<weight>$WEIGHT</weight>"
   # write map task information
   for file in $id-map-*
   do
@@ -51,33 +75,68 @@ function print_jobtracker {
     echo "<output>$UPLOAD_DIR/$file.zip</output>"
     echo "</map>"
   done
+  print_reduces
+
+  # close outter tag
+  echo "</mr>" >> $JOBTRACKER_FILE
+}
+
+function print_stage {
+  echo "<mr>"
+  echo "<id>"$id"</id>"
+  echo "<shuffled>0</shuffled>"
+  echo "<slowstart>$SLOWSTART</slowstart>"
+  echo "<weight>$WEIGHT</weight>"
+  # write the dependencies (map tasks are created from their reduce outputs)
+  for dep in ${after//,/ }
+  do
+    echo "<after>$dep</after>"
+  done
+  print_reduces
+  echo "</mr>"
+}
+
+function print_reduces {
   # write reduce task information
-  # remember that some magic will happen (see shuffle.sh)
+  # reducer inputs are built by the work generator (see main/mr_shuffle.h)
   for ((aux=0; aux<$nreds; aux++))
   do
     echo "<reduce>"
     echo "<name>$id-reduce-$aux</name>"
     echo "<status>w</status>"
     echo "<input>$PRE_STAGE_DIR/$id-reduce-$aux.zip</input>"
-    echo "<output>$UPLOAD_DIR/$id-reduce-$aux.torrent</input>"
+    echo "<output>$UPLOAD_DIR/$id-reduce-$aux.torrent</output>"
     echo "</reduce>"
   done
-
-  # close outter tag
-  echo "</mr>" >> $JOBTRACKER_FILE
 }
 
 function make_torrents {
   for file in $id-map-*
   do
-    $MAKE_TORRENT $file -t $TRACKER -o $file.torrent
+    # piece size is chosen from the split size and the number of downloaders
+    $MAKE_TORRENT $file -t $TRACKER -d $REPLICATION -j $HASH_THREADS -o $file.torrent &
+    # keep at most STAGE_JOBS splits being hashed at the same time
+    while [ $(jobs -r | wc -l) -ge $STAGE_JOBS ]
+    do
+      sleep 0.1
+    done
   done
-
+  wait
 }
 
+if [ "$#" -eq 3 ] && [ "$1" == "--after" ]; then
+  after=$2
+  nreds=$3
+  id=$(date +%s)
+  print_stage >> $JOBTRACKER_FILE
+  echo $id
+  exit
+fi
+
 if [ "$#" -ne 3 ]; then
   echo "Illegal number of parameters."
   echo "Usage ./setup-mr.sh nmaps nreds ifile"
+  echo "      ./setup-mr.sh --after id[,id...] nreds"
   exit 
 fi
 
@@ -0,0 +1,276 @@
+/*
+ * bt_agent.cpp
+ *
+ * Resident BitTorrent agent (one per host). It is based on simple_client.cpp
+ * but, instead of scanning a directory for new .torrent files, it serves
+ * requests from freeCycles tasks (see AgentHandler in data_handler.h) through
+ * a Unix socket inside the shared directory.
+ * All tasks running on the host share this session: one peer table, global
+ * rate limits and outputs keep being seeded after tasks exit.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <list>
+#include <vector>
+#include <string>
+
+#include "data_handler.h"
+
+// Seconds between two fast-resume checkpoints.
+#define CHECKPOINT_INTERVAL 600
+// Milliseconds the agent waits for socket activity before checking torrents.
+#define POLL_INTERVAL 1000
+
+/**
+ * A connected task. Pending waits are replied (in completion order) as soon
+ * as the respective torrent is seeding.
+ */
+struct AgentClient {
+	int fd;
+	std::string buf;
+	std::list<libtorrent::torrent_handle> waiting;
+};
+
+volatile sig_atomic_t agent_stop = 0;
+
+void handle_stop(int /*sig*/) { agent_stop = 1; }
+
+/**
+ * Sends a reply line to a client.
+ */
+void reply(AgentClient& c, const char* what, const std::string& arg) {
+	std::string line = std::string(what) + " " + arg + "\n";
+	if (write(c.fd, line.c_str(), line.size()) != (ssize_t)line.size()) {
+		fprintf(stderr, "failed to reply to client %d: %s", c.fd, line.c_str());
+	}
+}
+
+/**
+ * Processes one request line from a client.
+ */
+void process_request(
+		BitTorrentHandler& bt,
+		AgentClient& c,
+		const std::string& shared_dir,
+		const std::string& line) {
+	std::string cmd = line.substr(0, line.find(' '));
+	std::string arg = line.substr(line.find(' ') + 1);
+	libtorrent::torrent_handle th;
+	int partition = -1;
+
+	// FETCH is an ADD that only downloads one partition file.
+	if (!cmd.compare("FETCH")) {
+		partition = atoi(arg.c_str());
+		arg = arg.substr(arg.find(' ') + 1);
+		cmd = "ADD";
+	}
+	if (!cmd.compare("ADD") || !cmd.compare("PUBLISH")) {
+		// Published files were just created by the task (no checking needed).
+		th = bt.add_torrent(arg, shared_dir, !cmd.compare("PUBLISH"), partition);
+		if (!th.is_valid()) { reply(c, "ERR", "cannot add " + arg); return; }
+		if (!cmd.compare("PUBLISH")) {
+			// Keep a copy of the .torrent next to the data (for restarts).
+			if (arg.compare(shared_dir + th.name() + ".torrent"))
+			{ copy_file(arg, shared_dir + th.name() + ".torrent"); }
+			bt.getCache().touch(th.name(), info_hash_hex(th));
+			bt.getCache().save();
+			bt.evict_cache();
+		}
+		reply(c, "OK", th.name());
+	}
+	else if (!cmd.compare("WAIT")) {
+		std::vector<libtorrent::torrent_handle> handles = bt.getTorrents();
+		std::vector<libtorrent::torrent_handle>::iterator hit;
+		for(hit = handles.begin(); hit != handles.end(); hit++) {
+			if (hit->name() == arg) { break; }
+		}
+		if (hit == handles.end()) { reply(c, "ERR", "unknown torrent " + arg); }
+		else { c.waiting.push_back(*hit); }
+	}
+	else { reply(c, "ERR", "unknown command " + cmd); }
+}
+
+/**
+ * Reads all available data from a client and processes complete lines.
+ * Returns non zero if the client closed the connection.
+ */
+int read_client(
+		BitTorrentHandler& bt,
+		AgentClient& c,
+		const std::string& shared_dir) {
+	char buf[512];
+	ssize_t ret;
+	size_t end;
+
+	if ((ret = read(c.fd, buf, sizeof(buf))) <= 0) { return 1; }
+	c.buf.append(buf, ret);
+	while ((end = c.buf.find('\n')) != std::string::npos) {
+		process_request(bt, c, shared_dir, c.buf.substr(0, end));
+		c.buf.erase(0, end + 1);
+	}
+	return 0;
+}
+
+/**
+ * Replies to every wait whose torrent is already seeding. Finished downloads
+ * are indexed right away (tasks look for co-located inputs in the index, see
+ * find_local_copy). Returns the number of replies.
+ */
+int check_waiting(BitTorrentHandler& bt, AgentClient& c) {
+	std::list<libtorrent::torrent_handle>::iterator lit = c.waiting.begin();
+	int done = 0;
+	while (lit != c.waiting.end()) {
+		if (!torrent_done(*lit)) { lit++; continue; }
+		bt.getCache().touch(lit->name(), info_hash_hex(*lit));
+		reply(c, "DONE", lit->name());
+		lit = c.waiting.erase(lit);
+		done++;
+	}
+	if (done) { bt.getCache().save(); }
+	return done;
+}
+
+/**
+ * Opens the agent Unix socket (inside the shared directory).
+ */
+int open_socket(const std::string& path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) { return -1; }
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	// Remove stale socket (left behind by a crashed agent).
+	unlink(path.c_str());
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void usage(char *name) {
+    fprintf(stderr, "This is the freeCycles per host BitTorrent agent.\n"
+        "Usage: %s [OPTION]...\n"
+        "Options:\n"
+        "  [ -d X ]   Download rate limit (KBps)\n"
+        "  [ -u Y ]   Upload rate limit (KBps)\n"
+        "  [ -c Z ]   Shared directory cache budget (MB)\n"
+        "  [ -h   ]   Shows this help text.\n"
+        "  [ -s   ]   Shared directory (where the agent socket is created).\n",
+        name
+    );
+}
+
+int main(int argc, char* argv[]) {
+	std::string shared_dir = "/tmp/freeCycles-shared/";
+	int download_rate = 0, upload_rate = 0;
+	long long cache_budget = CACHE_DEFAULT_BUDGET;
+	std::list<AgentClient> clients;
+	std::list<AgentClient>::iterator cit;
+	std::vector<struct pollfd> fds;
+	time_t last_checkpoint = time(NULL);
+	int listen_fd, lock_fd, done;
+
+	/* Command line processing */
+	for(int arg_index = 1; arg_index < argc; arg_index++) {
+		if (!strcmp(argv[arg_index], "-d"))
+		{ download_rate = atoi(argv[++arg_index]) * 1000; }
+		else if (!strcmp(argv[arg_index], "-u"))
+		{ upload_rate = atoi(argv[++arg_index]) * 1000; }
+		else if (!strcmp(argv[arg_index], "-c"))
+		{ cache_budget = atoll(argv[++arg_index]) * 1024 * 1024; }
+		else if (!strcmp(argv[arg_index], "-s"))
+		{ shared_dir = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-h")) {
+			usage(argv[0]);
+			exit(0);
+		}
+		else {
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGTERM, handle_stop);
+	signal(SIGINT, handle_stop);
+
+	/* Only one agent per shared directory (the lock is held until exit) */
+	lock_fd = open((shared_dir + AGENT_LOCK_FILE).c_str(), O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB)) {
+		fprintf(stderr, "another agent is running (shared dir = %s).\n", shared_dir.c_str());
+		return 1;
+	}
+
+	/* Init session (rate limits apply to the whole host) */
+	BitTorrentHandler bt("", "", shared_dir, shared_dir, "", "bt_agent");
+	if (bt.init(download_rate, upload_rate, cache_budget)) { return 1; }
+
+	if ((listen_fd = open_socket(shared_dir + AGENT_SOCKET_FILE)) < 0) {
+		fprintf(stderr, "failed to open agent socket: %s\n", strerror(errno));
+		return 1;
+	}
+	fprintf(stderr, "Just started bt agent (shared dir = %s).\n", shared_dir.c_str());
+
+	while(!agent_stop) {
+		fds.clear();
+		struct pollfd lpfd = { listen_fd, POLLIN, 0 };
+		fds.push_back(lpfd);
+		for(cit = clients.begin(); cit != clients.end(); cit++) {
+			struct pollfd pfd = { cit->fd, POLLIN, 0 };
+			fds.push_back(pfd);
+		}
+		if (poll(&fds[0], fds.size(), POLL_INTERVAL) < 0 && errno != EINTR) { break; }
+
+		// Serve connected tasks (fds[1..] follow the clients order).
+		int i = 1;
+		done = 0;
+		for(cit = clients.begin(); cit != clients.end(); i++) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+					read_client(bt, *cit, shared_dir)) {
+				close(cit->fd);
+				cit = clients.erase(cit);
+				continue;
+			}
+			done += check_waiting(bt, *cit);
+			cit++;
+		}
+		// New files may exceed the cache budget.
+		if (done) { bt.evict_cache(); }
+		// Accept new tasks.
+		if (fds[0].revents & POLLIN) {
+			AgentClient c;
+			if ((c.fd = accept(listen_fd, NULL, NULL)) >= 0) { clients.push_back(c); }
+		}
+		// Alerts are not used by the agent (drop them).
+		bt.dropAlerts();
+		// Periodically save fast-resume data (in case the agent is killed)
+		// and enforce the cache budget (jobs also expire with time).
+		if (time(NULL) - last_checkpoint > CHECKPOINT_INTERVAL) {
+			bt.evict_cache();
+			bt.save_resume_data();
+			last_checkpoint = time(NULL);
+		}
+	}
+
+	for(cit = clients.begin(); cit != clients.end(); cit++) { close(cit->fd); }
+	close(listen_fd);
+	unlink((shared_dir + AGENT_SOCKET_FILE).c_str());
+	close(lock_fd);
+	// BitTorrentHandler destructor saves resume data and the cache index.
+	return 0;
+}
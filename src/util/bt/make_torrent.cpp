@@ -42,8 +42,16 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include <boost/bind.hpp>
 
+#include <sys/time.h>
+
+#include "piece_size.h"
+#include "piece_hasher.h"
+
 using namespace libtorrent;
 
+// size (bytes) of a HAVE message, sent to every peer for every piece
+#define HAVE_MSG_SIZE 9
+
 // do not include files and folders whose
 // name starts with a .
 bool file_filter(std::string const& f)
@@ -53,9 +61,50 @@ bool file_filter(std::string const& f)
 	return true;
 }
 
-void print_progress(int i, int num)
+double now_ms()
 {
-	fprintf(stderr, "\r%d/%d", i+1, num);
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+// hashes the files with every piece size (16 kiB up to 4 MiB) and reports
+// the hashing time, the .torrent size and the protocol overhead (the
+// .torrent plus HAVE messages, for every downloader) of each setting
+int benchmark_piece_sizes(file_storage& fs, std::string const& full_path
+	, int pad_file_limit, int flags, int downloaders, int threads)
+{
+	int chosen = choose_piece_size(fs.total_size(), downloaders);
+
+	// warm up the page cache so the first setting is not penalized
+	create_torrent warmup(fs, chosen, pad_file_limit, flags);
+	if (hash_pieces_parallel(warmup, parent_path(full_path), threads))
+		return 1;
+
+	printf("total size: %lld bytes, downloaders: %d\n"
+		, (long long)fs.total_size(), downloaders);
+	printf("  piece size    pieces   hash ms    MB/s   .torrent  overhead (%%)\n");
+	for (int piece_size = PIECE_SIZE_MIN; piece_size <= PIECE_SIZE_MAX; piece_size *= 2)
+	{
+		create_torrent t(fs, piece_size, pad_file_limit, flags);
+		double start = now_ms();
+		if (hash_pieces_parallel(t, parent_path(full_path), threads))
+			return 1;
+		double elapsed = now_ms() - start;
+
+		std::vector<char> torrent;
+		bencode(back_inserter(torrent), t.generate());
+		long long overhead = ((long long)torrent.size()
+			+ (long long)t.num_pieces() * HAVE_MSG_SIZE) * downloaders;
+		printf("%c %10d %9d %9.1f %7.1f %10d %9lld (%.3f)\n"
+			, piece_size == chosen ? '*' : ' '
+			, piece_size, t.num_pieces(), elapsed
+			, elapsed > 0 ? fs.total_size() / 1000.0 / elapsed : 0.0
+			, int(torrent.size()), overhead
+			, fs.total_size() > 0 ? overhead * 100.0 / fs.total_size() : 0.0);
+	}
+	printf("(* piece size chosen for %d downloaders)\n", downloaders);
+	return 0;
 }
 
 void print_usage()
@@ -83,6 +132,13 @@ void print_usage()
 		"            than bytes will be piece-aligned\n"
 		"-s bytes    specifies a piece size for the torrent\n"
 		"            This has to be a multiple of 16 kiB\n"
+		"            If not set, it is chosen from the file size\n"
+		"            and the number of downloaders (see -d)\n"
+		"-d count    expected number of downloaders (default 1)\n"
+		"-j threads  number of hashing threads (default: one\n"
+		"            per core)\n"
+		"-b          benchmark every piece size (hashing time and\n"
+		"            transfer overhead) instead of writing a torrent\n"
 		"-l          Don't follow symlinks, instead encode them as\n"
 		"            links in the torrent file\n"
 		"-o file     specifies the output filename of the torrent file\n"
@@ -115,6 +171,9 @@ int main(int argc, char* argv[])
 		std::vector<std::string> trackers;
 		int pad_file_limit = -1;
 		int piece_size = 0;
+		int downloaders = 1;
+		bool benchmark = false;
+		int threads = 0;
 		int flags = 0;
 		std::string root_cert;
 
@@ -153,6 +212,17 @@ int main(int argc, char* argv[])
 					++i;
 					piece_size = atoi(argv[i]);
 					break;
+				case 'd':
+					++i;
+					downloaders = atoi(argv[i]);
+					break;
+				case 'b':
+					benchmark = true;
+					break;
+				case 'j':
+					++i;
+					threads = atoi(argv[i]);
+					break;
 				case 'm':
 					++i;
 					merklefile = argv[i];
@@ -197,6 +267,13 @@ int main(int argc, char* argv[])
 			return 1;
 		}
 
+		if (benchmark)
+			return benchmark_piece_sizes(fs, full_path, pad_file_limit, flags
+				, downloaders, threads);
+
+		if (piece_size == 0)
+			piece_size = choose_piece_size(fs.total_size(), downloaders);
+
 		create_torrent t(fs, piece_size, pad_file_limit, flags);
 		int tier = 0;
 		for (std::vector<std::string>::iterator i = trackers.begin()
@@ -207,16 +284,11 @@ int main(int argc, char* argv[])
 			, end(web_seeds.end()); i != end; ++i)
 			t.add_url_seed(*i);
 
-		error_code ec;
-		set_piece_hashes(t, parent_path(full_path)
-			, boost::bind(&print_progress, _1, t.num_pieces()), ec);
-		if (ec)
-		{
-			fprintf(stderr, "%s\n", ec.message().c_str());
+		// pieces (and files) are hashed by all cores
+		if (hash_pieces_parallel(t, parent_path(full_path), threads))
 			return 1;
-		}
 
-		fprintf(stderr, "\n");
+		error_code ec;
 		t.set_creator(creator_str.c_str());
 		if (!comment_str.empty())
 			t.set_comment(comment_str.c_str());
@@ -0,0 +1,363 @@
+/*
+ * submit_job.cpp
+ *
+ * Job submission tool. It stages an input file as the map inputs of a new
+ * MapReduce job and registers the job with the work generator, replacing the
+ * staging done by scripts/setup_mr.sh:
+ * - split boundaries are chosen by size (the input is divided in 'nmaps'
+ *   parts with about the same number of bytes), always at the end of a record
+ *   (a line), so no record is split between two maps;
+ * - splits are written and hashed in parallel (several splits at the same
+ *   time, each one hashed with its share of the cores, see piece_hasher.h);
+ * - the job description is written to a temporary file and then renamed into
+ *   the jobtracker spool directory (<jobtracker xml>.spool, see
+ *   JobStore::importSpool in main/mr_state.h). The work generator imports the
+ *   whole job (or nothing) and only after all its inputs are in place.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+#include <string>
+
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/create_torrent.hpp"
+#include "libtorrent/file.hpp"
+
+#include "piece_size.h"
+#include "piece_hasher.h"
+
+// Buffer used to scan and copy the input (bytes).
+#define COPY_BUFFER_SIZE (1024*1024)
+// Suffix of the jobtracker spool directory (see main/mr_state.h).
+#define SPOOL_SUFFIX ".spool"
+
+/**
+ * Job being submitted (from the command line).
+ */
+struct Submission {
+	std::string id;
+	std::string input;
+	std::string pre_stage_dir;
+	std::string upload_dir;
+	std::string jobtracker;
+	std::vector<std::string> trackers;
+	std::vector<std::string> after;
+	int nreds;
+	int replication;
+	int slowstart;
+	int weight;
+	/**
+	 * Byte ranges of the splits: split i is [bounds[i], bounds[i+1]).
+	 */
+	std::vector<off_t> bounds;
+	/**
+	 * Next split to stage and number of hashing threads per split.
+	 */
+	size_t next;
+	int hash_threads;
+	int error;
+	pthread_mutex_t lock;
+};
+
+/**
+ * Name of split 'i' (also the name of its map task) and its path.
+ */
+std::string split_name(Submission& s, size_t i) {
+	char buf[32];
+	sprintf(buf, "-map-%lu", (unsigned long)i);
+	return s.id + buf;
+}
+
+std::string split_path(Submission& s, size_t i) { return s.pre_stage_dir + "/" + split_name(s, i); }
+
+/**
+ * Returns the offset just after the first new line at or after 'offset' (or
+ * 'size' if there is none).
+ */
+off_t next_record(int fd, off_t offset, off_t size) {
+	std::vector<char> buf(COPY_BUFFER_SIZE);
+	ssize_t n;
+	while (offset < size && (n = pread(fd, &buf[0], buf.size(), offset)) > 0) {
+		char* nl = (char*)memchr(&buf[0], '\n', n);
+		if (nl) { return offset + (nl - &buf[0]) + 1; }
+		offset += n;
+	}
+	return size;
+}
+
+/**
+ * Chooses the split boundaries of the input ('nmaps' splits of about the same
+ * size, ending at a record boundary). Inputs with few records may get fewer
+ * splits. Returns zero on success.
+ */
+int choose_splits(Submission& s, int nmaps) {
+	struct stat st;
+	int fd;
+
+	if ((fd = open(s.input.c_str(), O_RDONLY)) < 0) {
+		fprintf(stderr, "failed to open %s: %s\n", s.input.c_str(), strerror(errno));
+		return 1;
+	}
+	if (fstat(fd, &st) || st.st_size == 0) {
+		fprintf(stderr, "empty (or unreadable) input %s\n", s.input.c_str());
+		close(fd);
+		return 1;
+	}
+	s.bounds.push_back(0);
+	for(int i = 1; i < nmaps; i++) {
+		off_t target = (off_t)((long long)st.st_size * i / nmaps);
+		// The record holding the byte before the target ends this split.
+		if (target <= s.bounds.back()) { continue; }
+		off_t bound = next_record(fd, target - 1, st.st_size);
+		if (bound > s.bounds.back() && bound < st.st_size) { s.bounds.push_back(bound); }
+	}
+	s.bounds.push_back(st.st_size);
+	close(fd);
+	return 0;
+}
+
+/**
+ * Writes split 'i' of the input. Returns zero on success.
+ */
+int write_split(Submission& s, size_t i) {
+	std::vector<char> buf(COPY_BUFFER_SIZE);
+	std::string path = split_path(s, i);
+	off_t offset = s.bounds[i];
+	int in, out;
+	ssize_t n = 0;
+
+	if ((in = open(s.input.c_str(), O_RDONLY)) < 0) { return 1; }
+	if ((out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "failed to create %s: %s\n", path.c_str(), strerror(errno));
+		close(in);
+		return 1;
+	}
+	while (offset < s.bounds[i + 1]) {
+		size_t chunk = s.bounds[i + 1] - offset < (off_t)buf.size() ?
+				s.bounds[i + 1] - offset : buf.size();
+		if ((n = pread(in, &buf[0], chunk, offset)) <= 0 ||
+				write(out, &buf[0], n) != n) { break; }
+		offset += n;
+	}
+	close(in);
+	if (close(out) || offset < s.bounds[i + 1]) {
+		fprintf(stderr, "failed to write %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Creates the .torrent file of split 'i' (written to a temporary file and
+ * renamed, so a .torrent file is always complete). Returns zero on success.
+ */
+int make_split_torrent(Submission& s, size_t i) {
+	std::string path = split_path(s, i);
+	std::string torrent = path + ".torrent";
+	libtorrent::file_storage fs;
+	std::vector<char> data;
+	FILE* f;
+
+	libtorrent::add_files(fs, path);
+	libtorrent::create_torrent t(fs, choose_piece_size(fs.total_size(), s.replication));
+	for(size_t k = 0; k < s.trackers.size(); k++) { t.add_tracker(s.trackers[k], k); }
+	if (hash_pieces_parallel(t, libtorrent::parent_path(path), s.hash_threads)) { return 1; }
+	t.set_creator("freeCycles");
+	libtorrent::bencode(std::back_inserter(data), t.generate());
+	if (!(f = fopen((torrent + ".tmp").c_str(), "wb")) ||
+			fwrite(&data[0], 1, data.size(), f) != data.size() ||
+			fclose(f) ||
+			rename((torrent + ".tmp").c_str(), torrent.c_str())) {
+		fprintf(stderr, "failed to write %s: %s\n", torrent.c_str(), strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Thread body: stages splits (write and hash) until there are none left.
+ */
+void* stage_splits(void* args) {
+	Submission& s = *(Submission*)args;
+	size_t i;
+	int error;
+
+	while (true) {
+		pthread_mutex_lock(&s.lock);
+		i = s.next++;
+		error = s.error;
+		pthread_mutex_unlock(&s.lock);
+		if (error || i >= s.bounds.size() - 1) { break; }
+		if (write_split(s, i) || make_split_torrent(s, i)) {
+			pthread_mutex_lock(&s.lock);
+			s.error = 1;
+			pthread_mutex_unlock(&s.lock);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Stages all splits using 'nthreads' threads (0 means one per core).
+ * Returns zero on success.
+ */
+int stage(Submission& s, int nthreads) {
+	size_t nsplits = s.bounds.size() - 1;
+	std::vector<pthread_t> threads;
+	int nworkers;
+
+	if (nthreads <= 0) { nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN); }
+	if (nthreads < 1) { nthreads = 1; }
+	nworkers = (size_t)nthreads < nsplits ? nthreads : (int)nsplits;
+	// Cores left by the splits staged at the same time hash each split.
+	s.hash_threads = nthreads / nworkers;
+	s.next = 0;
+	s.error = 0;
+	pthread_mutex_init(&s.lock, NULL);
+	threads.resize(nworkers);
+	for(int i = 0; i < nworkers; i++) {
+		if (pthread_create(&threads[i], NULL, stage_splits, &s)) {
+			// Stage the remaining splits in the calling thread instead.
+			threads[i] = pthread_self();
+			stage_splits(&s);
+		}
+	}
+	for(int i = 0; i < nworkers; i++)
+	{ if (!pthread_equal(threads[i], pthread_self())) { pthread_join(threads[i], NULL); } }
+	pthread_mutex_destroy(&s.lock);
+	return s.error;
+}
+
+/**
+ * Writes the job description (same format as jobtracker.xml) into the
+ * jobtracker spool. Returns zero on success.
+ */
+int register_job(Submission& s) {
+	std::string spool = s.jobtracker + SPOOL_SUFFIX;
+	std::string path = spool + "/" + s.id + ".xml";
+	std::string tmp = path + ".tmp";
+	FILE* f;
+
+	if (mkdir(spool.c_str(), 0755) && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s: %s\n", spool.c_str(), strerror(errno));
+		return 1;
+	}
+	if (!(f = fopen(tmp.c_str(), "w"))) {
+		fprintf(stderr, "failed to create %s: %s\n", tmp.c_str(), strerror(errno));
+		return 1;
+	}
+	fprintf(f, "<mr>\n<id>%s</id>\n<shuffled>0</shuffled>\n", s.id.c_str());
+	fprintf(f, "<slowstart>%d</slowstart>\n<weight>%d</weight>\n", s.slowstart, s.weight);
+	for(size_t i = 0; i < s.after.size(); i++)
+	{ fprintf(f, "<after>%s</after>\n", s.after[i].c_str()); }
+	for(size_t i = 0; i < s.bounds.size() - 1; i++) {
+		std::string name = split_name(s, i);
+		fprintf(f, "<map>\n<name>%s</name>\n<status>w</status>\n", name.c_str());
+		fprintf(f, "<input>%s/%s.torrent</input>\n", s.pre_stage_dir.c_str(), name.c_str());
+		fprintf(f, "<output>%s/%s.zip</output>\n</map>\n", s.upload_dir.c_str(), name.c_str());
+	}
+	// Reducer inputs are built by the work generator (see main/mr_shuffle.h).
+	for(int r = 0; r < s.nreds; r++) {
+		fprintf(f, "<reduce>\n<name>%s-reduce-%d</name>\n<status>w</status>\n", s.id.c_str(), r);
+		fprintf(f, "<input>%s/%s-reduce-%d.zip</input>\n", s.pre_stage_dir.c_str(), s.id.c_str(), r);
+		fprintf(f, "<output>%s/%s-reduce-%d.torrent</output>\n</reduce>\n", s.upload_dir.c_str(), s.id.c_str(), r);
+	}
+	fprintf(f, "</mr>\n");
+	if (fflush(f) || fsync(fileno(f)) || fclose(f) || rename(tmp.c_str(), path.c_str())) {
+		fprintf(stderr, "failed to write %s: %s\n", path.c_str(), strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+void usage(char* name) {
+	fprintf(stderr,
+			"usage: %s nmaps nreds ifile [OPTIONS]\n"
+			"\n"
+			"Splits 'ifile' into (at most) 'nmaps' map inputs, creates their\n"
+			"torrents and submits the job (with 'nreds' reducers) to the\n"
+			"work generator.\n\n"
+			"OPTIONS:\n"
+			"-i id       job id (default: current time)\n"
+			"-t url      tracker (default: udp://boinc.rnl.ist.utl.pt:6969)\n"
+			"-d count    replicas of each map task (default 3), used to\n"
+			"            choose the piece size\n"
+			"-j threads  staging threads (default: one per core)\n"
+			"-s percent  reduce slow-start (default 100)\n"
+			"-w weight   job weight (default 1)\n"
+			"-a id       run after job 'id' (may be repeated)\n"
+			"-p dir      directory of the map inputs (default /tmp)\n"
+			"-u dir      directory of the task outputs (default /tmp)\n"
+			"-x file     jobtracker file (default /tmp/jobtracker.xml)\n",
+			name);
+}
+
+int main(int argc, char* argv[]) {
+	Submission s;
+	char buf[32];
+	int nmaps, nthreads = 0;
+
+	if (argc < 4) {
+		usage(argv[0]);
+		return 1;
+	}
+	nmaps = atoi(argv[1]);
+	s.nreds = atoi(argv[2]);
+	s.input = argv[3];
+	sprintf(buf, "%ld", (long)time(NULL));
+	s.id = buf;
+	s.pre_stage_dir = "/tmp";
+	s.upload_dir = "/tmp";
+	s.jobtracker = "/tmp/jobtracker.xml";
+	s.replication = 3;
+	s.slowstart = 100;
+	s.weight = 1;
+
+	/* Command line processing */
+	for(int arg_index = 4; arg_index < argc; arg_index++) {
+		if (arg_index + 1 >= argc || argv[arg_index][0] != '-') {
+			usage(argv[0]);
+			return 1;
+		}
+		if (!strcmp(argv[arg_index], "-i")) { s.id = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-t")) { s.trackers.push_back(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-d")) { s.replication = atoi(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-j")) { nthreads = atoi(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-s")) { s.slowstart = atoi(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-w")) { s.weight = atoi(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-a")) { s.after.push_back(argv[++arg_index]); }
+		else if (!strcmp(argv[arg_index], "-p")) { s.pre_stage_dir = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-u")) { s.upload_dir = argv[++arg_index]; }
+		else if (!strcmp(argv[arg_index], "-x")) { s.jobtracker = argv[++arg_index]; }
+		else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (nmaps < 1 || s.nreds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (s.trackers.empty()) { s.trackers.push_back("udp://boinc.rnl.ist.utl.pt:6969"); }
+
+	if (choose_splits(s, nmaps)) { return 1; }
+	if ((int)s.bounds.size() - 1 < nmaps) {
+		fprintf(stderr,
+				"%s has too few records for %d splits, the job has %lu map tasks\n",
+				s.input.c_str(),
+				nmaps,
+				(unsigned long)s.bounds.size() - 1);
+	}
+	if (stage(s, nthreads)) { return 1; }
+	if (register_job(s)) { return 1; }
+	printf("%s\n", s.id.c_str());
+	return 0;
+}